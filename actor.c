@@ -0,0 +1,197 @@
+#include "actor.h"
+
+/* The payload of the message that stops an actor. */
+static char tpActorPoison;
+
+void tpRunActor(void* actor);
+int tpActorPush(TPActor* actor, void* payload);
+tp_actor_message* tpActorPop(TPActor* actor);
+
+/***
+ * Create an Actor:
+ * An actor handles the messages sent to it one at a time, in order, on the
+ * pool. Its mailbox is a lock-free queue senders push to with a single
+ * atomic swap. The actor takes a worker only while it has messages, and
+ * then handles up to batchSize of them before letting other tasks run,
+ * keeping its state in that worker's cache. Its activations have affinity
+ * to the actor, so they tend to run on the same worker.
+ * @param threadPool The Thread Pool to run the actor on.
+ * @param receiveFunc Handles a message, given the actor, the message and state.
+ * @param state The actor's state.
+ * @param batchSize The most messages handled per activation, 0 for the default.
+ * @return A pointer to the new Actor, or NULL if failed.
+ */
+TPActor* tpActorCreate(ThreadPool* threadPool, void (*receiveFunc)(TPActor* actor, void* message, void* state),
+                       void* state, int batchSize) {
+
+    if (threadPool == NULL || receiveFunc == NULL || batchSize < 0) {
+        fprintf(stderr, "Bad arguments for ActorCreate.\n");
+        return NULL;
+    }
+
+    TPActor* actor = aligned_alloc(64, (sizeof(TPActor) + 63) & ~(size_t) 63);
+    if (actor == NULL) {
+        fprintf(stderr, "Cannot allocate memory for actor.\n");
+        return NULL;
+    }
+    actor->pool = threadPool;
+    actor->receiveFunc = receiveFunc;
+    actor->stopFunc = NULL;
+    actor->state = state;
+    actor->batchSize = batchSize == 0 ? TP_DEFAULT_ACTOR_BATCH_SIZE : batchSize;
+    atomic_init(&actor->numOfMessages, 0);
+    atomic_init(&actor->stub.next, NULL);
+    actor->stub.payload = NULL;
+    actor->head = &actor->stub;
+    atomic_init(&actor->tail, &actor->stub);
+
+    return actor;
+}
+
+/***
+ * Send a message to an Actor, from any thread.
+ * @param actor The Actor, not stopped.
+ * @param message The message.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpActorSend(TPActor* actor, void* message) {
+
+    if (actor == NULL) {
+        fprintf(stderr, "Bad arguments for ActorSend.\n");
+        return TP_FAILURE;
+    }
+
+    return tpActorPush(actor, message);
+}
+
+/***
+ * Stop an Actor once it handled the messages sent before:
+ * then stopFunc runs on the pool, e.g. to free state, and the actor is freed.
+ * No messages may be sent to it after this.
+ * @param actor The Actor.
+ * @param stopFunc Optional, run with the actor and its state.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpActorStop(TPActor* actor, void (*stopFunc)(TPActor* actor, void* state)) {
+
+    if (actor == NULL) {
+        fprintf(stderr, "Bad arguments for ActorStop.\n");
+        return TP_FAILURE;
+    }
+
+    /* Only the activation reads it, after taking the poison message that follows. */
+    actor->stopFunc = stopFunc;
+
+    return tpActorPush(actor, &tpActorPoison);
+}
+
+/***
+ * An activation of an actor: handle up to a batch of messages, then
+ * queue another activation if messages are left.
+ * @param actor The Actor.
+ */
+void tpRunActor(void* actor) {
+
+    TPActor* self = (TPActor*) actor;
+    int numOfHandled = 0;
+
+    while (numOfHandled < self->batchSize) {
+        tp_actor_message* message = tpActorPop(self);
+        if (message == NULL) {
+            break;
+        }
+        numOfHandled++;
+
+        void* payload = message->payload;
+        free(message);
+        if (payload == &tpActorPoison) {
+            if (self->stopFunc != NULL) {
+                (*(self->stopFunc))(self, self->state);
+            }
+            free(self);
+            return;
+        }
+        (*(self->receiveFunc))(self, payload, self->state);
+    }
+
+    /*
+     * Past this point the actor is only touched if messages are left: a send
+     * seeing the count at 0 queues the next activation itself. A send that
+     * is half done counts as left, and is picked up by the next activation.
+     */
+    if (atomic_fetch_sub(&self->numOfMessages, numOfHandled) - numOfHandled > 0) {
+        if (tpInsertTaskWithAffinity(self->pool, (uint64_t) (uintptr_t) self, tpRunActor, self) != TASK_INSERT_SUCCESS) {
+            tpRunActor(self);
+        }
+    }
+}
+
+/***
+ * Add a message to an actor's mailbox, and queue an activation if the actor is idle.
+ * @param actor The Actor.
+ * @param payload The message.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpActorPush(TPActor* actor, void* payload) {
+
+    tp_actor_message* message = malloc(sizeof(tp_actor_message));
+    if (message == NULL) {
+        fprintf(stderr, "Cannot allocate memory for message.\n");
+        return TP_FAILURE;
+    }
+    message->payload = payload;
+    atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+
+    /* Counted before it is visible, so an activation never handles more than it counted. */
+    bool isIdle = atomic_fetch_add(&actor->numOfMessages, 1) == 0;
+    tp_actor_message* previous = atomic_exchange_explicit(&actor->tail, message, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, message, memory_order_release);
+
+    if (isIdle && tpInsertTaskWithAffinity(actor->pool, (uint64_t) (uintptr_t) actor, tpRunActor, actor)
+                  != TASK_INSERT_SUCCESS) {
+        tpRunActor(actor);
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Take the oldest message from an actor's mailbox.
+ * Only the running activation may call this.
+ * @param actor The Actor.
+ * @return The message, or NULL if the mailbox is empty or a send is half done.
+ */
+tp_actor_message* tpActorPop(TPActor* actor) {
+
+    tp_actor_message* head = actor->head;
+    tp_actor_message* next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+    if (head == &actor->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        actor->head = next;
+        head = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        actor->head = next;
+        return head;
+    }
+
+    /* head is the last message: put the stub behind it, so it can be taken. */
+    if (head != atomic_load_explicit(&actor->tail, memory_order_acquire)) {
+        return NULL;
+    }
+    atomic_store_explicit(&actor->stub.next, NULL, memory_order_relaxed);
+    tp_actor_message* previous = atomic_exchange_explicit(&actor->tail, &actor->stub, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, &actor->stub, memory_order_release);
+
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next != NULL) {
+        actor->head = next;
+        return head;
+    }
+
+    return NULL;
+}
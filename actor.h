@@ -0,0 +1,42 @@
+#ifndef __ACTOR__
+#define __ACTOR__
+
+#include "threadPool.h"
+#include <stdatomic.h>
+
+/* The default number of messages an actor handles per activation. */
+#define TP_DEFAULT_ACTOR_BATCH_SIZE 32
+
+/// Actor Message struct.
+
+typedef struct tp_actor_message
+{
+    _Atomic(struct tp_actor_message*) next; /* The next message in the mailbox. */
+    void* payload;               /* The message. */
+
+}tp_actor_message;
+
+/// Actor struct.
+
+typedef struct tp_actor
+{
+    ThreadPool* pool;            /* The Thread Pool the actor runs on. */
+    void (*receiveFunc)(struct tp_actor* actor, void* message, void* state); /* Handles a message. */
+    void (*stopFunc)(struct tp_actor* actor, void* state); /* Optional, run once the last message is handled. */
+    void* state;                 /* The actor's own state, only touched by its handlers. */
+    int batchSize;               /* The most messages handled per activation. */
+    atomic_int numOfMessages;    /* The messages sent and not yet handled, an activation is due while > 0. */
+    tp_actor_message* head;      /* The oldest message, only touched by the running activation. */
+    tp_actor_message stub;       /* Keeps the mailbox non-empty, so senders never touch head. */
+    _Alignas(64) _Atomic(tp_actor_message*) tail; /* The newest message, swapped by senders. */
+
+}TPActor;
+
+TPActor* tpActorCreate(ThreadPool* threadPool, void (*receiveFunc)(TPActor* actor, void* message, void* state),
+                       void* state, int batchSize);
+
+int tpActorSend(TPActor* actor, void* message);
+
+int tpActorStop(TPActor* actor, void (*stopFunc)(TPActor* actor, void* state));
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Benchmark of tpProcessMappedFile: counts the records of a large file,
+ * once on the calling thread and once in parallel chunks on a pool.
+ *
+ * Build: make bench from the top directory, or from this directory,
+ *        with the pool sources in the parent directory,
+ *        gcc -O2 -I.. mmapChunksBench.c ../[a-z]*.c -o mmapChunksBench -lpthread
+ * Run:   ./mmapChunksBench <file> [threads] [chunk MiB] [MiB to generate if file is missing]
+ */
+#include "../mmapChunks.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+atomic_long numOfRecords;
+
+double nowSeconds(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+long countRecords(const char* data, size_t length) {
+
+    long count = 0;
+    const char* end = data + length;
+    while ((data = memchr(data, '\n', (size_t) (end - data))) != NULL) {
+        count++;
+        data++;
+    }
+    return count;
+}
+
+void countChunk(const char* data, size_t length, size_t chunkIndex, void* arg) {
+
+    (void) chunkIndex;
+    (void) arg;
+    atomic_fetch_add(&numOfRecords, countRecords(data, length));
+}
+
+void serialChunk(const char* data, size_t length, size_t chunkIndex, void* arg) {
+
+    (void) chunkIndex;
+    *(long*) arg += countRecords(data, length);
+}
+
+int generate(const char* path, long megabytes) {
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    long bytes = 0;
+    for (long i = 0; bytes < megabytes * 1024 * 1024; ++i) {
+        bytes += fprintf(file, "%ld,record-%ld,%ld\n", i, i * 7919, i % 1000);
+    }
+    return fclose(file);
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [threads] [chunk MiB] [MiB to generate]\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[1];
+    int numOfThreads = argc > 2 ? atoi(argv[2]) : 4;
+    size_t chunkSize = (size_t) (argc > 3 ? atol(argv[3]) : 4) * 1024 * 1024;
+    long megabytes = argc > 4 ? atol(argv[4]) : 1024;
+
+    struct stat status;
+    if (stat(path, &status) != 0 && generate(path, megabytes) != 0) {
+        fprintf(stderr, "Cannot create %s.\n", path);
+        return 1;
+    }
+
+    /* One pool worker, one chunk: the whole file on a single thread. */
+    ThreadPool* serialPool = tpCreate(1);
+    long serialRecords = 0;
+    double start = nowSeconds();
+    tpProcessMappedFile(serialPool, path, SIZE_MAX / 2, '\n', serialChunk, &serialRecords);
+    double serialSeconds = nowSeconds() - start;
+    tpDestroy(serialPool, 1);
+
+    ThreadPool* threadPool = tpCreate(numOfThreads);
+    start = nowSeconds();
+    long numOfChunks = tpProcessMappedFile(threadPool, path, chunkSize, '\n', countChunk, NULL);
+    double parallelSeconds = nowSeconds() - start;
+    tpDestroy(threadPool, 1);
+
+    stat(path, &status);
+    double megabytesRead = (double) status.st_size / (1024 * 1024);
+    printf("serial:   %ld records, %.3f s, %.1f MiB/s\n", serialRecords, serialSeconds, megabytesRead / serialSeconds);
+    printf("parallel: %ld records, %ld chunks, %d threads, %.3f s, %.1f MiB/s\n", atomic_load(&numOfRecords),
+           numOfChunks, numOfThreads, parallelSeconds, megabytesRead / parallelSeconds);
+
+    return serialRecords == atomic_load(&numOfRecords) ? 0 : 1;
+}
@@ -0,0 +1,371 @@
+#include "channel.h"
+#include "fiber.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* The timeout of the operations that wait as long as it takes. */
+#define TP_CHANNEL_FOREVER (-1L)
+
+int tpChannelTransfer(TPChannel* channel, void* element, bool isSend, long timeoutNs);
+TPFiber* tpChannelWakeOne(TPChannel* channel, bool isSender);
+tp_channel_waiter* tpChannelTakeWaiters(tp_channel_waiters* waiters);
+void tpChannelResumeWaiters(tp_channel_waiter* waiter);
+void tpChannelRemoveWaiter(tp_channel_waiters* waiters, tp_channel_waiter* waiter);
+
+/***
+ * Create a Channel:
+ * A bounded queue of fixed size elements, copied in and out, that any
+ * number of threads or tasks send to and receive from. An operation that
+ * cannot go on waits: a fiber task suspends, giving its worker to other
+ * tasks, and other tasks wait in a blocking region, see tpBlockingBegin,
+ * so a spare worker can take over their worker's share.
+ * @param elementSize The size of an element.
+ * @param capacity The most elements the channel holds.
+ * @return A pointer to the new Channel, or NULL if failed.
+ */
+TPChannel* tpChannelCreate(size_t elementSize, int capacity) {
+
+    if (elementSize == 0 || capacity <= 0) {
+        fprintf(stderr, "Bad arguments for ChannelCreate.\n");
+        return NULL;
+    }
+
+    TPChannel* channel = malloc(sizeof(TPChannel));
+    if (channel == NULL) {
+        fprintf(stderr, "Cannot allocate memory for channel.\n");
+        return NULL;
+    }
+    if ((channel->elements = malloc(elementSize * capacity)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for elements.\n");
+        free(channel);
+        return NULL;
+    }
+    channel->elementSize = elementSize;
+    channel->capacity = capacity;
+    channel->head = 0;
+    channel->count = 0;
+    channel->isClosed = false;
+    channel->numOfSenders = 0;
+    channel->numOfReceivers = 0;
+    channel->senderFibers.head = NULL;
+    channel->senderFibers.tail = NULL;
+    channel->receiverFibers.head = NULL;
+    channel->receiverFibers.tail = NULL;
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&channel->mutex, NULL);
+    pthread_cond_init(&channel->notFull, &attributes);
+    pthread_cond_init(&channel->notEmpty, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    return channel;
+}
+
+/***
+ * Send an element, waiting while the channel is full.
+ * @param channel The Channel.
+ * @param element The element to copy in.
+ * @return 0 if sent, TP_CHANNEL_CLOSED if the channel is closed, or -1 if failed.
+ */
+int tpChannelSend(TPChannel* channel, const void* element) {
+
+    return tpChannelTransfer(channel, (void*) element, true, TP_CHANNEL_FOREVER);
+}
+
+/***
+ * Send an element if the channel is not full.
+ * @param channel The Channel.
+ * @param element The element to copy in.
+ * @return 0 if sent, TP_CHANNEL_WOULD_BLOCK if full, TP_CHANNEL_CLOSED if closed, or -1 if failed.
+ */
+int tpChannelTrySend(TPChannel* channel, const void* element) {
+
+    return tpChannelTransfer(channel, (void*) element, true, 0);
+}
+
+/***
+ * Send an element, waiting at most a timeout while the channel is full.
+ * A fiber task waits as a plain task here, keeping its worker in a blocking region.
+ * @param channel The Channel.
+ * @param element The element to copy in.
+ * @param timeoutNs The most nanoseconds to wait.
+ * @return 0 if sent, TP_CHANNEL_WOULD_BLOCK if timed out, TP_CHANNEL_CLOSED if closed, or -1 if failed.
+ */
+int tpChannelTimedSend(TPChannel* channel, const void* element, long timeoutNs) {
+
+    return tpChannelTransfer(channel, (void*) element, true, timeoutNs < 0 ? 0 : timeoutNs);
+}
+
+/***
+ * Receive an element, waiting while the channel is empty.
+ * @param channel The Channel.
+ * @param element Where to copy the element.
+ * @return 0 if received, TP_CHANNEL_CLOSED if the channel is closed and empty, or -1 if failed.
+ */
+int tpChannelRecv(TPChannel* channel, void* element) {
+
+    return tpChannelTransfer(channel, element, false, TP_CHANNEL_FOREVER);
+}
+
+/***
+ * Receive an element if the channel is not empty.
+ * @param channel The Channel.
+ * @param element Where to copy the element.
+ * @return 0 if received, TP_CHANNEL_WOULD_BLOCK if empty, TP_CHANNEL_CLOSED if closed and empty, or -1 if failed.
+ */
+int tpChannelTryRecv(TPChannel* channel, void* element) {
+
+    return tpChannelTransfer(channel, element, false, 0);
+}
+
+/***
+ * Receive an element, waiting at most a timeout while the channel is empty.
+ * A fiber task waits as a plain task here, keeping its worker in a blocking region.
+ * @param channel The Channel.
+ * @param element Where to copy the element.
+ * @param timeoutNs The most nanoseconds to wait.
+ * @return 0 if received, TP_CHANNEL_WOULD_BLOCK if timed out, TP_CHANNEL_CLOSED if closed and empty, or -1 if failed.
+ */
+int tpChannelTimedRecv(TPChannel* channel, void* element, long timeoutNs) {
+
+    return tpChannelTransfer(channel, element, false, timeoutNs < 0 ? 0 : timeoutNs);
+}
+
+/***
+ * Close a Channel: sends fail from now on, and receives fail once the
+ * elements left are received. Everyone waiting is woken.
+ * @param channel The Channel.
+ */
+void tpChannelClose(TPChannel* channel) {
+
+    if (channel == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&channel->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    channel->isClosed = true;
+    pthread_cond_broadcast(&channel->notFull);
+    pthread_cond_broadcast(&channel->notEmpty);
+    tp_channel_waiter* senders = tpChannelTakeWaiters(&channel->senderFibers);
+    tp_channel_waiter* receivers = tpChannelTakeWaiters(&channel->receiverFibers);
+    if (pthread_mutex_unlock(&channel->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    /* Resumed without the lock, a fiber that can not be queued runs right here. */
+    tpChannelResumeWaiters(senders);
+    tpChannelResumeWaiters(receivers);
+}
+
+/***
+ * Free a Channel no one uses anymore, with the elements left in it.
+ * @param channel The Channel.
+ */
+void tpChannelDestroy(TPChannel* channel) {
+
+    if (channel == NULL) {
+        return;
+    }
+
+    pthread_cond_destroy(&channel->notEmpty);
+    pthread_cond_destroy(&channel->notFull);
+    pthread_mutex_destroy(&channel->mutex);
+    free(channel->elements);
+    free(channel);
+}
+
+/***
+ * Send or receive an element, waiting as needed.
+ * @param channel The Channel.
+ * @param element The element to copy in, or where to copy it out.
+ * @param isSend Is it a send?
+ * @param timeoutNs The most nanoseconds to wait, 0 to not wait, TP_CHANNEL_FOREVER to wait as long as it takes.
+ * @return 0 if worked, TP_CHANNEL_CLOSED, TP_CHANNEL_WOULD_BLOCK, or -1 if failed.
+ */
+int tpChannelTransfer(TPChannel* channel, void* element, bool isSend, long timeoutNs) {
+
+    if (channel == NULL || element == NULL) {
+        fprintf(stderr, "Bad arguments for channel operation.\n");
+        return TP_FAILURE;
+    }
+
+    TPFiber* fiber = timeoutNs == TP_CHANNEL_FOREVER ? tpCurrentFiber() : NULL;
+    TPFiber* wokenFiber = NULL;
+    bool isBlocking = false;
+    struct timespec deadline;
+    if (timeoutNs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (deadline.tv_nsec + timeoutNs) / 1000000000L;
+        deadline.tv_nsec = (deadline.tv_nsec + timeoutNs) % 1000000000L;
+    }
+
+    if (pthread_mutex_lock(&channel->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    int result = TP_SUCCESS;
+    while (!channel->isClosed && (isSend ? channel->count == channel->capacity : channel->count == 0)) {
+        if (timeoutNs == 0) {
+            result = TP_CHANNEL_WOULD_BLOCK;
+            break;
+        }
+
+        if (fiber != NULL) {
+            /* Suspend at the tail until a receiver or sender resumes us, then take our waiter out if it was an early return. */
+            tp_channel_waiter self = {fiber, NULL};
+            tp_channel_waiters* waiters = isSend ? &channel->senderFibers : &channel->receiverFibers;
+            if (waiters->tail != NULL) {
+                waiters->tail->next = &self;
+            } else {
+                waiters->head = &self;
+            }
+            waiters->tail = &self;
+            if (pthread_mutex_unlock(&channel->mutex) != 0) {
+                fprintf(stderr, "Error in system call\n");
+            }
+            tpFiberSuspend();
+            if (pthread_mutex_lock(&channel->mutex) != 0) {
+                fprintf(stderr, "Error in system call\n");
+            }
+            tpChannelRemoveWaiter(waiters, &self);
+            continue;
+        }
+
+        if (!isBlocking) {
+            isBlocking = true;
+            tpBlockingBegin();
+        }
+        int error;
+        if (isSend) {
+            channel->numOfSenders++;
+            error = timeoutNs > 0 ? pthread_cond_timedwait(&channel->notFull, &channel->mutex, &deadline)
+                                  : pthread_cond_wait(&channel->notFull, &channel->mutex);
+            channel->numOfSenders--;
+        } else {
+            channel->numOfReceivers++;
+            error = timeoutNs > 0 ? pthread_cond_timedwait(&channel->notEmpty, &channel->mutex, &deadline)
+                                  : pthread_cond_wait(&channel->notEmpty, &channel->mutex);
+            channel->numOfReceivers--;
+        }
+        if (error == ETIMEDOUT && !channel->isClosed
+            && (isSend ? channel->count == channel->capacity : channel->count == 0)) {
+            result = TP_CHANNEL_WOULD_BLOCK;
+            break;
+        }
+    }
+
+    if (result == TP_SUCCESS) {
+        if (isSend && channel->isClosed) {
+            result = TP_CHANNEL_CLOSED;
+        } else if (isSend) {
+            int tail = (channel->head + channel->count) % channel->capacity;
+            memcpy(channel->elements + (size_t) tail * channel->elementSize, element, channel->elementSize);
+            channel->count++;
+            wokenFiber = tpChannelWakeOne(channel, false);
+        } else if (channel->count == 0) {
+            result = TP_CHANNEL_CLOSED;
+        } else {
+            memcpy(element, channel->elements + (size_t) channel->head * channel->elementSize, channel->elementSize);
+            channel->head = (channel->head + 1) % channel->capacity;
+            channel->count--;
+            wokenFiber = tpChannelWakeOne(channel, true);
+        }
+    }
+
+    if (pthread_mutex_unlock(&channel->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (isBlocking) {
+        tpBlockingEnd();
+    }
+    if (wokenFiber != NULL) {
+        tpFiberResume(wokenFiber);
+    }
+
+    return result;
+}
+
+/***
+ * Wake one waiting sender or receiver, the earliest suspended fiber task first.
+ * A fiber is only taken off its list here, the caller resumes it once the
+ * Channel's mutex is unlocked: if it can not be queued it runs on the
+ * caller's thread, and would lock the mutex again.
+ * The Channel's mutex must be locked.
+ * @param channel The Channel.
+ * @param isSender Wake a sender, not a receiver?
+ * @return The fiber to resume, or NULL if none.
+ */
+TPFiber* tpChannelWakeOne(TPChannel* channel, bool isSender) {
+
+    tp_channel_waiters* waiters = isSender ? &channel->senderFibers : &channel->receiverFibers;
+    if (waiters->head != NULL) {
+        tp_channel_waiter* waiter = waiters->head;
+        tpChannelRemoveWaiter(waiters, waiter);
+        return waiter->fiber;
+    }
+    if (isSender ? channel->numOfSenders > 0 : channel->numOfReceivers > 0) {
+        pthread_cond_signal(isSender ? &channel->notFull : &channel->notEmpty);
+    }
+
+    return NULL;
+}
+
+/***
+ * Take all the suspended fiber tasks off a list, to resume them with
+ * tpChannelResumeWaiters once the Channel's mutex is unlocked.
+ * The Channel's mutex must be locked.
+ * @param waiters The list.
+ * @return The waiters, in order.
+ */
+tp_channel_waiter* tpChannelTakeWaiters(tp_channel_waiters* waiters) {
+
+    tp_channel_waiter* waiter = waiters->head;
+    waiters->head = NULL;
+    waiters->tail = NULL;
+
+    return waiter;
+}
+
+/***
+ * Resume the fiber tasks taken off a list, in order.
+ * @param waiter The first waiter.
+ */
+void tpChannelResumeWaiters(tp_channel_waiter* waiter) {
+
+    while (waiter != NULL) {
+        /* The waiter lives on its fiber's stack, done with once the fiber runs. */
+        tp_channel_waiter* next = waiter->next;
+        tpFiberResume(waiter->fiber);
+        waiter = next;
+    }
+}
+
+/***
+ * Take a waiter off a list, if it is still there.
+ * The Channel's mutex must be locked.
+ * @param waiters The list.
+ * @param waiter The waiter.
+ */
+void tpChannelRemoveWaiter(tp_channel_waiters* waiters, tp_channel_waiter* waiter) {
+
+    tp_channel_waiter* previous = NULL;
+    for (tp_channel_waiter* current = waiters->head; current != NULL; current = current->next) {
+        if (current == waiter) {
+            if (previous != NULL) {
+                previous->next = current->next;
+            } else {
+                waiters->head = current->next;
+            }
+            if (waiters->tail == current) {
+                waiters->tail = previous;
+            }
+            return;
+        }
+        previous = current;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef __CHANNEL__
+#define __CHANNEL__
+
+#include "threadPool.h"
+
+/* Returned by channel operations when the channel is closed, for a receive only once it is drained too. */
+#define TP_CHANNEL_CLOSED (-2)
+
+/* Returned by the try and timed channel operations when they would block or timed out. */
+#define TP_CHANNEL_WOULD_BLOCK (-3)
+
+/// Channel Waiter struct.
+
+typedef struct tp_channel_waiter
+{
+    struct tp_fiber* fiber;      /* The fiber task suspended on the channel. */
+    struct tp_channel_waiter* next; /* The next waiter. */
+
+}tp_channel_waiter;
+
+/// Channel Waiters struct.
+
+typedef struct tp_channel_waiters
+{
+    tp_channel_waiter* head;     /* The earliest waiter, woken first. */
+    tp_channel_waiter* tail;     /* The latest waiter. */
+
+}tp_channel_waiters;
+
+/// Channel struct.
+
+typedef struct tp_channel
+{
+    unsigned char* elements;     /* The ring of elements. */
+    size_t elementSize;          /* The size of an element. */
+    int capacity;                /* The most elements in the ring. */
+    int head;                    /* The oldest element. */
+    int count;                   /* The number of elements in the ring. */
+    bool isClosed;               /* Was the channel closed? */
+    pthread_mutex_t mutex;       /* The mutex for the channel. */
+    pthread_cond_t notFull;      /* Signalled for a thread waiting to send. */
+    pthread_cond_t notEmpty;     /* Signalled for a thread waiting to receive. */
+    int numOfSenders;            /* The number of threads waiting on notFull. */
+    int numOfReceivers;          /* The number of threads waiting on notEmpty. */
+    tp_channel_waiters senderFibers; /* The fiber tasks suspended to send, in order. */
+    tp_channel_waiters receiverFibers; /* The fiber tasks suspended to receive, in order. */
+
+}TPChannel;
+
+TPChannel* tpChannelCreate(size_t elementSize, int capacity);
+
+int tpChannelSend(TPChannel* channel, const void* element);
+
+int tpChannelTrySend(TPChannel* channel, const void* element);
+
+int tpChannelTimedSend(TPChannel* channel, const void* element, long timeoutNs);
+
+int tpChannelRecv(TPChannel* channel, void* element);
+
+int tpChannelTryRecv(TPChannel* channel, void* element);
+
+int tpChannelTimedRecv(TPChannel* channel, void* element, long timeoutNs);
+
+void tpChannelClose(TPChannel* channel);
+
+void tpChannelDestroy(TPChannel* channel);
+
+#endif
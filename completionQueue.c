@@ -0,0 +1,324 @@
+#include "completionQueue.h"
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/// Completion Task struct.
+
+typedef struct tp_completion_task
+{
+    TPCompletionQueue* queue;    /* Where to post the completion. */
+    int (*computeFunc)(void *, void **); /* The task. */
+    void* parameters;            /* The parameters to the task. */
+    void* userData;              /* Posted with the result. */
+    uint64_t taskId;             /* Posted with the result. */
+
+}tp_completion_task;
+
+void tpRunCompletionTask(void* task);
+void tpCompletionQueuePost(TPCompletionQueue* queue, const TPCompletion* completion);
+bool tpCompletionQueueTake(TPCompletionQueue* queue, TPCompletion* completion);
+void tpCompletionQueueSignal(TPCompletionQueue* queue);
+
+/***
+ * Create a new Completion Queue:
+ * Tasks inserted with tpInsertTaskWithCompletion post a record of their id,
+ * status and result to the queue's ring when done, and harvesters take
+ * records from it in bulk, neither side taking a lock. The ring is bounded;
+ * if it is full, records spill to a locked overflow list, and nothing is lost.
+ * The queue's eventfd becomes readable with the first completion after a
+ * harvest emptied the queue, so an event loop can poll for completions.
+ * @param capacity The number of records the ring holds, rounded up to a power of two, 0 for the default.
+ * @return A pointer to the new Completion Queue, or NULL if failed.
+ */
+TPCompletionQueue* tpCompletionQueueCreate(int capacity) {
+
+    if (capacity < 0) {
+        fprintf(stderr, "Bad arguments for CompletionQueueCreate.\n");
+        return NULL;
+    }
+    size_t size = 2;
+    while (size < (size_t) (capacity == 0 ? TP_DEFAULT_COMPLETION_QUEUE_CAPACITY : capacity)) {
+        size *= 2;
+    }
+
+    TPCompletionQueue* queue = aligned_alloc(64, (sizeof(TPCompletionQueue) + 63) & ~(size_t) 63);
+    if (queue == NULL) {
+        fprintf(stderr, "Cannot allocate memory for completion queue.\n");
+        return NULL;
+    }
+    if ((queue->cells = malloc(sizeof(tp_completion_cell) * size)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for completions.\n");
+        free(queue);
+        return NULL;
+    }
+    if ((queue->overflow = osCreateQueue()) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for queue.\n");
+        free(queue->cells);
+        free(queue);
+        return NULL;
+    }
+    if ((queue->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        fprintf(stderr, "Error in system call\n");
+        osDestroyQueue(queue->overflow);
+        free(queue->cells);
+        free(queue);
+        return NULL;
+    }
+
+    /* A cell is free for the post with the same sequence number as its index. */
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->nextTaskId, 1);
+    atomic_init(&queue->overflowCount, 0);
+    atomic_init(&queue->isSignalled, false);
+    pthread_mutex_init(&queue->mutexOverflow, NULL);
+
+    return queue;
+}
+
+/***
+ * Free a Completion Queue. No task may still post to it.
+ * @param queue The Completion Queue.
+ */
+void tpCompletionQueueDestroy(TPCompletionQueue* queue) {
+
+    if (queue == NULL) {
+        return;
+    }
+
+    while (!osIsQueueEmpty(queue->overflow)) {
+        free(osDequeue(queue->overflow));
+    }
+    osDestroyQueue(queue->overflow);
+    pthread_mutex_destroy(&queue->mutexOverflow);
+    close(queue->eventFd);
+    free(queue->cells);
+    free(queue);
+}
+
+/***
+ * Get the fd to poll for completions, e.g. with epoll for EPOLLIN.
+ * @param queue The Completion Queue.
+ * @return The eventfd of the queue.
+ */
+int tpCompletionQueueFd(TPCompletionQueue* queue) {
+
+    return queue->eventFd;
+}
+
+/***
+ * Take finished tasks' completions out of the queue, without blocking.
+ * The eventfd stays readable while completions are left, so harvest until
+ * this returns fewer than maxCompletions, or poll again.
+ * @param queue The Completion Queue.
+ * @param completions Where to write the completions.
+ * @param maxCompletions The most completions to take.
+ * @return The number of completions written, or -1 if failed.
+ */
+int tpCompletionQueueHarvest(TPCompletionQueue* queue, TPCompletion* completions, int maxCompletions) {
+
+    if (queue == NULL || completions == NULL || maxCompletions < 0) {
+        fprintf(stderr, "Bad arguments for CompletionQueueHarvest.\n");
+        return TP_FAILURE;
+    }
+
+    int numOfCompletions = 0;
+    while (numOfCompletions < maxCompletions && tpCompletionQueueTake(queue, &completions[numOfCompletions])) {
+        numOfCompletions++;
+    }
+
+    /* The queue looks empty: re-arm the eventfd, then look again for posts that raced with us. */
+    if (numOfCompletions < maxCompletions && atomic_load(&queue->isSignalled)) {
+        uint64_t value;
+        if (read(queue->eventFd, &value, sizeof(value)) < 0) {
+            /* Another harvester reset it already. */
+        }
+        atomic_store(&queue->isSignalled, false);
+        /* Order the store before the loads below, pairs with the fence in tpCompletionQueueSignal. */
+        atomic_thread_fence(memory_order_seq_cst);
+        while (numOfCompletions < maxCompletions && tpCompletionQueueTake(queue, &completions[numOfCompletions])) {
+            numOfCompletions++;
+        }
+        if (numOfCompletions == maxCompletions) {
+            tpCompletionQueueSignal(queue);
+        }
+    }
+
+    return numOfCompletions;
+}
+
+/***
+ * Add a task that posts a completion record to a Completion Queue when done.
+ * @param threadPool The Thread Pool to do the task.
+ * @param queue The Completion Queue to post to.
+ * @param computeFunc The task, returning its status and writing its result.
+ * @param param The parameters to the task.
+ * @param userData Posted with the result, to tell the task apart.
+ * @param taskId Where to write the id of the task, may be NULL.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertTaskWithCompletion(ThreadPool* threadPool, TPCompletionQueue* queue,
+                               int (*computeFunc) (void* param, void** result), void* param,
+                               void* userData, uint64_t* taskId) {
+
+    if (queue == NULL || computeFunc == NULL) {
+        fprintf(stderr, "Bad arguments for InsertTaskWithCompletion.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    tp_completion_task* task = malloc(sizeof(tp_completion_task));
+    if (task == NULL) {
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    task->queue = queue;
+    task->computeFunc = computeFunc;
+    task->parameters = param;
+    task->userData = userData;
+    task->taskId = atomic_fetch_add_explicit(&queue->nextTaskId, 1, memory_order_relaxed);
+    if (taskId != NULL) {
+        *taskId = task->taskId;
+    }
+
+    if (tpInsertTask(threadPool, tpRunCompletionTask, task) != TASK_INSERT_SUCCESS) {
+        free(task);
+        return TASK_INSERT_FAILURE;
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Run a task and post its completion.
+ * @param task The completion task.
+ */
+void tpRunCompletionTask(void* task) {
+
+    tp_completion_task* self = (tp_completion_task*) task;
+    TPCompletion completion;
+
+    completion.taskId = self->taskId;
+    completion.userData = self->userData;
+    completion.result = NULL;
+    completion.status = (*(self->computeFunc))(self->parameters, &completion.result);
+    tpCompletionQueuePost(self->queue, &completion);
+
+    free(self);
+}
+
+/***
+ * Add a completion to the ring, or to the overflow list if the ring is full,
+ * and signal the eventfd if it is the first since the last harvest.
+ * @param queue The Completion Queue.
+ * @param completion The completion.
+ */
+void tpCompletionQueuePost(TPCompletionQueue* queue, const TPCompletion* completion) {
+
+    size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (true) {
+        tp_completion_cell* cell = &queue->cells[position & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+        if (difference == 0) {
+            /* The cell is free, claim it. */
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->completion = *completion;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                break;
+            }
+        } else if (difference < 0) {
+            /* The ring is full, spill. */
+            TPCompletion* spilled = malloc(sizeof(TPCompletion));
+            if (spilled == NULL) {
+                fprintf(stderr, "Cannot allocate memory for completion, it is dropped.\n");
+                return;
+            }
+            *spilled = *completion;
+            pthread_mutex_lock(&queue->mutexOverflow);
+            osEnqueue(queue->overflow, spilled);
+            atomic_fetch_add(&queue->overflowCount, 1);
+            pthread_mutex_unlock(&queue->mutexOverflow);
+            break;
+        } else {
+            /* Another worker claimed this cell, try the next one. */
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+
+    tpCompletionQueueSignal(queue);
+}
+
+/***
+ * Take one completion from the ring, or from the overflow list once the ring is empty.
+ * @param queue The Completion Queue.
+ * @param completion Where to write the completion.
+ * @return true if a completion was taken, false if the queue is empty.
+ */
+bool tpCompletionQueueTake(TPCompletionQueue* queue, TPCompletion* completion) {
+
+    size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (true) {
+        tp_completion_cell* cell = &queue->cells[position & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+
+        if (difference == 0) {
+            /* The cell holds a completion, claim it and hand the cell back to the posters. */
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *completion = cell->completion;
+                atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            break;
+        } else {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+
+    /* The ring is empty, which is the usual case, and there is rarely an overflow. */
+    if (atomic_load(&queue->overflowCount) == 0) {
+        return false;
+    }
+    bool isTaken = false;
+    pthread_mutex_lock(&queue->mutexOverflow);
+    if (!osIsQueueEmpty(queue->overflow)) {
+        TPCompletion* spilled = osDequeue(queue->overflow);
+        atomic_fetch_sub(&queue->overflowCount, 1);
+        *completion = *spilled;
+        free(spilled);
+        isTaken = true;
+    }
+    pthread_mutex_unlock(&queue->mutexOverflow);
+
+    return isTaken;
+}
+
+/***
+ * Make the eventfd readable, unless it is already.
+ * @param queue The Completion Queue.
+ */
+void tpCompletionQueueSignal(TPCompletionQueue* queue) {
+
+    /*
+     * One eventfd write per batch, later completions ride along until the harvest.
+     * The fence orders publishing the completion before reading isSignalled: either
+     * we see the harvester's reset and signal, or its re-drain sees our completion.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&queue->isSignalled, memory_order_relaxed)
+        && !atomic_exchange(&queue->isSignalled, true)) {
+        uint64_t one = 1;
+        if (write(queue->eventFd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "Error in system call\n");
+        }
+    }
+}
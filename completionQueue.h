@@ -0,0 +1,62 @@
+#ifndef __COMPLETION_QUEUE__
+#define __COMPLETION_QUEUE__
+
+#include "threadPool.h"
+#include <stdatomic.h>
+
+/* The default number of completions the ring holds before posts spill to the overflow list. */
+#define TP_DEFAULT_COMPLETION_QUEUE_CAPACITY 4096
+
+/* The status a task reports when it succeeded. */
+#define TP_COMPLETION_OK 0
+
+/// Completion struct.
+
+typedef struct tp_completion
+{
+    uint64_t taskId;             /* The id the task got on insert. */
+    int status;                  /* What the task reported, TP_COMPLETION_OK or its own error code. */
+    void* userData;              /* Identifies the task to the harvester, as given on insert. */
+    void* result;                /* What the task produced. */
+
+}TPCompletion;
+
+/// Completion Queue Cell struct.
+
+typedef struct tp_completion_cell
+{
+    atomic_size_t sequence;      /* Tells producers and consumers whose turn the cell is. */
+    TPCompletion completion;
+
+}tp_completion_cell;
+
+/// Completion Queue struct.
+
+typedef struct tp_completion_queue
+{
+    tp_completion_cell* cells;   /* The ring of completions. */
+    size_t mask;                 /* The ring capacity - 1, the capacity is a power of two. */
+    _Alignas(64) atomic_size_t tail; /* The next cell to post to, claimed by workers. */
+    _Alignas(64) atomic_size_t head; /* The next cell to harvest, claimed by harvesters. */
+    _Alignas(64) atomic_uint_fast64_t nextTaskId; /* The id of the next task inserted. */
+    atomic_int overflowCount;    /* The number of completions in overflow. */
+    atomic_bool isSignalled;     /* Was eventFd written since the last harvest emptied the queue? */
+    int eventFd;                 /* Readable while there are completions to harvest. */
+    pthread_mutex_t mutexOverflow; /* The mutex for overflow. */
+    struct os_queue* overflow;   /* Completions posted while the ring was full. */
+
+}TPCompletionQueue;
+
+TPCompletionQueue* tpCompletionQueueCreate(int capacity);
+
+void tpCompletionQueueDestroy(TPCompletionQueue* queue);
+
+int tpCompletionQueueFd(TPCompletionQueue* queue);
+
+int tpCompletionQueueHarvest(TPCompletionQueue* queue, TPCompletion* completions, int maxCompletions);
+
+int tpInsertTaskWithCompletion(ThreadPool* threadPool, TPCompletionQueue* queue,
+                               int (*computeFunc) (void* param, void** result), void* param,
+                               void* userData, uint64_t* taskId);
+
+#endif
@@ -0,0 +1,396 @@
+#include "fiber.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The states of a fiber. A fiber is RUNNING while it runs or waits in the task queue. */
+#define TP_FIBER_RUNNING 0
+#define TP_FIBER_NOTIFIED 1      /* Running, and resumed before it suspended. */
+#define TP_FIBER_SUSPENDING 2    /* Switching back to its worker to be suspended. */
+#define TP_FIBER_RESUMED 3       /* Resumed while switching back to its worker. */
+#define TP_FIBER_SUSPENDED 4     /* Waiting for tpFiberResume. */
+
+/* Why a fiber switched back to its worker. */
+#define TP_FIBER_STOP_YIELD 0
+#define TP_FIBER_STOP_SUSPEND 1
+#define TP_FIBER_STOP_FINISH 2
+
+void tpFiberEntry(void);
+void tpFiberStop(TPFiber* fiber, int stopReason);
+bool tpRequeueFiber(TPFiber* fiber);
+TPFiber* tpAllocFiber(ThreadPool* threadPool);
+void tpReleaseFiber(TPFiber* fiber);
+void tpFreeFiber(TPFiber* fiber);
+
+/* The fiber the calling thread runs, NULL outside of any fiber. */
+static __thread TPFiber* tpRunningFiber = NULL;
+
+/***
+ * Add a task that runs on its own stack, as a fiber:
+ * A fiber task can give up its worker without blocking it, by tpYield or
+ * tpFiberSuspend, and continue later on any worker of the pool. Stacks come
+ * from a cache of finished fibers, so creating a fiber rarely allocates.
+ * Scratch memory, see tpScratchAlloc, does not survive giving up the worker.
+ * @param threadPool The Thread Pool to do the task.
+ * @param computeFunc The task.
+ * @param param The parameters to the task.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertFiberTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param) {
+
+    /* If Thread Pool is closing down or NULL is passed, FAIL. */
+    if (threadPool == NULL || computeFunc == NULL || tpRejectsInserts(threadPool)) {
+        fprintf(stderr, "Bad arguments for InsertFiberTask or ThreadPool is shutting down.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    TPFiber* fiber = tpAllocFiber(threadPool);
+    if (fiber == NULL) {
+        fprintf(stderr, "Cannot create fiber to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    fiber->computeFunc = computeFunc;
+    fiber->parameters = param;
+    fiber->tag = tpGetTaskTag();
+    atomic_store(&fiber->state, TP_FIBER_RUNNING);
+
+    /* Prepare the fiber to start at tpFiberEntry on its own stack. */
+    if (getcontext(&fiber->context) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        tpReleaseFiber(fiber);
+        return TASK_INSERT_FAILURE;
+    }
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = fiber->stackSize;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, tpFiberEntry, 0);
+
+    if (tpInsertTask(threadPool, tpRunFiber, fiber) != TASK_INSERT_SUCCESS) {
+        tpReleaseFiber(fiber);
+        return TASK_INSERT_FAILURE;
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Get the fiber the calling task runs as.
+ * @return The fiber, or NULL if the caller is not a fiber task.
+ */
+TPFiber* tpCurrentFiber(void) {
+
+    return tpRunningFiber;
+}
+
+/***
+ * Give up the worker to other tasks, and continue once the fiber's turn comes again.
+ * Does nothing if the caller is not a fiber task.
+ */
+void tpYield(void) {
+
+    TPFiber* fiber = tpRunningFiber;
+    if (fiber != NULL) {
+        tpFiberStop(fiber, TP_FIBER_STOP_YIELD);
+    }
+}
+
+/***
+ * Give up the worker until another thread calls tpFiberResume on this fiber.
+ * A resume that comes before the suspend is not lost, the suspend returns at
+ * once instead, so callers may publish tpCurrentFiber to a waker and then
+ * suspend without holding a lock. Like a condition wait, it may also return
+ * early: callers re-check what they wait for.
+ * Does nothing if the caller is not a fiber task.
+ */
+void tpFiberSuspend(void) {
+
+    TPFiber* fiber = tpRunningFiber;
+    if (fiber == NULL) {
+        return;
+    }
+
+    int expected = TP_FIBER_RUNNING;
+    if (!atomic_compare_exchange_strong(&fiber->state, &expected, TP_FIBER_SUSPENDING)) {
+        /* Resumed already, take the notification and keep running. */
+        atomic_store(&fiber->state, TP_FIBER_RUNNING);
+        return;
+    }
+    tpFiberStop(fiber, TP_FIBER_STOP_SUSPEND);
+}
+
+/***
+ * Let a suspended fiber continue, see tpFiberSuspend.
+ * Safe to call from any thread, and before the fiber actually suspended.
+ * If the fiber can not be queued, e.g. the pool is shutting down, it
+ * continues on the calling thread, until it suspends again or finishes,
+ * unless the shutdown does not wait for tasks, see tpRequeueFiber.
+ * @param fiber The fiber.
+ */
+void tpFiberResume(TPFiber* fiber) {
+
+    if (fiber == NULL) {
+        return;
+    }
+
+    int state = atomic_load(&fiber->state);
+    while (true) {
+        switch (state) {
+            case TP_FIBER_RUNNING:
+                if (atomic_compare_exchange_weak(&fiber->state, &state, TP_FIBER_NOTIFIED)) {
+                    return;
+                }
+                break;
+            case TP_FIBER_SUSPENDING:
+                /* Its worker re-queues the fiber once it is off the fiber's stack. */
+                if (atomic_compare_exchange_weak(&fiber->state, &state, TP_FIBER_RESUMED)) {
+                    return;
+                }
+                break;
+            case TP_FIBER_SUSPENDED:
+                if (atomic_compare_exchange_weak(&fiber->state, &state, TP_FIBER_RUNNING)) {
+                    if (!tpRequeueFiber(fiber)) {
+                        tpRunFiber(fiber);
+                    }
+                    return;
+                }
+                break;
+            default:
+                /* Already notified. */
+                return;
+        }
+    }
+}
+
+/***
+ * Run a fiber on the calling thread until it suspends or finishes.
+ * This is the task queued for every fiber. If the fiber can not be queued
+ * again after a yield, it keeps running here rather than being dropped,
+ * unless the pool is shutting down without waiting for tasks, see tpRequeueFiber.
+ * @param param The fiber.
+ */
+void tpRunFiber(void* param) {
+
+    TPFiber* fiber = (TPFiber*) param;
+    TPFiber* previousFiber = tpRunningFiber;
+    void* previousTag = tpGetTaskTag();
+    ucontext_t workerContext;
+    bool isRunnable = true;
+
+    while (isRunnable) {
+        /* The tag goes with the fiber, not with the tasks that ran on the worker meanwhile. */
+        fiber->returnContext = &workerContext;
+        tpRunningFiber = fiber;
+        tpSetTaskTag(fiber->tag);
+        if (swapcontext(&workerContext, &fiber->context) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+        fiber->tag = tpGetTaskTag();
+        tpSetTaskTag(previousTag);
+        tpRunningFiber = previousFiber;
+
+        /* Back on the worker's stack, the fiber can now be handed to another worker. */
+        isRunnable = false;
+        switch (fiber->stopReason) {
+            case TP_FIBER_STOP_YIELD:
+                isRunnable = !tpRequeueFiber(fiber);
+                break;
+            case TP_FIBER_STOP_SUSPEND: {
+                int expected = TP_FIBER_SUSPENDING;
+                if (!atomic_compare_exchange_strong(&fiber->state, &expected, TP_FIBER_SUSPENDED)) {
+                    /* Resumed while switching, run it again. */
+                    atomic_store(&fiber->state, TP_FIBER_RUNNING);
+                    isRunnable = !tpRequeueFiber(fiber);
+                }
+                break;
+            }
+            default:
+                tpReleaseFiber(fiber);
+                break;
+        }
+    }
+}
+
+/***
+ * The first function on a fiber's stack, runs its task.
+ */
+void tpFiberEntry(void) {
+
+    TPFiber* fiber = tpRunningFiber;
+
+    (*(fiber->computeFunc))(fiber->parameters);
+
+    fiber->stopReason = TP_FIBER_STOP_FINISH;
+    setcontext(fiber->returnContext);
+}
+
+/***
+ * Switch from a fiber back to the worker running it.
+ * @param fiber The running fiber.
+ * @param stopReason Why the fiber stops, one of TP_FIBER_STOP_*.
+ */
+void tpFiberStop(TPFiber* fiber, int stopReason) {
+
+    fiber->stopReason = stopReason;
+    if (swapcontext(&fiber->context, fiber->returnContext) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Queue a fiber to continue on the next free worker.
+ * Once the pool is shutting down without waiting for tasks, the fiber is
+ * left as it is, like the tasks still queued: it never runs again and is
+ * freed with the pool, see tpFreeFiberCache.
+ * @param fiber The fiber.
+ * @return true if queued or left, false if the caller must run the fiber itself.
+ */
+bool tpRequeueFiber(TPFiber* fiber) {
+
+    /* Queued with the fiber's own tag, not the tag of whoever resumes it. */
+    ThreadPool* threadPool = fiber->pool;
+    void* tag = tpGetTaskTag();
+    tpSetTaskTag(fiber->tag);
+    int result = tpInsertTask(threadPool, tpRunFiber, fiber);
+    tpSetTaskTag(tag);
+    if (result == TASK_INSERT_SUCCESS) {
+        return true;
+    }
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    bool isLeft = threadPool->isShuttingDown && !threadPool->shouldWaitForTasks;
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return isLeft;
+}
+
+/***
+ * Get a fiber with a stack, from the Thread Pool's cache if it has one.
+ * @param threadPool The Thread Pool.
+ * @return The fiber, or NULL if failed.
+ */
+TPFiber* tpAllocFiber(ThreadPool* threadPool) {
+
+    TPFiber* fiber = NULL;
+
+    if (tpLockMutex(threadPool->mutexFiberCache, &threadPool->fiberCacheLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (threadPool->fiberCache != NULL) {
+        fiber = threadPool->fiberCache;
+        threadPool->fiberCache = fiber->next;
+        threadPool->numOfCachedFibers--;
+    }
+    if (pthread_mutex_unlock(threadPool->mutexFiberCache) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    if (fiber != NULL) {
+        fiber->next = NULL;
+        return fiber;
+    }
+
+    /* A stack overflow hits the guard page and faults, rather than corrupting the heap. */
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t stackSize = (threadPool->config.fiberStackSize + pageSize - 1) & ~(pageSize - 1);
+    if ((fiber = malloc(sizeof(TPFiber))) == NULL) {
+        return NULL;
+    }
+    char* mapping = mmap(NULL, pageSize + stackSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error in system call\n");
+        free(fiber);
+        return NULL;
+    }
+    if (mprotect(mapping, pageSize, PROT_NONE) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        munmap(mapping, pageSize + stackSize);
+        free(fiber);
+        return NULL;
+    }
+    fiber->pool = threadPool;
+    fiber->stack = mapping + pageSize;
+    fiber->stackSize = stackSize;
+    fiber->guardSize = pageSize;
+    fiber->next = NULL;
+
+    /* Keep track of every fiber, so those never resumed are freed with the pool. */
+    if (tpLockMutex(threadPool->mutexFiberCache, &threadPool->fiberCacheLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    fiber->prevFiber = NULL;
+    fiber->nextFiber = threadPool->fibers;
+    if (threadPool->fibers != NULL) {
+        threadPool->fibers->prevFiber = fiber;
+    }
+    threadPool->fibers = fiber;
+    if (pthread_mutex_unlock(threadPool->mutexFiberCache) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return fiber;
+}
+
+/***
+ * Put a finished fiber back in the Thread Pool's cache, or free it if the cache is full.
+ * @param fiber The fiber.
+ */
+void tpReleaseFiber(TPFiber* fiber) {
+
+    ThreadPool* threadPool = fiber->pool;
+
+    if (tpLockMutex(threadPool->mutexFiberCache, &threadPool->fiberCacheLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (threadPool->numOfCachedFibers < TP_MAX_CACHED_FIBERS) {
+        fiber->next = threadPool->fiberCache;
+        threadPool->fiberCache = fiber;
+        threadPool->numOfCachedFibers++;
+        fiber = NULL;
+    } else {
+        if (fiber->prevFiber != NULL) {
+            fiber->prevFiber->nextFiber = fiber->nextFiber;
+        } else {
+            threadPool->fibers = fiber->nextFiber;
+        }
+        if (fiber->nextFiber != NULL) {
+            fiber->nextFiber->prevFiber = fiber->prevFiber;
+        }
+    }
+    if (pthread_mutex_unlock(threadPool->mutexFiberCache) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    if (fiber != NULL) {
+        tpFreeFiber(fiber);
+    }
+}
+
+/***
+ * Unmap the stack of a fiber and free it.
+ * @param fiber The fiber, off every list.
+ */
+void tpFreeFiber(TPFiber* fiber) {
+
+    munmap((char*) fiber->stack - fiber->guardSize, fiber->guardSize + fiber->stackSize);
+    free(fiber);
+}
+
+/***
+ * Free every fiber of a Thread Pool: the cached ones, and the ones still
+ * suspended or left by a shutdown, whose tasks never finish. The workers must be done.
+ * @param threadPool The Thread Pool.
+ */
+void tpFreeFiberCache(ThreadPool* threadPool) {
+
+    while (threadPool->fibers != NULL) {
+        TPFiber* fiber = threadPool->fibers;
+        threadPool->fibers = fiber->nextFiber;
+        tpFreeFiber(fiber);
+    }
+    threadPool->fiberCache = NULL;
+    threadPool->numOfCachedFibers = 0;
+}
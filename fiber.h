@@ -0,0 +1,50 @@
+#ifndef __FIBER__
+#define __FIBER__
+
+#include "threadPool.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <ucontext.h>
+
+/* The default stack size of a fiber task, see tpInsertFiberTask. */
+#define TP_DEFAULT_FIBER_STACK_SIZE (64 * 1024)
+
+/* The most finished fibers a Thread Pool keeps for reuse. */
+#define TP_MAX_CACHED_FIBERS 64
+
+/// Fiber struct.
+
+typedef struct tp_fiber
+{
+    struct thread_pool* pool;    /* The Thread Pool the fiber runs on. */
+    void (*computeFunc)(void *); /* The task. */
+    void* parameters;            /* The parameters to the task. */
+    void* tag;                   /* The fiber's tag while it is switched out, see tpSetTaskTag. */
+    ucontext_t context;          /* The fiber's registers while it is not running. */
+    ucontext_t* returnContext;   /* The worker to switch back to when the fiber stops running. */
+    atomic_int state;            /* Where the fiber is in its suspend / resume cycle. */
+    int stopReason;              /* Why the fiber switched back to its worker. */
+    struct tp_fiber* next;       /* The next fiber in the Thread Pool's cache. */
+    struct tp_fiber* prevFiber;  /* The previous fiber in the Thread Pool's list of all fibers. */
+    struct tp_fiber* nextFiber;  /* The next fiber in the Thread Pool's list of all fibers. */
+    void* stack;                 /* The fiber's stack, mapped above a guard page. */
+    size_t stackSize;            /* The size of stack. */
+    size_t guardSize;            /* The size of the inaccessible page below stack. */
+
+}TPFiber;
+
+int tpInsertFiberTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param);
+
+TPFiber* tpCurrentFiber(void);
+
+void tpYield(void);
+
+void tpFiberSuspend(void);
+
+void tpFiberResume(TPFiber* fiber);
+
+void tpRunFiber(void* fiber);
+
+void tpFreeFiberCache(ThreadPool* threadPool);
+
+#endif
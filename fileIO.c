@@ -0,0 +1,404 @@
+#include "fileIO.h"
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int tpFileSubmit(TPFileIO* io, int op, int fd, void* buffer, size_t length, off_t offset,
+                 void (*callback)(ssize_t result, int error, void* arg), void* arg);
+void* tpFileIORoutine(void* io);
+int tpTakeFileRequests(TPFileIO* io, tp_file_request** batch);
+bool tpIsFileRequestReady(TPFileIO* io, tp_file_request* request);
+void tpUnlinkFileRequest(tp_file_request** head, tp_file_request** tail, tp_file_request* request);
+void tpDoFileRequests(tp_file_request** batch, int numOfRequests);
+void tpRunFileCallback(void* request);
+
+/***
+ * Create a group of I/O threads to do file reads, writes and syncs:
+ * Blocking pread / pwrite calls run on the group's own threads instead of
+ * occupying compute workers, and each request's callback is then queued
+ * on the compute pool. Pending reads or writes on the same fd at adjacent
+ * offsets are merged into one preadv / pwritev.
+ * Requests are not ordered against each other, except that a sync starts
+ * only after the writes to its fd submitted before it are done.
+ * @param threadPool The compute Thread Pool to run the callbacks.
+ * @param numOfThreads The number of I/O threads, 0 for the default.
+ * @return A pointer to the new I/O group, or NULL if failed.
+ */
+TPFileIO* tpFileIOCreate(ThreadPool* threadPool, int numOfThreads) {
+
+    if (threadPool == NULL || numOfThreads < 0) {
+        fprintf(stderr, "Bad arguments for FileIOCreate.\n");
+        return NULL;
+    }
+    if (numOfThreads == 0) {
+        numOfThreads = TP_DEFAULT_FILE_IO_THREADS;
+    }
+
+    TPFileIO* io = malloc(sizeof(TPFileIO));
+    if (io == NULL) {
+        fprintf(stderr, "Cannot allocate memory for file I/O.\n");
+        return NULL;
+    }
+    if ((io->threads = malloc(sizeof(pthread_t) * numOfThreads)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for threads.\n");
+        free(io);
+        return NULL;
+    }
+    io->pool = threadPool;
+    io->numOfThreads = 0;
+    io->pendingHead = NULL;
+    io->pendingTail = NULL;
+    io->inFlight = NULL;
+    io->isStopping = false;
+    pthread_mutex_init(&io->mutex, NULL);
+    pthread_cond_init(&io->cv, NULL);
+
+    for (int i = 0; i < numOfThreads; ++i) {
+        if (pthread_create(&io->threads[i], NULL, tpFileIORoutine, io) != 0) {
+            fprintf(stderr, "Error in system call\n");
+            tpFileIODestroy(io);
+            return NULL;
+        }
+        io->numOfThreads++;
+    }
+
+    return io;
+}
+
+/***
+ * Stop an I/O group once its pending requests are done, and free it.
+ * Callbacks of the last requests may still be queued on the compute pool.
+ * @param io The I/O group.
+ */
+void tpFileIODestroy(TPFileIO* io) {
+
+    if (io == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&io->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    io->isStopping = true;
+    pthread_cond_broadcast(&io->cv);
+    if (pthread_mutex_unlock(&io->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    for (int i = 0; i < io->numOfThreads; ++i) {
+        pthread_join(io->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&io->cv);
+    pthread_mutex_destroy(&io->mutex);
+    free(io->threads);
+    free(io);
+}
+
+/***
+ * Read from a file at an offset, like pread, on an I/O thread.
+ * @param io The I/O group.
+ * @param fd The file descriptor.
+ * @param buffer The buffer to read into, valid until the callback runs.
+ * @param length The number of bytes to read.
+ * @param offset Where in the file to read.
+ * @param callback Run on the compute pool with the bytes read, or -1 and the errno, and arg.
+ * @param arg The argument to the callback.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpFileRead(TPFileIO* io, int fd, void* buffer, size_t length, off_t offset,
+               void (*callback)(ssize_t result, int error, void* arg), void* arg) {
+
+    return tpFileSubmit(io, TP_FILE_READ, fd, buffer, length, offset, callback, arg);
+}
+
+/***
+ * Write to a file at an offset, like pwrite, on an I/O thread.
+ * @param io The I/O group.
+ * @param fd The file descriptor.
+ * @param buffer The buffer to write from, valid until the callback runs.
+ * @param length The number of bytes to write.
+ * @param offset Where in the file to write.
+ * @param callback Run on the compute pool with the bytes written, or -1 and the errno, and arg.
+ * @param arg The argument to the callback.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpFileWrite(TPFileIO* io, int fd, const void* buffer, size_t length, off_t offset,
+                void (*callback)(ssize_t result, int error, void* arg), void* arg) {
+
+    return tpFileSubmit(io, TP_FILE_WRITE, fd, (void*) buffer, length, offset, callback, arg);
+}
+
+/***
+ * Flush a file to storage, like fsync, on an I/O thread,
+ * after the writes to it submitted before are done.
+ * @param io The I/O group.
+ * @param fd The file descriptor.
+ * @param callback Run on the compute pool with 0, or -1 and the errno, and arg.
+ * @param arg The argument to the callback.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpFileSync(TPFileIO* io, int fd, void (*callback)(ssize_t result, int error, void* arg), void* arg) {
+
+    return tpFileSubmit(io, TP_FILE_SYNC, fd, NULL, 0, 0, callback, arg);
+}
+
+/***
+ * Queue a file request for the I/O threads.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpFileSubmit(TPFileIO* io, int op, int fd, void* buffer, size_t length, off_t offset,
+                 void (*callback)(ssize_t result, int error, void* arg), void* arg) {
+
+    if (io == NULL || fd < 0 || (buffer == NULL && op != TP_FILE_SYNC) || offset < 0 || callback == NULL) {
+        fprintf(stderr, "Bad arguments for file request.\n");
+        return TP_FAILURE;
+    }
+
+    tp_file_request* request = malloc(sizeof(tp_file_request));
+    if (request == NULL) {
+        fprintf(stderr, "Cannot allocate memory for file request.\n");
+        return TP_FAILURE;
+    }
+    request->io = io;
+    request->op = op;
+    request->fd = fd;
+    request->offset = offset;
+    request->buffer = buffer;
+    request->length = length;
+    request->result = 0;
+    request->error = 0;
+    request->callback = callback;
+    request->arg = arg;
+    request->next = NULL;
+
+    if (pthread_mutex_lock(&io->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (io->isStopping) {
+        pthread_mutex_unlock(&io->mutex);
+        free(request);
+        fprintf(stderr, "File I/O is stopping.\n");
+        return TP_FAILURE;
+    }
+    request->prev = io->pendingTail;
+    if (io->pendingTail == NULL) {
+        io->pendingHead = request;
+    } else {
+        io->pendingTail->next = request;
+    }
+    io->pendingTail = request;
+    pthread_cond_signal(&io->cv);
+    if (pthread_mutex_unlock(&io->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * The routine of an I/O thread: take a batch of requests, do it and queue its callbacks.
+ * @param io The I/O group.
+ * @return NULL.
+ */
+void* tpFileIORoutine(void* io) {
+
+    TPFileIO* self = (TPFileIO*) io;
+    tp_file_request* batch[TP_FILE_IO_MAX_COALESCE];
+
+    while (true) {
+        if (pthread_mutex_lock(&self->mutex) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+        int numOfRequests;
+        while ((numOfRequests = tpTakeFileRequests(self, batch)) == 0) {
+            if (self->isStopping && self->pendingHead == NULL) {
+                pthread_mutex_unlock(&self->mutex);
+                return NULL;
+            }
+            pthread_cond_wait(&self->cv, &self->mutex);
+        }
+        if (pthread_mutex_unlock(&self->mutex) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+
+        tpDoFileRequests(batch, numOfRequests);
+
+        /* Done writes may let a waiting sync start. */
+        if (pthread_mutex_lock(&self->mutex) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+        for (int i = 0; i < numOfRequests; ++i) {
+            tpUnlinkFileRequest(&self->inFlight, NULL, batch[i]);
+        }
+        if (batch[0]->op == TP_FILE_WRITE) {
+            pthread_cond_broadcast(&self->cv);
+        }
+        if (pthread_mutex_unlock(&self->mutex) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+
+        for (int i = 0; i < numOfRequests; ++i) {
+            if (tpInsertTask(self->pool, tpRunFileCallback, batch[i]) != TASK_INSERT_SUCCESS) {
+                tpRunFileCallback(batch[i]);
+            }
+        }
+    }
+}
+
+/***
+ * Take the oldest pending request that may start, with the pending requests
+ * that continue it in the file, and move them in flight.
+ * The I/O group's mutex must be locked.
+ * @param io The I/O group.
+ * @param batch Where to write the requests, in file order.
+ * @return The number of requests taken, 0 if none may start.
+ */
+int tpTakeFileRequests(TPFileIO* io, tp_file_request** batch) {
+
+    tp_file_request* first = io->pendingHead;
+    while (first != NULL && !tpIsFileRequestReady(io, first)) {
+        first = first->next;
+    }
+    if (first == NULL) {
+        return 0;
+    }
+
+    tpUnlinkFileRequest(&io->pendingHead, &io->pendingTail, first);
+    batch[0] = first;
+    int numOfRequests = 1;
+
+    /* Chain the requests that start where the batch ends. */
+    if (first->op != TP_FILE_SYNC) {
+        off_t end = first->offset + (off_t) first->length;
+        tp_file_request* request = io->pendingHead;
+        while (request != NULL && numOfRequests < TP_FILE_IO_MAX_COALESCE) {
+            if (request->op == first->op && request->fd == first->fd && request->offset == end) {
+                tpUnlinkFileRequest(&io->pendingHead, &io->pendingTail, request);
+                batch[numOfRequests++] = request;
+                end += (off_t) request->length;
+                request = io->pendingHead;
+            } else {
+                request = request->next;
+            }
+        }
+    }
+
+    for (int i = 0; i < numOfRequests; ++i) {
+        batch[i]->prev = NULL;
+        batch[i]->next = io->inFlight;
+        if (io->inFlight != NULL) {
+            io->inFlight->prev = batch[i];
+        }
+        io->inFlight = batch[i];
+    }
+
+    return numOfRequests;
+}
+
+/***
+ * Check if a pending request may start:
+ * a sync waits for the writes to its fd that were submitted before it.
+ * The I/O group's mutex must be locked.
+ * @param io The I/O group.
+ * @param request The pending request.
+ * @return true if it may start, false if not.
+ */
+bool tpIsFileRequestReady(TPFileIO* io, tp_file_request* request) {
+
+    if (request->op != TP_FILE_SYNC) {
+        return true;
+    }
+    for (tp_file_request* other = request->prev; other != NULL; other = other->prev) {
+        if (other->op == TP_FILE_WRITE && other->fd == request->fd) {
+            return false;
+        }
+    }
+    for (tp_file_request* other = io->inFlight; other != NULL; other = other->next) {
+        if (other->op == TP_FILE_WRITE && other->fd == request->fd) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/***
+ * Remove a request from a list.
+ * @param head The head of the list.
+ * @param tail The tail of the list, NULL if the list keeps none.
+ * @param request The request.
+ */
+void tpUnlinkFileRequest(tp_file_request** head, tp_file_request** tail, tp_file_request* request) {
+
+    if (request->prev == NULL) {
+        *head = request->next;
+    } else {
+        request->prev->next = request->next;
+    }
+    if (request->next != NULL) {
+        request->next->prev = request->prev;
+    } else if (tail != NULL) {
+        *tail = request->prev;
+    }
+}
+
+/***
+ * Do a batch of requests with one system call, and split the result among them.
+ * @param batch The requests, adjacent in the file and all of one op.
+ * @param numOfRequests The size of batch.
+ */
+void tpDoFileRequests(tp_file_request** batch, int numOfRequests) {
+
+    tp_file_request* first = batch[0];
+    ssize_t result;
+
+    do {
+        if (first->op == TP_FILE_SYNC) {
+            result = fsync(first->fd);
+        } else if (numOfRequests == 1) {
+            result = first->op == TP_FILE_READ
+                     ? pread(first->fd, first->buffer, first->length, first->offset)
+                     : pwrite(first->fd, first->buffer, first->length, first->offset);
+        } else {
+            struct iovec vectors[TP_FILE_IO_MAX_COALESCE];
+            for (int i = 0; i < numOfRequests; ++i) {
+                vectors[i].iov_base = batch[i]->buffer;
+                vectors[i].iov_len = batch[i]->length;
+            }
+            result = first->op == TP_FILE_READ
+                     ? preadv(first->fd, vectors, numOfRequests, first->offset)
+                     : pwritev(first->fd, vectors, numOfRequests, first->offset);
+        }
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0) {
+        int error = errno;
+        for (int i = 0; i < numOfRequests; ++i) {
+            batch[i]->result = -1;
+            batch[i]->error = error;
+        }
+        return;
+    }
+
+    /* A short transfer, e.g. at end of file, is short for the requests at the end of the batch. */
+    size_t remaining = (size_t) result;
+    for (int i = 0; i < numOfRequests; ++i) {
+        size_t done = remaining < batch[i]->length ? remaining : batch[i]->length;
+        batch[i]->result = first->op == TP_FILE_SYNC ? 0 : (ssize_t) done;
+        remaining -= done;
+    }
+}
+
+/***
+ * Run the callback of a done request, and free it.
+ * @param request The request.
+ */
+void tpRunFileCallback(void* request) {
+
+    tp_file_request* self = (tp_file_request*) request;
+
+    (*(self->callback))(self->result, self->error, self->arg);
+
+    free(self);
+}
@@ -0,0 +1,65 @@
+#ifndef __FILE_IO__
+#define __FILE_IO__
+
+#include "threadPool.h"
+#include <sys/types.h>
+
+/* The most adjacent requests an I/O thread merges into one preadv / pwritev. */
+#define TP_FILE_IO_MAX_COALESCE 16
+
+/* The default number of I/O threads, see tpFileIOCreate. */
+#define TP_DEFAULT_FILE_IO_THREADS 4
+
+/* The file operations. */
+#define TP_FILE_READ 0
+#define TP_FILE_WRITE 1
+#define TP_FILE_SYNC 2
+
+/// File Request struct.
+
+typedef struct tp_file_request
+{
+    struct tp_file_io* io;       /* The I/O group doing the request. */
+    int op;                      /* TP_FILE_READ, TP_FILE_WRITE or TP_FILE_SYNC. */
+    int fd;                      /* The file descriptor. */
+    off_t offset;                /* Where in the file to read or write. */
+    void* buffer;                /* The buffer to read into or write from. */
+    size_t length;               /* The size of buffer. */
+    ssize_t result;              /* The number of bytes read or written, or -1. */
+    int error;                   /* The errno of the request if result is -1, else 0. */
+    void (*callback)(ssize_t result, int error, void* arg); /* Run on the compute pool when done. */
+    void* arg;                   /* The argument to the callback. */
+    struct tp_file_request* prev; /* The previous request in its list. */
+    struct tp_file_request* next; /* The next request in its list. */
+
+}tp_file_request;
+
+/// File IO struct.
+
+typedef struct tp_file_io
+{
+    ThreadPool* pool;            /* The compute Thread Pool running the callbacks. */
+    pthread_t* threads;          /* The I/O threads. */
+    int numOfThreads;            /* The size of threads. */
+    pthread_mutex_t mutex;       /* The mutex for the lists and isStopping. */
+    pthread_cond_t cv;           /* Signalled when a request may be ready for an I/O thread. */
+    tp_file_request* pendingHead; /* The requests not yet started, in submission order. */
+    tp_file_request* pendingTail;
+    tp_file_request* inFlight;   /* The requests being done by I/O threads. */
+    bool isStopping;             /* Is the group asked to stop once pending requests are done? */
+
+}TPFileIO;
+
+TPFileIO* tpFileIOCreate(ThreadPool* threadPool, int numOfThreads);
+
+void tpFileIODestroy(TPFileIO* io);
+
+int tpFileRead(TPFileIO* io, int fd, void* buffer, size_t length, off_t offset,
+               void (*callback)(ssize_t result, int error, void* arg), void* arg);
+
+int tpFileWrite(TPFileIO* io, int fd, const void* buffer, size_t length, off_t offset,
+                void (*callback)(ssize_t result, int error, void* arg), void* arg);
+
+int tpFileSync(TPFileIO* io, int fd, void (*callback)(ssize_t result, int error, void* arg), void* arg);
+
+#endif
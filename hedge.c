@@ -0,0 +1,441 @@
+#include "hedge.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+void tpRunHedgedAttempt(void* call);
+void* tpHedgerRoutine(void* policy);
+void tpRecordHedgeLatency(TPHedgePolicy* policy, uint64_t latencyNs);
+void tpReleaseHedgedCall(tp_hedged_call* call);
+int tpHedgeHeapPush(TPHedgePolicy* policy, tp_hedged_call* call);
+void tpHedgeHeapRemove(TPHedgePolicy* policy, tp_hedged_call* call);
+void tpHedgeHeapSwap(TPHedgePolicy* policy, int i, int j);
+int tpCompareLatencies(const void* latency, const void* other);
+
+/* The hedged call the calling thread runs an attempt of, NULL if none. */
+static __thread tp_hedged_call* tpRunningCall = NULL;
+
+/***
+ * Create a Hedge Policy for a class of idempotent tasks:
+ * A task inserted with tpInsertHedgedTask that runs longer than the given
+ * percentile of the run times of the policy's recent tasks is started a
+ * second time, and the result of the attempt that finishes first wins.
+ * The duplicate is inserted for the same class, so it counts against the
+ * class's share, concurrency limit and rate like any other task of it.
+ * The losing attempt should stop early by checking tpHedgeIsCancelled,
+ * and its result is dropped.
+ * Until enough latencies are known, and never below it, the delay is minDelayNs.
+ * @param threadPool The Thread Pool to run the tasks.
+ * @param classId The class to insert the tasks for.
+ * @param percentile The latency percentile to start a duplicate after, above 0 and up to 100.
+ * @param minDelayNs The least delay before starting a duplicate.
+ * @param discardFunc Optional, frees the result of a losing attempt.
+ * @return A pointer to the new Hedge Policy, or NULL if failed.
+ */
+TPHedgePolicy* tpHedgePolicyCreate(ThreadPool* threadPool, int classId, double percentile,
+                                   uint64_t minDelayNs, void (*discardFunc)(void* result)) {
+
+    if (threadPool == NULL || classId < 0 || classId >= threadPool->numOfClasses
+        || !(percentile > 0 && percentile <= 100)) {
+        fprintf(stderr, "Bad arguments for HedgePolicyCreate.\n");
+        return NULL;
+    }
+
+    TPHedgePolicy* policy = malloc(sizeof(TPHedgePolicy));
+    if (policy == NULL) {
+        fprintf(stderr, "Cannot allocate memory for hedge policy.\n");
+        return NULL;
+    }
+    policy->pool = threadPool;
+    policy->classId = classId;
+    policy->percentile = percentile;
+    policy->minDelayNs = minDelayNs;
+    policy->delayNs = minDelayNs;
+    policy->discardFunc = discardFunc;
+    policy->numOfSamples = 0;
+    policy->heap = NULL;
+    policy->heapSize = 0;
+    policy->heapCapacity = 0;
+    policy->numOfCalls = 0;
+    policy->numOfHedges = 0;
+    policy->isStopping = false;
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&policy->mutex, NULL);
+    pthread_cond_init(&policy->cv, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    if (pthread_create(&policy->hedger, NULL, tpHedgerRoutine, policy) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        pthread_cond_destroy(&policy->cv);
+        pthread_mutex_destroy(&policy->mutex);
+        free(policy);
+        return NULL;
+    }
+
+    return policy;
+}
+
+/***
+ * Add an idempotent task that is started again if it is slow, see tpHedgePolicyCreate.
+ * @param policy The Hedge Policy.
+ * @param computeFunc The task, returning its result.
+ * @param param The parameters to the task.
+ * @param doneFunc Run once, on a worker, with the first result and arg.
+ * @param arg The argument to doneFunc.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertHedgedTask(TPHedgePolicy* policy, void* (*computeFunc) (void *), void* param,
+                       void (*doneFunc)(void* result, void* arg), void* arg) {
+
+    if (policy == NULL || computeFunc == NULL || doneFunc == NULL) {
+        fprintf(stderr, "Bad arguments for InsertHedgedTask.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    tp_hedged_call* call = malloc(sizeof(tp_hedged_call));
+    if (call == NULL) {
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    call->policy = policy;
+    call->computeFunc = computeFunc;
+    call->parameters = param;
+    call->doneFunc = doneFunc;
+    call->arg = arg;
+    call->startNs = 0;
+    call->deadlineNs = 0;
+    call->heapIndex = -1;
+    call->numOfReferences = 1;
+    call->isStarted = false;
+    atomic_init(&call->isDone, false);
+
+    if (pthread_mutex_lock(&policy->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (policy->isStopping) {
+        pthread_mutex_unlock(&policy->mutex);
+        free(call);
+        fprintf(stderr, "Hedge policy is stopping.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    policy->numOfCalls++;
+    if (pthread_mutex_unlock(&policy->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    if (tpInsertTaskForClass(policy->pool, policy->classId, tpRunHedgedAttempt, call) != TASK_INSERT_SUCCESS) {
+        pthread_mutex_lock(&policy->mutex);
+        tpReleaseHedgedCall(call);
+        pthread_mutex_unlock(&policy->mutex);
+        return TASK_INSERT_FAILURE;
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Check if the hedged task the caller runs lost to its other attempt,
+ * so the caller can stop early. Its result is dropped either way.
+ * @return true if cancelled, false if not, or if the caller does not run a hedged task.
+ */
+bool tpHedgeIsCancelled(void) {
+
+    tp_hedged_call* call = tpRunningCall;
+
+    return call != NULL && atomic_load_explicit(&call->isDone, memory_order_relaxed);
+}
+
+/***
+ * Get the number of duplicates a Hedge Policy started.
+ * @param policy The Hedge Policy.
+ * @return The number of duplicates.
+ */
+long tpHedgeCount(TPHedgePolicy* policy) {
+
+    pthread_mutex_lock(&policy->mutex);
+    long numOfHedges = policy->numOfHedges;
+    pthread_mutex_unlock(&policy->mutex);
+
+    return numOfHedges;
+}
+
+/***
+ * Free a Hedge Policy, after the attempts of its tasks are done.
+ * No duplicates are started from now on.
+ * A task calling this is in a blocking region, see tpBlockingBegin.
+ * @param policy The Hedge Policy.
+ */
+void tpHedgePolicyDestroy(TPHedgePolicy* policy) {
+
+    if (policy == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&policy->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    policy->isStopping = true;
+    pthread_cond_broadcast(&policy->cv);
+    if (pthread_mutex_unlock(&policy->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    pthread_join(policy->hedger, NULL);
+
+    tpBlockingBegin();
+    pthread_mutex_lock(&policy->mutex);
+    while (policy->numOfCalls > 0) {
+        pthread_cond_wait(&policy->cv, &policy->mutex);
+    }
+    pthread_mutex_unlock(&policy->mutex);
+    tpBlockingEnd();
+
+    free(policy->heap);
+    pthread_cond_destroy(&policy->cv);
+    pthread_mutex_destroy(&policy->mutex);
+    free(policy);
+}
+
+/***
+ * Run an attempt of a hedged call, and deliver its result if it is the first.
+ * @param call The hedged call.
+ */
+void tpRunHedgedAttempt(void* call) {
+
+    tp_hedged_call* self = (tp_hedged_call*) call;
+    TPHedgePolicy* policy = self->policy;
+
+    /* The first attempt starts the clock, a duplicate is only worth it once the task runs. */
+    pthread_mutex_lock(&policy->mutex);
+    if (!self->isStarted) {
+        self->isStarted = true;
+        self->startNs = tpNowNs();
+        self->deadlineNs = self->startNs + policy->delayNs;
+        if (!policy->isStopping && tpHedgeHeapPush(policy, self) == TP_SUCCESS) {
+            self->numOfReferences++;
+            if (self->heapIndex == 0) {
+                pthread_cond_signal(&policy->cv);
+            }
+        }
+    }
+    pthread_mutex_unlock(&policy->mutex);
+
+    if (!atomic_load(&self->isDone)) {
+        tp_hedged_call* outer = tpRunningCall;
+        tpRunningCall = self;
+        void* result = (*(self->computeFunc))(self->parameters);
+        tpRunningCall = outer;
+
+        if (!atomic_exchange(&self->isDone, true)) {
+            pthread_mutex_lock(&policy->mutex);
+            tpRecordHedgeLatency(policy, tpNowNs() - self->startNs);
+            if (self->heapIndex >= 0) {
+                tpHedgeHeapRemove(policy, self);
+                tpReleaseHedgedCall(self);
+            }
+            pthread_mutex_unlock(&policy->mutex);
+            (*(self->doneFunc))(result, self->arg);
+        } else if (policy->discardFunc != NULL) {
+            (*(policy->discardFunc))(result);
+        }
+    }
+
+    pthread_mutex_lock(&policy->mutex);
+    tpReleaseHedgedCall(self);
+    pthread_mutex_unlock(&policy->mutex);
+}
+
+/***
+ * The routine of the hedger thread: wait for the earliest deadline, and
+ * start a duplicate of its call if the call is still running.
+ * @param policy The Hedge Policy.
+ * @return NULL.
+ */
+void* tpHedgerRoutine(void* policy) {
+
+    TPHedgePolicy* self = (TPHedgePolicy*) policy;
+
+    pthread_mutex_lock(&self->mutex);
+    while (!self->isStopping) {
+        if (self->heapSize == 0) {
+            pthread_cond_wait(&self->cv, &self->mutex);
+            continue;
+        }
+
+        tp_hedged_call* call = self->heap[0];
+        if (call->deadlineNs > tpNowNs()) {
+            struct timespec deadline;
+            deadline.tv_sec = (time_t) (call->deadlineNs / 1000000000ULL);
+            deadline.tv_nsec = (long) (call->deadlineNs % 1000000000ULL);
+            pthread_cond_timedwait(&self->cv, &self->mutex, &deadline);
+            continue;
+        }
+
+        /* The heap's reference to the call passes to the duplicate. */
+        tpHedgeHeapRemove(self, call);
+        if (atomic_load(&call->isDone)) {
+            tpReleaseHedgedCall(call);
+            continue;
+        }
+        self->numOfHedges++;
+        pthread_mutex_unlock(&self->mutex);
+        int result = tpInsertTaskForClass(self->pool, self->classId, tpRunHedgedAttempt, call);
+        pthread_mutex_lock(&self->mutex);
+        if (result != TASK_INSERT_SUCCESS) {
+            self->numOfHedges--;
+            tpReleaseHedgedCall(call);
+        }
+    }
+
+    /* Stopping: no more duplicates. */
+    while (self->heapSize > 0) {
+        tp_hedged_call* call = self->heap[0];
+        tpHedgeHeapRemove(self, call);
+        tpReleaseHedgedCall(call);
+    }
+    pthread_mutex_unlock(&self->mutex);
+
+    return NULL;
+}
+
+/***
+ * Record the latency of a call, and recompute the delay once in a while.
+ * The policy's mutex must be locked.
+ * @param policy The Hedge Policy.
+ * @param latencyNs The time from the start of the first attempt to the first result.
+ */
+void tpRecordHedgeLatency(TPHedgePolicy* policy, uint64_t latencyNs) {
+
+    policy->samples[policy->numOfSamples % TP_HEDGE_NUM_OF_SAMPLES] = latencyNs;
+    policy->numOfSamples++;
+    if (policy->numOfSamples % TP_HEDGE_RECOMPUTE_INTERVAL != 0) {
+        return;
+    }
+
+    uint64_t sorted[TP_HEDGE_NUM_OF_SAMPLES];
+    int numOfSamples = policy->numOfSamples < TP_HEDGE_NUM_OF_SAMPLES
+                       ? (int) policy->numOfSamples : TP_HEDGE_NUM_OF_SAMPLES;
+    memcpy(sorted, policy->samples, sizeof(uint64_t) * numOfSamples);
+    qsort(sorted, numOfSamples, sizeof(uint64_t), tpCompareLatencies);
+
+    int rank = (int) (policy->percentile / 100 * numOfSamples + 0.5);
+    uint64_t delayNs = sorted[rank > 0 ? rank - 1 : 0];
+    policy->delayNs = delayNs > policy->minDelayNs ? delayNs : policy->minDelayNs;
+}
+
+/***
+ * Drop a reference to a call, freeing it with the last one.
+ * The policy's mutex must be locked.
+ * @param call The hedged call.
+ */
+void tpReleaseHedgedCall(tp_hedged_call* call) {
+
+    TPHedgePolicy* policy = call->policy;
+
+    if (--call->numOfReferences > 0) {
+        return;
+    }
+    free(call);
+    if (--policy->numOfCalls == 0 && policy->isStopping) {
+        pthread_cond_broadcast(&policy->cv);
+    }
+}
+
+/***
+ * Add a call to the deadline heap.
+ * The policy's mutex must be locked.
+ * @param policy The Hedge Policy.
+ * @param call The hedged call.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpHedgeHeapPush(TPHedgePolicy* policy, tp_hedged_call* call) {
+
+    if (policy->heapSize == policy->heapCapacity) {
+        int capacity = policy->heapCapacity == 0 ? 64 : policy->heapCapacity * 2;
+        tp_hedged_call** heap = realloc(policy->heap, sizeof(tp_hedged_call*) * capacity);
+        if (heap == NULL) {
+            return TP_FAILURE;
+        }
+        policy->heap = heap;
+        policy->heapCapacity = capacity;
+    }
+
+    int i = policy->heapSize++;
+    policy->heap[i] = call;
+    call->heapIndex = i;
+    while (i > 0 && policy->heap[(i - 1) / 2]->deadlineNs > policy->heap[i]->deadlineNs) {
+        tpHedgeHeapSwap(policy, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Take a call out of the deadline heap.
+ * The policy's mutex must be locked.
+ * @param policy The Hedge Policy.
+ * @param call The hedged call, in the heap.
+ */
+void tpHedgeHeapRemove(TPHedgePolicy* policy, tp_hedged_call* call) {
+
+    int i = call->heapIndex;
+    int last = --policy->heapSize;
+    call->heapIndex = -1;
+    if (i == last) {
+        return;
+    }
+    policy->heap[i] = policy->heap[last];
+    policy->heap[i]->heapIndex = i;
+
+    /* The moved call may belong above or below its new place. */
+    while (i > 0 && policy->heap[(i - 1) / 2]->deadlineNs > policy->heap[i]->deadlineNs) {
+        tpHedgeHeapSwap(policy, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < policy->heapSize && policy->heap[left]->deadlineNs < policy->heap[smallest]->deadlineNs) {
+            smallest = left;
+        }
+        if (right < policy->heapSize && policy->heap[right]->deadlineNs < policy->heap[smallest]->deadlineNs) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        tpHedgeHeapSwap(policy, i, smallest);
+        i = smallest;
+    }
+}
+
+/***
+ * Swap two calls in the deadline heap.
+ * @param policy The Hedge Policy.
+ * @param i A place in the heap.
+ * @param j Another place in the heap.
+ */
+void tpHedgeHeapSwap(TPHedgePolicy* policy, int i, int j) {
+
+    tp_hedged_call* call = policy->heap[i];
+    policy->heap[i] = policy->heap[j];
+    policy->heap[j] = call;
+    policy->heap[i]->heapIndex = i;
+    policy->heap[j]->heapIndex = j;
+}
+
+/***
+ * Order latencies for qsort.
+ * @return Negative, 0 or positive as latency is shorter, equal or longer than other.
+ */
+int tpCompareLatencies(const void* latency, const void* other) {
+
+    uint64_t first = *(const uint64_t*) latency;
+    uint64_t second = *(const uint64_t*) other;
+
+    return (first > second) - (first < second);
+}
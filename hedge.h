@@ -0,0 +1,67 @@
+#ifndef __HEDGE__
+#define __HEDGE__
+
+#include "threadPool.h"
+#include <stdatomic.h>
+
+/* The number of recent latencies a hedge policy takes its percentile over. */
+#define TP_HEDGE_NUM_OF_SAMPLES 256
+
+/* How many new latencies a hedge policy records before it recomputes its delay. */
+#define TP_HEDGE_RECOMPUTE_INTERVAL 32
+
+/// Hedged Call struct.
+
+typedef struct tp_hedged_call
+{
+    struct tp_hedge_policy* policy; /* The policy the call was inserted with. */
+    void* (*computeFunc)(void *); /* The task, run once or twice. */
+    void* parameters;            /* The parameters to the task. */
+    void (*doneFunc)(void* result, void* arg); /* Run with the first result. */
+    void* arg;                   /* The argument to doneFunc. */
+    uint64_t startNs;            /* When the first attempt started. */
+    uint64_t deadlineNs;         /* When to start the duplicate. */
+    int heapIndex;               /* The call's place in the policy's heap, -1 if not there. */
+    int numOfReferences;         /* The attempts and heap entry holding the call. */
+    bool isStarted;              /* Did the first attempt start? */
+    atomic_bool isDone;          /* Did an attempt finish? */
+
+}tp_hedged_call;
+
+/// Hedge Policy struct.
+
+typedef struct tp_hedge_policy
+{
+    ThreadPool* pool;            /* The Thread Pool running the calls. */
+    int classId;                 /* The class the calls are inserted for. */
+    double percentile;           /* The latency percentile after which a duplicate starts, e.g. 95. */
+    uint64_t minDelayNs;         /* The least delay before a duplicate starts. */
+    uint64_t delayNs;            /* The current delay before a duplicate starts. */
+    void (*discardFunc)(void* result); /* Optional, frees the result of a losing attempt. */
+    uint64_t samples[TP_HEDGE_NUM_OF_SAMPLES]; /* The latencies of recent calls. */
+    long numOfSamples;           /* The number of latencies recorded. */
+    tp_hedged_call** heap;       /* The calls waiting for their deadline, earliest first. */
+    int heapSize;                /* The number of calls in heap. */
+    int heapCapacity;            /* The size of heap. */
+    int numOfCalls;              /* The calls not yet freed. */
+    long numOfHedges;            /* The number of duplicates started. */
+    bool isStopping;             /* Is the policy being destroyed? */
+    pthread_t hedger;            /* The thread starting the duplicates. */
+    pthread_mutex_t mutex;       /* The mutex for the policy and its calls. */
+    pthread_cond_t cv;           /* Signalled for the hedger and for destroy. */
+
+}TPHedgePolicy;
+
+TPHedgePolicy* tpHedgePolicyCreate(ThreadPool* threadPool, int classId, double percentile,
+                                   uint64_t minDelayNs, void (*discardFunc)(void* result));
+
+int tpInsertHedgedTask(TPHedgePolicy* policy, void* (*computeFunc) (void *), void* param,
+                       void (*doneFunc)(void* result, void* arg), void* arg);
+
+bool tpHedgeIsCancelled(void);
+
+long tpHedgeCount(TPHedgePolicy* policy);
+
+void tpHedgePolicyDestroy(TPHedgePolicy* policy);
+
+#endif
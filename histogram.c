@@ -0,0 +1,208 @@
+#include "histogram.h"
+
+int tpHistogramIndex(uint64_t value);
+uint64_t tpHistogramHighestValue(int index);
+
+/***
+ * Empty a Histogram:
+ * A log-linear (HDR style) histogram, values are counted in buckets that
+ * grow with the value, so every value is kept to 3.125% (see
+ * TP_HISTOGRAM_SUB_BUCKET_BITS) and recording is a handful of instructions.
+ * Histograms of the same layout merge by adding their buckets, e.g. the
+ * per-worker histograms of a Thread Pool.
+ * @param histogram The Histogram.
+ */
+void tpHistogramInit(TPHistogram* histogram) {
+
+    atomic_init(&histogram->count, 0);
+    atomic_init(&histogram->sum, 0);
+    atomic_init(&histogram->min, UINT64_MAX);
+    atomic_init(&histogram->max, 0);
+    for (int i = 0; i < TP_HISTOGRAM_NUM_OF_BUCKETS; ++i) {
+        atomic_init(&histogram->buckets[i], 0);
+    }
+}
+
+/***
+ * Create a new empty Histogram.
+ * @return A pointer to the new Histogram, or NULL if failed.
+ */
+TPHistogram* tpHistogramCreate(void) {
+
+    TPHistogram* histogram = aligned_alloc(64, (sizeof(TPHistogram) + 63) & ~(size_t) 63);
+    if (histogram == NULL) {
+        fprintf(stderr, "Cannot allocate memory for histogram.\n");
+        return NULL;
+    }
+    tpHistogramInit(histogram);
+
+    return histogram;
+}
+
+/***
+ * Free a Histogram.
+ * @param histogram The Histogram.
+ */
+void tpHistogramDestroy(TPHistogram* histogram) {
+
+    free(histogram);
+}
+
+/***
+ * Record a value. Only one thread at a time may record into a Histogram.
+ * @param histogram The Histogram.
+ * @param value The value, e.g. a latency in nanoseconds.
+ */
+void tpHistogramRecord(TPHistogram* histogram, uint64_t value) {
+
+    tpCounterAdd(&histogram->buckets[tpHistogramIndex(value)], 1);
+    tpCounterAdd(&histogram->count, 1);
+    tpCounterAdd(&histogram->sum, value);
+    if (value < atomic_load_explicit(&histogram->min, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->min, value, memory_order_relaxed);
+    }
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+/***
+ * Add the values of one Histogram to another.
+ * The source may be recorded into meanwhile, the target is written like a record.
+ * @param into The Histogram to add to.
+ * @param from The Histogram to add.
+ */
+void tpHistogramMerge(TPHistogram* into, const TPHistogram* from) {
+
+    for (int i = 0; i < TP_HISTOGRAM_NUM_OF_BUCKETS; ++i) {
+        unsigned long long count = atomic_load_explicit(&from->buckets[i], memory_order_relaxed);
+        if (count != 0) {
+            tpCounterAdd(&into->buckets[i], count);
+        }
+    }
+    tpCounterAdd(&into->count, atomic_load_explicit(&from->count, memory_order_relaxed));
+    tpCounterAdd(&into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+    unsigned long long min = atomic_load_explicit(&from->min, memory_order_relaxed);
+    if (min < atomic_load_explicit(&into->min, memory_order_relaxed)) {
+        atomic_store_explicit(&into->min, min, memory_order_relaxed);
+    }
+    unsigned long long max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if (max > atomic_load_explicit(&into->max, memory_order_relaxed)) {
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+    }
+}
+
+/***
+ * Get the value at a percentile, e.g. 99 for the p99.
+ * The value is the highest one its bucket stands for, so it is never below the real one.
+ * @param histogram The Histogram.
+ * @param percentile The percentile, 0 to 100.
+ * @return The value, or 0 if nothing was recorded.
+ */
+uint64_t tpHistogramPercentile(const TPHistogram* histogram, double percentile) {
+
+    /* Count the buckets rather than trusting count, which may be a record ahead of them. */
+    unsigned long long total = 0;
+    for (int i = 0; i < TP_HISTOGRAM_NUM_OF_BUCKETS; ++i) {
+        total += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    if (percentile <= 0) {
+        return atomic_load_explicit(&histogram->min, memory_order_relaxed);
+    }
+
+    unsigned long long target = (unsigned long long) (percentile / 100.0 * (double) total + 0.5);
+    if (target < 1) {
+        target = 1;
+    } else if (target > total) {
+        target = total;
+    }
+
+    unsigned long long seen = 0;
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    for (int i = 0; i < TP_HISTOGRAM_NUM_OF_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t value = tpHistogramHighestValue(i);
+            return value < max ? value : max;
+        }
+    }
+
+    return max;
+}
+
+/***
+ * Get the mean of the recorded values.
+ * @param histogram The Histogram.
+ * @return The mean, or 0 if nothing was recorded.
+ */
+uint64_t tpHistogramMean(const TPHistogram* histogram) {
+
+    unsigned long long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+
+    return count == 0 ? 0 : atomic_load_explicit(&histogram->sum, memory_order_relaxed) / count;
+}
+
+/***
+ * Add the latencies a Thread Pool recorded on all of its workers to a Histogram.
+ * The pool must be created with trackLatency set, see ThreadPoolConfig.
+ * @param threadPool The Thread Pool.
+ * @param latency TP_LATENCY_QUEUE_WAIT for the time from insert to start,
+ *                TP_LATENCY_RUN for the time from start to finish.
+ * @param histogram The Histogram to add to, e.g. one just emptied with tpHistogramInit.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpGetLatency(ThreadPool* threadPool, int latency, TPHistogram* histogram) {
+
+    if (threadPool == NULL || histogram == NULL || !threadPool->config.trackLatency
+        || (latency != TP_LATENCY_QUEUE_WAIT && latency != TP_LATENCY_RUN)) {
+        fprintf(stderr, "Bad arguments for GetLatency or the ThreadPool does not track latency.\n");
+        return TP_FAILURE;
+    }
+
+    for (int i = 0; i < threadPool->numOfWorkers; ++i) {
+        tp_worker* worker = &threadPool->workers[i];
+        tpHistogramMerge(histogram, latency == TP_LATENCY_QUEUE_WAIT ? worker->queueWaitLatency : worker->runLatency);
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Get the bucket of a value.
+ * @param value The value.
+ * @return The index of the bucket.
+ */
+int tpHistogramIndex(uint64_t value) {
+
+    if (value < TP_HISTOGRAM_SUB_BUCKETS) {
+        return (int) value;
+    }
+
+    /* Keep the top TP_HISTOGRAM_SUB_BUCKET_BITS bits of the value, the first of them is always set. */
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - (TP_HISTOGRAM_SUB_BUCKET_BITS - 1);
+    int subBucket = (int) (value >> shift) - TP_HISTOGRAM_HALF_SUB_BUCKETS;
+
+    return TP_HISTOGRAM_SUB_BUCKETS + (shift - 1) * TP_HISTOGRAM_HALF_SUB_BUCKETS + subBucket;
+}
+
+/***
+ * Get the highest value that falls into a bucket.
+ * @param index The index of the bucket.
+ * @return The value.
+ */
+uint64_t tpHistogramHighestValue(int index) {
+
+    if (index < TP_HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t) index;
+    }
+
+    int shift = (index - TP_HISTOGRAM_SUB_BUCKETS) / TP_HISTOGRAM_HALF_SUB_BUCKETS + 1;
+    uint64_t top = (uint64_t) ((index - TP_HISTOGRAM_SUB_BUCKETS) % TP_HISTOGRAM_HALF_SUB_BUCKETS
+                               + TP_HISTOGRAM_HALF_SUB_BUCKETS);
+
+    return ((top + 1) << shift) - 1;
+}
@@ -0,0 +1,54 @@
+#ifndef __HISTOGRAM__
+#define __HISTOGRAM__
+
+#include "threadPool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Values below 2^bits are exact, larger ones keep their top bits: a bucket is
+ * 1 / 2^(bits - 1) of its lowest value wide, 3.125% for 6 bits, and percentiles
+ * report the top of the bucket, so they are up to that much above the real value.
+ */
+#define TP_HISTOGRAM_SUB_BUCKET_BITS 6
+#define TP_HISTOGRAM_SUB_BUCKETS (1 << TP_HISTOGRAM_SUB_BUCKET_BITS)
+#define TP_HISTOGRAM_HALF_SUB_BUCKETS (TP_HISTOGRAM_SUB_BUCKETS / 2)
+
+/* The exact buckets, then half as many per power of two up to 2^63. */
+#define TP_HISTOGRAM_NUM_OF_BUCKETS \
+    (TP_HISTOGRAM_SUB_BUCKETS + (64 - TP_HISTOGRAM_SUB_BUCKET_BITS) * TP_HISTOGRAM_HALF_SUB_BUCKETS)
+
+/* The latencies the pool records, see tpGetLatency. */
+#define TP_LATENCY_QUEUE_WAIT 0
+#define TP_LATENCY_RUN 1
+
+/// Histogram struct.
+
+typedef struct tp_histogram
+{
+    /* One thread records, any thread may read or merge it at the same time. */
+    atomic_ullong count;         /* The number of values recorded. */
+    atomic_ullong sum;           /* The sum of the values recorded. */
+    atomic_ullong min;           /* The smallest value recorded, UINT64_MAX if none. */
+    atomic_ullong max;           /* The largest value recorded. */
+    atomic_ullong buckets[TP_HISTOGRAM_NUM_OF_BUCKETS]; /* The number of values in each bucket. */
+
+}TPHistogram;
+
+void tpHistogramInit(TPHistogram* histogram);
+
+TPHistogram* tpHistogramCreate(void);
+
+void tpHistogramDestroy(TPHistogram* histogram);
+
+void tpHistogramRecord(TPHistogram* histogram, uint64_t value);
+
+void tpHistogramMerge(TPHistogram* into, const TPHistogram* from);
+
+uint64_t tpHistogramPercentile(const TPHistogram* histogram, double percentile);
+
+uint64_t tpHistogramMean(const TPHistogram* histogram);
+
+int tpGetLatency(ThreadPool* threadPool, int latency, TPHistogram* histogram);
+
+#endif
@@ -0,0 +1,399 @@
+#include "keyedTasks.h"
+
+void tpRunKeyedTask(void* entry);
+tp_keyed_entry* tpFindKeyedEntry(TPKeyedTasks* tasks, const void* key, uint64_t hash);
+int tpAddKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry);
+void tpRemoveKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry, tp_keyed_entry** garbage);
+void tpReleaseKeyedEntry(tp_keyed_entry* entry, tp_keyed_entry** garbage);
+void tpCacheKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry);
+void tpUncacheKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry);
+void tpFreeKeyedEntries(void (*releaseFunc)(void* key, void* result), tp_keyed_entry* garbage);
+
+/***
+ * Create a set of Keyed Tasks:
+ * Tasks inserted with tpInsertKeyedTask compute a result for a key. An
+ * insert for a key whose task is queued or running does not queue another
+ * task, it waits for the same result. With a cache, results also serve the
+ * inserts for their key for cacheTtlNs after the task, the least recently
+ * used results making room when more than cacheCapacity are cached.
+ * @param threadPool The Thread Pool to run the tasks.
+ * @param hashFunc Hashes a key.
+ * @param equalsFunc Tells if two keys are equal.
+ * @param releaseFunc Optional, frees the key and result of a task once nothing uses them,
+ *                    and the key of an insert served without a task of its own, with a NULL result.
+ * @param cacheCapacity The most results cached, 0 to not cache.
+ * @param cacheTtlNs How long a result stays cached.
+ * @return A pointer to the new Keyed Tasks, or NULL if failed.
+ */
+TPKeyedTasks* tpKeyedTasksCreate(ThreadPool* threadPool, uint64_t (*hashFunc)(const void* key),
+                                 bool (*equalsFunc)(const void* key, const void* other),
+                                 void (*releaseFunc)(void* key, void* result),
+                                 int cacheCapacity, uint64_t cacheTtlNs) {
+
+    if (threadPool == NULL || hashFunc == NULL || equalsFunc == NULL || cacheCapacity < 0) {
+        fprintf(stderr, "Bad arguments for KeyedTasksCreate.\n");
+        return NULL;
+    }
+
+    TPKeyedTasks* tasks = malloc(sizeof(TPKeyedTasks));
+    if (tasks == NULL) {
+        fprintf(stderr, "Cannot allocate memory for keyed tasks.\n");
+        return NULL;
+    }
+    tasks->pool = threadPool;
+    tasks->hashFunc = hashFunc;
+    tasks->equalsFunc = equalsFunc;
+    tasks->releaseFunc = releaseFunc;
+    tasks->cacheCapacity = cacheCapacity;
+    tasks->cacheTtlNs = cacheTtlNs;
+    tasks->buckets = NULL;
+    tasks->numOfBuckets = 0;
+    tasks->numOfEntries = 0;
+    tasks->newest = NULL;
+    tasks->oldest = NULL;
+    tasks->numOfCached = 0;
+    tasks->numOfCoalesced = 0;
+    tasks->numOfHits = 0;
+    tasks->numOfRunning = 0;
+    pthread_mutex_init(&tasks->mutex, NULL);
+    pthread_cond_init(&tasks->cv, NULL);
+
+    return tasks;
+}
+
+/***
+ * Get the result for a key, from a cached result, the queued or running
+ * task for the key, or a new task. See tpKeyedTasksCreate.
+ * The result is only valid while doneFunc runs.
+ * If the insert works, the key belongs to the Keyed Tasks from then on: it is
+ * kept if it starts a task, else released at once with releaseFunc(key, NULL).
+ * If it fails, the key still belongs to the caller.
+ * @param tasks The Keyed Tasks.
+ * @param key The key, see releaseFunc.
+ * @param computeFunc The task, given the key and param, if it starts one.
+ * @param param The parameters to the task.
+ * @param doneFunc Run with the result and arg, on the caller for a cached result, else on a worker.
+ * @param arg The argument to doneFunc.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertKeyedTask(TPKeyedTasks* tasks, void* key, void* (*computeFunc) (void* key, void* param), void* param,
+                      void (*doneFunc)(void* result, void* arg), void* arg) {
+
+    if (tasks == NULL || computeFunc == NULL || doneFunc == NULL) {
+        fprintf(stderr, "Bad arguments for InsertKeyedTask.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    tp_keyed_waiter* waiter = malloc(sizeof(tp_keyed_waiter));
+    if (waiter == NULL) {
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    waiter->doneFunc = doneFunc;
+    waiter->arg = arg;
+    waiter->next = NULL;
+
+    uint64_t hash = (*(tasks->hashFunc))(key);
+    tp_keyed_entry* garbage = NULL;
+
+    if (pthread_mutex_lock(&tasks->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    tp_keyed_entry* entry = tpFindKeyedEntry(tasks, key, hash);
+
+    /* A stale result makes way for a new task. */
+    if (entry != NULL && entry->isDone && entry->expiresNs <= tpNowNs()) {
+        tpRemoveKeyedEntry(tasks, entry, &garbage);
+        entry = NULL;
+    }
+
+    if (entry != NULL && entry->isDone) {
+        entry->numOfReferences++;
+        tasks->numOfHits++;
+        tpUncacheKeyedEntry(tasks, entry);
+        tpCacheKeyedEntry(tasks, entry);
+        pthread_mutex_unlock(&tasks->mutex);
+        free(waiter);
+
+        (*doneFunc)(entry->result, arg);
+
+        pthread_mutex_lock(&tasks->mutex);
+        tpReleaseKeyedEntry(entry, &garbage);
+        pthread_mutex_unlock(&tasks->mutex);
+        tpFreeKeyedEntries(tasks->releaseFunc, garbage);
+        if (tasks->releaseFunc != NULL) {
+            (*(tasks->releaseFunc))(key, NULL);
+        }
+        return TASK_INSERT_SUCCESS;
+    }
+
+    if (entry != NULL) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        tasks->numOfCoalesced++;
+        pthread_mutex_unlock(&tasks->mutex);
+        tpFreeKeyedEntries(tasks->releaseFunc, garbage);
+        if (tasks->releaseFunc != NULL) {
+            (*(tasks->releaseFunc))(key, NULL);
+        }
+        return TASK_INSERT_SUCCESS;
+    }
+
+    entry = malloc(sizeof(tp_keyed_entry));
+    if (entry != NULL) {
+        entry->tasks = tasks;
+        entry->key = key;
+        entry->hash = hash;
+        entry->computeFunc = computeFunc;
+        entry->parameters = param;
+        entry->result = NULL;
+        entry->isDone = false;
+        entry->expiresNs = 0;
+        entry->numOfReferences = 1;
+        entry->waiters = waiter;
+        entry->newer = NULL;
+        entry->older = NULL;
+    }
+    if (entry == NULL || tpAddKeyedEntry(tasks, entry) != TP_SUCCESS) {
+        pthread_mutex_unlock(&tasks->mutex);
+        tpFreeKeyedEntries(tasks->releaseFunc, garbage);
+        free(entry);
+        free(waiter);
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    tasks->numOfRunning++;
+    pthread_mutex_unlock(&tasks->mutex);
+    tpFreeKeyedEntries(tasks->releaseFunc, garbage);
+
+    if (tpInsertTask(tasks->pool, tpRunKeyedTask, entry) != TASK_INSERT_SUCCESS) {
+        /* Waiters may have attached already: they are served here, by the caller. */
+        tpRunKeyedTask(entry);
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Free a set of Keyed Tasks and its cached results, once its tasks are done.
+ * No inserts may come in meanwhile.
+ * A task calling this is in a blocking region, see tpBlockingBegin.
+ * @param tasks The Keyed Tasks.
+ */
+void tpKeyedTasksDestroy(TPKeyedTasks* tasks) {
+
+    if (tasks == NULL) {
+        return;
+    }
+
+    tpBlockingBegin();
+    pthread_mutex_lock(&tasks->mutex);
+    while (tasks->numOfRunning > 0) {
+        pthread_cond_wait(&tasks->cv, &tasks->mutex);
+    }
+    pthread_mutex_unlock(&tasks->mutex);
+    tpBlockingEnd();
+
+    tp_keyed_entry* garbage = NULL;
+    while (tasks->newest != NULL) {
+        tpRemoveKeyedEntry(tasks, tasks->newest, &garbage);
+    }
+    tpFreeKeyedEntries(tasks->releaseFunc, garbage);
+
+    free(tasks->buckets);
+    pthread_cond_destroy(&tasks->cv);
+    pthread_mutex_destroy(&tasks->mutex);
+    free(tasks);
+}
+
+/***
+ * Run the task of a key, then serve its result to every insert that waited for it.
+ * @param entry The entry of the key.
+ */
+void tpRunKeyedTask(void* entry) {
+
+    tp_keyed_entry* self = (tp_keyed_entry*) entry;
+    TPKeyedTasks* tasks = self->tasks;
+    void (*releaseFunc)(void* key, void* result) = tasks->releaseFunc;
+    tp_keyed_entry* garbage = NULL;
+
+    void* result = (*(self->computeFunc))(self->key, self->parameters);
+
+    pthread_mutex_lock(&tasks->mutex);
+    self->result = result;
+    self->isDone = true;
+    tp_keyed_waiter* waiters = self->waiters;
+    self->waiters = NULL;
+    self->numOfReferences++;
+    if (tasks->cacheCapacity > 0) {
+        self->expiresNs = tpNowNs() + tasks->cacheTtlNs;
+        tpCacheKeyedEntry(tasks, self);
+        if (tasks->numOfCached > tasks->cacheCapacity) {
+            tpRemoveKeyedEntry(tasks, tasks->oldest, &garbage);
+        }
+    } else {
+        tpRemoveKeyedEntry(tasks, self, &garbage);
+    }
+    pthread_mutex_unlock(&tasks->mutex);
+
+    while (waiters != NULL) {
+        tp_keyed_waiter* waiter = waiters;
+        waiters = waiter->next;
+        (*(waiter->doneFunc))(result, waiter->arg);
+        free(waiter);
+    }
+
+    /* The Keyed Tasks may be freed once this task is no longer counted. */
+    pthread_mutex_lock(&tasks->mutex);
+    tpReleaseKeyedEntry(self, &garbage);
+    if (--tasks->numOfRunning == 0) {
+        pthread_cond_broadcast(&tasks->cv);
+    }
+    pthread_mutex_unlock(&tasks->mutex);
+    tpFreeKeyedEntries(releaseFunc, garbage);
+}
+
+/***
+ * Find the entry of a key.
+ * The mutex of the Keyed Tasks must be locked.
+ * @return The entry, or NULL if there is none.
+ */
+tp_keyed_entry* tpFindKeyedEntry(TPKeyedTasks* tasks, const void* key, uint64_t hash) {
+
+    if (tasks->numOfBuckets == 0) {
+        return NULL;
+    }
+    for (tp_keyed_entry* entry = tasks->buckets[hash & (tasks->numOfBuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && (*(tasks->equalsFunc))(entry->key, key)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/***
+ * Add an entry to the table, growing it at one entry per bucket.
+ * The mutex of the Keyed Tasks must be locked, and entry->hash set.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpAddKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry) {
+
+    if (tasks->numOfEntries >= tasks->numOfBuckets) {
+        size_t numOfBuckets = tasks->numOfBuckets == 0 ? 64 : tasks->numOfBuckets * 2;
+        tp_keyed_entry** buckets = calloc(numOfBuckets, sizeof(tp_keyed_entry*));
+        if (buckets == NULL) {
+            return TP_FAILURE;
+        }
+        for (size_t i = 0; i < tasks->numOfBuckets; ++i) {
+            tp_keyed_entry* other = tasks->buckets[i];
+            while (other != NULL) {
+                tp_keyed_entry* next = other->next;
+                other->next = buckets[other->hash & (numOfBuckets - 1)];
+                buckets[other->hash & (numOfBuckets - 1)] = other;
+                other = next;
+            }
+        }
+        free(tasks->buckets);
+        tasks->buckets = buckets;
+        tasks->numOfBuckets = numOfBuckets;
+    }
+
+    entry->next = tasks->buckets[entry->hash & (tasks->numOfBuckets - 1)];
+    tasks->buckets[entry->hash & (tasks->numOfBuckets - 1)] = entry;
+    tasks->numOfEntries++;
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Take an entry out of the table and the cache, and drop the table's reference.
+ * The mutex of the Keyed Tasks must be locked.
+ * @param tasks The Keyed Tasks.
+ * @param entry The entry, in the table.
+ * @param garbage Where to add the entry if it is to be freed.
+ */
+void tpRemoveKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry, tp_keyed_entry** garbage) {
+
+    tp_keyed_entry** link = &tasks->buckets[entry->hash & (tasks->numOfBuckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    tasks->numOfEntries--;
+
+    /* Every done entry in the table is cached, if there is a cache. */
+    if (entry->isDone && tasks->cacheCapacity > 0) {
+        tpUncacheKeyedEntry(tasks, entry);
+    }
+    tpReleaseKeyedEntry(entry, garbage);
+}
+
+/***
+ * Drop a reference to an entry.
+ * The mutex of the Keyed Tasks must be locked.
+ * @param entry The entry.
+ * @param garbage Where to add the entry if it is to be freed.
+ */
+void tpReleaseKeyedEntry(tp_keyed_entry* entry, tp_keyed_entry** garbage) {
+
+    if (--entry->numOfReferences == 0) {
+        entry->next = *garbage;
+        *garbage = entry;
+    }
+}
+
+/***
+ * Put a done entry at the most recent end of the cache.
+ * The mutex of the Keyed Tasks must be locked.
+ */
+void tpCacheKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry) {
+
+    entry->older = tasks->newest;
+    entry->newer = NULL;
+    if (tasks->newest != NULL) {
+        tasks->newest->newer = entry;
+    } else {
+        tasks->oldest = entry;
+    }
+    tasks->newest = entry;
+    tasks->numOfCached++;
+}
+
+/***
+ * Take a done entry out of the cache order.
+ * The mutex of the Keyed Tasks must be locked.
+ */
+void tpUncacheKeyedEntry(TPKeyedTasks* tasks, tp_keyed_entry* entry) {
+
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        tasks->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        tasks->oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+    tasks->numOfCached--;
+}
+
+/***
+ * Release the keys and results of freed entries, and free them.
+ * @param releaseFunc The release function of the Keyed Tasks.
+ * @param garbage The entries, chained by next.
+ */
+void tpFreeKeyedEntries(void (*releaseFunc)(void* key, void* result), tp_keyed_entry* garbage) {
+
+    while (garbage != NULL) {
+        tp_keyed_entry* entry = garbage;
+        garbage = entry->next;
+        if (releaseFunc != NULL) {
+            (*releaseFunc)(entry->key, entry->result);
+        }
+        free(entry);
+    }
+}
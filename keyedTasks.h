@@ -0,0 +1,70 @@
+#ifndef __KEYED_TASKS__
+#define __KEYED_TASKS__
+
+#include "threadPool.h"
+
+/// Keyed Waiter struct.
+
+typedef struct tp_keyed_waiter
+{
+    void (*doneFunc)(void* result, void* arg); /* Run with the result of the key's task. */
+    void* arg;                   /* The argument to doneFunc. */
+    struct tp_keyed_waiter* next; /* The next waiter. */
+
+}tp_keyed_waiter;
+
+/// Keyed Entry struct.
+
+typedef struct tp_keyed_entry
+{
+    struct tp_keyed_tasks* tasks; /* The keyed tasks the entry belongs to. */
+    void* key;                   /* The key, from the insert that started the task. */
+    uint64_t hash;               /* The hash of key. */
+    void* (*computeFunc)(void* key, void* param); /* The task. */
+    void* parameters;            /* The parameters to the task. */
+    void* result;                /* The result, once the task is done. */
+    bool isDone;                 /* Is the task done, and the entry cached? */
+    uint64_t expiresNs;          /* When a cached result is stale. */
+    int numOfReferences;         /* The deliveries of result in progress, plus one while in the table. */
+    tp_keyed_waiter* waiters;    /* Who waits for the result of a running task. */
+    struct tp_keyed_entry* next; /* The next entry in the bucket. */
+    struct tp_keyed_entry* newer; /* The more recently cached entry. */
+    struct tp_keyed_entry* older; /* The less recently cached entry. */
+
+}tp_keyed_entry;
+
+/// Keyed Tasks struct.
+
+typedef struct tp_keyed_tasks
+{
+    ThreadPool* pool;            /* The Thread Pool running the tasks. */
+    uint64_t (*hashFunc)(const void* key); /* Hashes a key. */
+    bool (*equalsFunc)(const void* key, const void* other); /* Tells if two keys are equal. */
+    void (*releaseFunc)(void* key, void* result); /* Optional, run when a key and its result, if any, are no longer used. */
+    int cacheCapacity;           /* The most results cached, 0 to not cache. */
+    uint64_t cacheTtlNs;         /* How long a result stays cached. */
+    tp_keyed_entry** buckets;    /* The running and cached entries, chained by hash. */
+    size_t numOfBuckets;         /* The size of buckets, a power of two. */
+    size_t numOfEntries;         /* The number of entries in buckets. */
+    tp_keyed_entry* newest;      /* The most recently cached entry. */
+    tp_keyed_entry* oldest;      /* The least recently cached entry, evicted first. */
+    int numOfCached;             /* The number of cached entries. */
+    long numOfCoalesced;         /* The inserts that attached to a running task. */
+    long numOfHits;              /* The inserts served from the cache. */
+    int numOfRunning;            /* The tasks queued or running. */
+    pthread_mutex_t mutex;       /* The mutex for the entries. */
+    pthread_cond_t cv;           /* Broadcast when the last running task is done. */
+
+}TPKeyedTasks;
+
+TPKeyedTasks* tpKeyedTasksCreate(ThreadPool* threadPool, uint64_t (*hashFunc)(const void* key),
+                                 bool (*equalsFunc)(const void* key, const void* other),
+                                 void (*releaseFunc)(void* key, void* result),
+                                 int cacheCapacity, uint64_t cacheTtlNs);
+
+int tpInsertKeyedTask(TPKeyedTasks* tasks, void* key, void* (*computeFunc) (void* key, void* param), void* param,
+                      void (*doneFunc)(void* result, void* arg), void* arg);
+
+void tpKeyedTasksDestroy(TPKeyedTasks* tasks);
+
+#endif
@@ -0,0 +1,83 @@
+#include "latch.h"
+
+/***
+ * Initialize a countdown Latch:
+ * tpLatchWait returns once tpLatchCountDown was called count times,
+ * e.g. once by each of count tasks.
+ * @param latch The Latch.
+ * @param count The number of count downs to wait for.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpLatchInit(TPLatch* latch, int count) {
+
+    if (latch == NULL || count < 0) {
+        fprintf(stderr, "Bad arguments for LatchInit.\n");
+        return TP_FAILURE;
+    }
+    if (pthread_mutex_init(&latch->mutex, NULL) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+    if (pthread_cond_init(&latch->cv, NULL) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        pthread_mutex_destroy(&latch->mutex);
+        return TP_FAILURE;
+    }
+    latch->count = count;
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Count a Latch down, releasing its waiters on the last count down.
+ * @param latch The Latch.
+ */
+void tpLatchCountDown(TPLatch* latch) {
+
+    if (pthread_mutex_lock(&latch->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (latch->count > 0 && --latch->count == 0) {
+        pthread_cond_broadcast(&latch->cv);
+    }
+    if (pthread_mutex_unlock(&latch->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Wait until a Latch is counted down to 0.
+ * A task waiting is in a blocking region, see tpBlockingBegin, so the
+ * tasks it waits for can still get a worker.
+ * @param latch The Latch.
+ */
+void tpLatchWait(TPLatch* latch) {
+
+    if (pthread_mutex_lock(&latch->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (latch->count > 0) {
+        pthread_mutex_unlock(&latch->mutex);
+        tpBlockingBegin();
+        pthread_mutex_lock(&latch->mutex);
+        while (latch->count > 0) {
+            pthread_cond_wait(&latch->cv, &latch->mutex);
+        }
+        pthread_mutex_unlock(&latch->mutex);
+        tpBlockingEnd();
+        return;
+    }
+    if (pthread_mutex_unlock(&latch->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Free the resources of a Latch no one waits on.
+ * @param latch The Latch.
+ */
+void tpLatchDestroy(TPLatch* latch) {
+
+    pthread_cond_destroy(&latch->cv);
+    pthread_mutex_destroy(&latch->mutex);
+}
@@ -0,0 +1,24 @@
+#ifndef __LATCH__
+#define __LATCH__
+
+#include "threadPool.h"
+
+/// Latch struct.
+
+typedef struct tp_latch
+{
+    pthread_mutex_t mutex;       /* The mutex for count. */
+    pthread_cond_t cv;           /* Broadcast when count reaches 0. */
+    int count;                   /* The number of count downs left. */
+
+}TPLatch;
+
+int tpLatchInit(TPLatch* latch, int count);
+
+void tpLatchCountDown(TPLatch* latch);
+
+void tpLatchWait(TPLatch* latch);
+
+void tpLatchDestroy(TPLatch* latch);
+
+#endif
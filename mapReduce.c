@@ -0,0 +1,336 @@
+#include "mapReduce.h"
+#include <string.h>
+
+void tpRunMapTask(void* task);
+void tpRunReduceTask(void* task);
+tp_map_reduce_entry* tpMapReduceFind(tp_map_reduce_table* table, void* key, uint64_t hash,
+                                     bool (*equalsFunc)(const void*, const void*));
+int tpMapReduceAddValue(tp_map_reduce_entry* entry, void* value);
+void tpMapReduceClearTable(tp_map_reduce_table* table);
+uint64_t tpMapReduceMix(uint64_t hash);
+
+/***
+ * Create a MapReduce job:
+ * Map tasks, one per input, emit key / value pairs into tables private to
+ * the worker running them, split into partitions by key hash, so emits
+ * never lock. With a combiner, the values of a key on one worker are
+ * merged as they are emitted, keeping a single value per key per worker.
+ * Then one reduce task per partition gathers the partition from every
+ * worker and reduces each of its keys, the partitions in parallel.
+ * @param threadPool The Thread Pool to run the tasks.
+ * @param spec What the job does, mapFunc, reduceFunc, hashFunc and equalsFunc are required.
+ * @return A pointer to the new job, or NULL if failed.
+ */
+TPMapReduce* tpMapReduceCreate(ThreadPool* threadPool, const TPMapReduceSpec* spec) {
+
+    if (threadPool == NULL || spec == NULL || spec->mapFunc == NULL || spec->reduceFunc == NULL
+        || spec->hashFunc == NULL || spec->equalsFunc == NULL || spec->numOfPartitions < 0) {
+        fprintf(stderr, "Bad arguments for MapReduceCreate.\n");
+        return NULL;
+    }
+
+    TPMapReduce* job = malloc(sizeof(TPMapReduce));
+    if (job == NULL) {
+        fprintf(stderr, "Cannot allocate memory for map reduce.\n");
+        return NULL;
+    }
+    job->pool = threadPool;
+    job->spec = *spec;
+    if (job->spec.numOfPartitions == 0) {
+        job->spec.numOfPartitions = TP_DEFAULT_NUM_OF_PARTITIONS;
+    }
+    job->numOfTables = threadPool->numOfWorkers + 1;
+    job->tables = calloc((size_t) job->numOfTables * job->spec.numOfPartitions, sizeof(tp_map_reduce_table));
+    if (job->tables == NULL) {
+        fprintf(stderr, "Cannot allocate memory for tables.\n");
+        free(job);
+        return NULL;
+    }
+    atomic_store(&job->numOfKeys, 0);
+    pthread_mutex_init(&job->mutexOutside, NULL);
+
+    return job;
+}
+
+/***
+ * Run a MapReduce job on a set of inputs, and wait until every key is reduced.
+ * A task calling this is in a blocking region, see tpBlockingBegin.
+ * @param job The job.
+ * @param inputs The inputs, one map task each.
+ * @param numOfInputs The size of inputs.
+ * @return The number of keys reduced, or -1 if failed.
+ */
+long tpMapReduceRun(TPMapReduce* job, void** inputs, int numOfInputs) {
+
+    if (job == NULL || (inputs == NULL && numOfInputs > 0) || numOfInputs < 0) {
+        fprintf(stderr, "Bad arguments for MapReduceRun.\n");
+        return TP_FAILURE;
+    }
+
+    int numOfPartitions = job->spec.numOfPartitions;
+    int numOfTasks = numOfInputs > numOfPartitions ? numOfInputs : numOfPartitions;
+    tp_map_reduce_task* tasks = malloc(sizeof(tp_map_reduce_task) * numOfTasks);
+    if (tasks == NULL) {
+        fprintf(stderr, "Cannot allocate memory for tasks.\n");
+        return TP_FAILURE;
+    }
+
+    /* Map. */
+    if (tpLatchInit(&job->done, numOfInputs) != TP_SUCCESS) {
+        free(tasks);
+        return TP_FAILURE;
+    }
+    for (int i = 0; i < numOfInputs; ++i) {
+        tasks[i].job = job;
+        tasks[i].input = inputs[i];
+        if (tpInsertTask(job->pool, tpRunMapTask, &tasks[i]) != TASK_INSERT_SUCCESS) {
+            tpRunMapTask(&tasks[i]);
+        }
+    }
+    tpLatchWait(&job->done);
+    tpLatchDestroy(&job->done);
+
+    /* Reduce. */
+    atomic_store(&job->numOfKeys, 0);
+    if (tpLatchInit(&job->done, numOfPartitions) != TP_SUCCESS) {
+        for (int i = 0; i < job->numOfTables * numOfPartitions; ++i) {
+            tpMapReduceClearTable(&job->tables[i]);
+        }
+        free(tasks);
+        return TP_FAILURE;
+    }
+    for (int i = 0; i < numOfPartitions; ++i) {
+        tasks[i].job = job;
+        tasks[i].partition = i;
+        if (tpInsertTask(job->pool, tpRunReduceTask, &tasks[i]) != TASK_INSERT_SUCCESS) {
+            tpRunReduceTask(&tasks[i]);
+        }
+    }
+    tpLatchWait(&job->done);
+    tpLatchDestroy(&job->done);
+
+    free(tasks);
+
+    return atomic_load(&job->numOfKeys);
+}
+
+/***
+ * Emit a key / value pair from a map task, or from any thread during the map phase.
+ * Both must stay valid until the run is over, and are not freed by the job.
+ * @param job The job.
+ * @param key The key.
+ * @param value The value.
+ */
+void tpMapReduceEmit(TPMapReduce* job, void* key, void* value) {
+
+    /* Only the workers of the job's pool own tables, any other thread shares the locked ones. */
+    int workerIndex = tpCurrentPool() == job->pool ? tpCurrentWorkerIndex() : -1;
+    bool isOutside = workerIndex < 0 || workerIndex >= job->numOfTables - 1;
+    if (isOutside) {
+        workerIndex = job->numOfTables - 1;
+        pthread_mutex_lock(&job->mutexOutside);
+    }
+
+    uint64_t hash = tpMapReduceMix((*(job->spec.hashFunc))(key));
+    int partition = (int) ((hash >> 32) % (uint64_t) job->spec.numOfPartitions);
+    tp_map_reduce_table* table = &job->tables[(size_t) workerIndex * job->spec.numOfPartitions + partition];
+
+    tp_map_reduce_entry* entry = tpMapReduceFind(table, key, hash, job->spec.equalsFunc);
+    if (entry != NULL && entry->numOfValues > 0 && job->spec.combineFunc != NULL) {
+        entry->values[0] = (*(job->spec.combineFunc))(entry->key, entry->values[0], value, job->spec.arg);
+    } else if (entry == NULL || tpMapReduceAddValue(entry, value) != TP_SUCCESS) {
+        fprintf(stderr, "Cannot allocate memory for pair, it is dropped.\n");
+    }
+
+    if (isOutside) {
+        pthread_mutex_unlock(&job->mutexOutside);
+    }
+}
+
+/***
+ * Free a MapReduce job that is not running.
+ * @param job The job.
+ */
+void tpMapReduceDestroy(TPMapReduce* job) {
+
+    if (job == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < job->numOfTables * job->spec.numOfPartitions; ++i) {
+        tpMapReduceClearTable(&job->tables[i]);
+        free(job->tables[i].buckets);
+    }
+    free(job->tables);
+    pthread_mutex_destroy(&job->mutexOutside);
+    free(job);
+}
+
+/***
+ * Run the map function on an input.
+ * @param task The map task.
+ */
+void tpRunMapTask(void* task) {
+
+    tp_map_reduce_task* self = (tp_map_reduce_task*) task;
+    TPMapReduce* job = self->job;
+
+    (*(job->spec.mapFunc))(job, self->input, job->spec.arg);
+
+    tpLatchCountDown(&job->done);
+}
+
+/***
+ * Gather a partition from every worker's tables and reduce each of its keys.
+ * @param task The reduce task.
+ */
+void tpRunReduceTask(void* task) {
+
+    tp_map_reduce_task* self = (tp_map_reduce_task*) task;
+    TPMapReduce* job = self->job;
+    int numOfPartitions = job->spec.numOfPartitions;
+    tp_map_reduce_table merged = {NULL, 0, 0};
+
+    for (int i = 0; i < job->numOfTables; ++i) {
+        tp_map_reduce_table* table = &job->tables[(size_t) i * numOfPartitions + self->partition];
+        for (size_t bucket = 0; bucket < table->numOfBuckets; ++bucket) {
+            for (tp_map_reduce_entry* entry = table->buckets[bucket]; entry != NULL; entry = entry->next) {
+                tp_map_reduce_entry* into = tpMapReduceFind(&merged, entry->key, entry->hash, job->spec.equalsFunc);
+                for (int k = 0; into != NULL && k < entry->numOfValues; ++k) {
+                    if (tpMapReduceAddValue(into, entry->values[k]) != TP_SUCCESS) {
+                        into = NULL;
+                    }
+                }
+                if (into == NULL) {
+                    fprintf(stderr, "Cannot allocate memory for pair, it is dropped.\n");
+                }
+            }
+        }
+        tpMapReduceClearTable(table);
+    }
+
+    for (size_t bucket = 0; bucket < merged.numOfBuckets; ++bucket) {
+        for (tp_map_reduce_entry* entry = merged.buckets[bucket]; entry != NULL; entry = entry->next) {
+            (*(job->spec.reduceFunc))(entry->key, entry->values, entry->numOfValues, job->spec.arg);
+        }
+    }
+    atomic_fetch_add(&job->numOfKeys, (long) merged.numOfEntries);
+    tpMapReduceClearTable(&merged);
+    free(merged.buckets);
+
+    tpLatchCountDown(&job->done);
+}
+
+/***
+ * Find the entry of a key in a table, adding an empty one if there is none.
+ * @param table The table.
+ * @param key The key.
+ * @param hash The mixed hash of key.
+ * @param equalsFunc Tells if two keys are equal.
+ * @return The entry, or NULL if failed.
+ */
+tp_map_reduce_entry* tpMapReduceFind(tp_map_reduce_table* table, void* key, uint64_t hash,
+                                     bool (*equalsFunc)(const void*, const void*)) {
+
+    if (table->numOfBuckets > 0) {
+        for (tp_map_reduce_entry* entry = table->buckets[hash & (table->numOfBuckets - 1)];
+             entry != NULL; entry = entry->next) {
+            if (entry->hash == hash && (*equalsFunc)(entry->key, key)) {
+                return entry;
+            }
+        }
+    }
+
+    /* Grow at one key per bucket. */
+    if (table->numOfEntries >= table->numOfBuckets) {
+        size_t numOfBuckets = table->numOfBuckets == 0 ? 16 : table->numOfBuckets * 2;
+        tp_map_reduce_entry** buckets = calloc(numOfBuckets, sizeof(tp_map_reduce_entry*));
+        if (buckets == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < table->numOfBuckets; ++i) {
+            tp_map_reduce_entry* entry = table->buckets[i];
+            while (entry != NULL) {
+                tp_map_reduce_entry* next = entry->next;
+                entry->next = buckets[entry->hash & (numOfBuckets - 1)];
+                buckets[entry->hash & (numOfBuckets - 1)] = entry;
+                entry = next;
+            }
+        }
+        free(table->buckets);
+        table->buckets = buckets;
+        table->numOfBuckets = numOfBuckets;
+    }
+
+    tp_map_reduce_entry* entry = malloc(sizeof(tp_map_reduce_entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->key = key;
+    entry->hash = hash;
+    entry->values = NULL;
+    entry->numOfValues = 0;
+    entry->capacity = 0;
+    entry->next = table->buckets[hash & (table->numOfBuckets - 1)];
+    table->buckets[hash & (table->numOfBuckets - 1)] = entry;
+    table->numOfEntries++;
+
+    return entry;
+}
+
+/***
+ * Add a value to an entry.
+ * @param entry The entry.
+ * @param value The value.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpMapReduceAddValue(tp_map_reduce_entry* entry, void* value) {
+
+    if (entry->numOfValues == entry->capacity) {
+        int capacity = entry->capacity == 0 ? 1 : entry->capacity * 2;
+        void** values = realloc(entry->values, sizeof(void*) * capacity);
+        if (values == NULL) {
+            return TP_FAILURE;
+        }
+        entry->values = values;
+        entry->capacity = capacity;
+    }
+    entry->values[entry->numOfValues++] = value;
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Free the entries of a table, keeping its buckets for the next run.
+ * @param table The table.
+ */
+void tpMapReduceClearTable(tp_map_reduce_table* table) {
+
+    for (size_t i = 0; i < table->numOfBuckets; ++i) {
+        tp_map_reduce_entry* entry = table->buckets[i];
+        while (entry != NULL) {
+            tp_map_reduce_entry* next = entry->next;
+            free(entry->values);
+            free(entry);
+            entry = next;
+        }
+        table->buckets[i] = NULL;
+    }
+    table->numOfEntries = 0;
+}
+
+/***
+ * Spread a user hash over all 64 bits, so partitions and buckets both get good bits.
+ * @param hash The hash.
+ * @return The mixed hash.
+ */
+uint64_t tpMapReduceMix(uint64_t hash) {
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
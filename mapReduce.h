@@ -0,0 +1,81 @@
+#ifndef __MAP_REDUCE__
+#define __MAP_REDUCE__
+
+#include "latch.h"
+#include <stdatomic.h>
+
+/* The default number of partitions, see TPMapReduceSpec. */
+#define TP_DEFAULT_NUM_OF_PARTITIONS 64
+
+struct tp_map_reduce;
+
+/// Map Reduce Spec struct.
+
+typedef struct tp_map_reduce_spec
+{
+    void (*mapFunc)(struct tp_map_reduce* job, void* input, void* arg); /* Emits the pairs of an input with tpMapReduceEmit. */
+    void* (*combineFunc)(void* key, void* value, void* other, void* arg); /* Optional, merges two values of a key on one worker. */
+    void (*reduceFunc)(void* key, void** values, int numOfValues, void* arg); /* Run once per key. */
+    uint64_t (*hashFunc)(const void* key); /* Hashes a key. */
+    bool (*equalsFunc)(const void* key, const void* other); /* Tells if two keys are equal. */
+    void* arg;                   /* The argument to the functions. */
+    int numOfPartitions;         /* The number of reduce tasks, 0 for the default. */
+
+}TPMapReduceSpec;
+
+/// Map Reduce Entry struct.
+
+typedef struct tp_map_reduce_entry
+{
+    void* key;                   /* The key. */
+    uint64_t hash;               /* The hash of key. */
+    void** values;               /* The values of key, a single one if combined. */
+    int numOfValues;             /* The number of values. */
+    int capacity;                /* The size of values. */
+    struct tp_map_reduce_entry* next; /* The next entry in the bucket. */
+
+}tp_map_reduce_entry;
+
+/// Map Reduce Table struct.
+
+typedef struct tp_map_reduce_table
+{
+    tp_map_reduce_entry** buckets; /* The entries, chained by hash. */
+    size_t numOfBuckets;         /* The size of buckets, a power of two. */
+    size_t numOfEntries;         /* The number of keys. */
+
+}tp_map_reduce_table;
+
+/// Map Reduce Task struct.
+
+typedef struct tp_map_reduce_task
+{
+    struct tp_map_reduce* job;   /* The job. */
+    void* input;                 /* The input of a map task. */
+    int partition;               /* The partition of a reduce task. */
+
+}tp_map_reduce_task;
+
+/// Map Reduce struct.
+
+typedef struct tp_map_reduce
+{
+    ThreadPool* pool;            /* The Thread Pool running the tasks. */
+    TPMapReduceSpec spec;        /* What the job does. */
+    int numOfTables;             /* The number of workers, plus one for emits from other threads. */
+    tp_map_reduce_table* tables; /* The tables of each worker, numOfPartitions per worker. */
+    pthread_mutex_t mutexOutside; /* The mutex for the tables of emits from other threads. */
+    atomic_long numOfKeys;       /* The number of keys reduced in this run. */
+    TPLatch done;                /* Counted down by the tasks of a phase. */
+
+}TPMapReduce;
+
+TPMapReduce* tpMapReduceCreate(ThreadPool* threadPool, const TPMapReduceSpec* spec);
+
+long tpMapReduceRun(TPMapReduce* job, void** inputs, int numOfInputs);
+
+void tpMapReduceEmit(TPMapReduce* job, void* key, void* value);
+
+void tpMapReduceDestroy(TPMapReduce* job);
+
+#endif
@@ -0,0 +1,151 @@
+#include "mmapChunks.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void tpRunMappedChunk(void* chunk);
+void tpAdviseChunk(tp_mapped_job* job, size_t chunkIndex);
+
+/***
+ * Process a file in parallel, chunk by chunk:
+ * The file is mapped read-only and split at every chunkSize bytes, each
+ * split moved forward past the next delimiter so records are never cut.
+ * Each chunk is a task on the pool. A chunk that starts hints the kernel
+ * to read ahead the chunk one round of workers later, so chunks are
+ * usually in memory by the time a worker gets to them.
+ * Waits for all chunks; a task calling this is in a blocking region, see tpBlockingBegin.
+ * @param threadPool The Thread Pool.
+ * @param path The path of the file.
+ * @param chunkSize The size to split at, rounded up to whole pages, 0 for the default.
+ * @param delimiter The byte that ends a record, e.g. '\n', or TP_NO_DELIMITER.
+ * @param processChunk Run on a worker per chunk, given the chunk, its size, its index and arg.
+ * @param arg The argument to processChunk.
+ * @return The number of chunks processed, or -1 if failed.
+ */
+long tpProcessMappedFile(ThreadPool* threadPool, const char* path, size_t chunkSize, int delimiter,
+                         void (*processChunk)(const char* data, size_t length, size_t chunkIndex, void* arg),
+                         void* arg) {
+
+    if (threadPool == NULL || path == NULL || processChunk == NULL || delimiter < TP_NO_DELIMITER || delimiter > 255) {
+        fprintf(stderr, "Bad arguments for ProcessMappedFile.\n");
+        return TP_FAILURE;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return TP_FAILURE;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        close(fd);
+        return TP_FAILURE;
+    }
+    if (status.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    tp_mapped_job job;
+    job.size = (size_t) status.st_size;
+    job.data = mmap(NULL, job.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (job.data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s.\n", path);
+        return TP_FAILURE;
+    }
+
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    if (chunkSize == 0) {
+        chunkSize = TP_DEFAULT_CHUNK_SIZE;
+    }
+    chunkSize = (chunkSize + pageSize - 1) / pageSize * pageSize;
+
+    job.chunks = malloc(sizeof(tp_mapped_chunk) * (job.size / chunkSize + 1));
+    if (job.chunks == NULL) {
+        fprintf(stderr, "Cannot allocate memory for chunks.\n");
+        munmap((void*) job.data, job.size);
+        return TP_FAILURE;
+    }
+
+    /* Cut at the page aligned split points, moved past the next delimiter. */
+    job.numOfChunks = 0;
+    size_t start = 0;
+    while (start < job.size) {
+        size_t end = (start / chunkSize + 1) * chunkSize;
+        if (end >= job.size) {
+            end = job.size;
+        } else if (delimiter != TP_NO_DELIMITER) {
+            const char* found = memchr(job.data + end - 1, delimiter, job.size - (end - 1));
+            end = found == NULL ? job.size : (size_t) (found - job.data) + 1;
+        }
+        job.chunks[job.numOfChunks].job = &job;
+        job.chunks[job.numOfChunks].offset = start;
+        job.chunks[job.numOfChunks].length = end - start;
+        job.numOfChunks++;
+        start = end;
+    }
+
+    job.readahead = (size_t) threadPool->numOfThreads;
+    job.processChunk = processChunk;
+    job.arg = arg;
+    if (tpLatchInit(&job.done, (int) job.numOfChunks) != TP_SUCCESS) {
+        free(job.chunks);
+        munmap((void*) job.data, job.size);
+        return TP_FAILURE;
+    }
+
+    /* The first round of chunks is read ahead here, later ones by the chunks before them. */
+    for (size_t i = 0; i < job.readahead && i < job.numOfChunks; ++i) {
+        tpAdviseChunk(&job, i);
+    }
+    for (size_t i = 0; i < job.numOfChunks; ++i) {
+        if (tpInsertTask(threadPool, tpRunMappedChunk, &job.chunks[i]) != TASK_INSERT_SUCCESS) {
+            tpRunMappedChunk(&job.chunks[i]);
+        }
+    }
+
+    tpLatchWait(&job.done);
+
+    tpLatchDestroy(&job.done);
+    free(job.chunks);
+    munmap((void*) job.data, job.size);
+
+    return (long) job.numOfChunks;
+}
+
+/***
+ * Process a chunk, after hinting the read ahead of a later one.
+ * @param chunk The chunk.
+ */
+void tpRunMappedChunk(void* chunk) {
+
+    tp_mapped_chunk* self = (tp_mapped_chunk*) chunk;
+    tp_mapped_job* job = self->job;
+    size_t chunkIndex = (size_t) (self - job->chunks);
+
+    if (chunkIndex + job->readahead < job->numOfChunks) {
+        tpAdviseChunk(job, chunkIndex + job->readahead);
+    }
+
+    (*(job->processChunk))(job->data + self->offset, self->length, chunkIndex, job->arg);
+
+    tpLatchCountDown(&job->done);
+}
+
+/***
+ * Hint the kernel to read a chunk in.
+ * @param job The job.
+ * @param chunkIndex The chunk.
+ */
+void tpAdviseChunk(tp_mapped_job* job, size_t chunkIndex) {
+
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    tp_mapped_chunk* chunk = &job->chunks[chunkIndex];
+    size_t alignedOffset = chunk->offset / pageSize * pageSize;
+
+    madvise((void*) (job->data + alignedOffset), chunk->length + (chunk->offset - alignedOffset), MADV_WILLNEED);
+}
@@ -0,0 +1,41 @@
+#ifndef __MMAP_CHUNKS__
+#define __MMAP_CHUNKS__
+
+#include "latch.h"
+
+/* Pass as the delimiter to split chunks at any byte. */
+#define TP_NO_DELIMITER (-1)
+
+/* The default chunk size, see tpProcessMappedFile. */
+#define TP_DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+
+/// Mapped Chunk struct.
+
+typedef struct tp_mapped_chunk
+{
+    struct tp_mapped_job* job;   /* The job the chunk belongs to. */
+    size_t offset;               /* Where the chunk starts in the file. */
+    size_t length;               /* The size of the chunk. */
+
+}tp_mapped_chunk;
+
+/// Mapped Job struct.
+
+typedef struct tp_mapped_job
+{
+    const char* data;            /* The mapped file. */
+    size_t size;                 /* The size of the file. */
+    tp_mapped_chunk* chunks;     /* The chunks, in file order. */
+    size_t numOfChunks;          /* The size of chunks. */
+    size_t readahead;            /* How many chunks ahead a starting chunk hints the kernel to read. */
+    void (*processChunk)(const char* data, size_t length, size_t chunkIndex, void* arg); /* Run per chunk. */
+    void* arg;                   /* The argument to processChunk. */
+    TPLatch done;                /* Counted down by each chunk. */
+
+}tp_mapped_job;
+
+long tpProcessMappedFile(ThreadPool* threadPool, const char* path, size_t chunkSize, int delimiter,
+                         void (*processChunk)(const char* data, size_t length, size_t chunkIndex, void* arg),
+                         void* arg);
+
+#endif
@@ -0,0 +1,306 @@
+#include "pipeline.h"
+
+/* The most tokens one step of a pipeline makes ready to run. */
+#define TP_PIPELINE_MAX_READY 4
+
+void tpRunPipelineStage(void* token);
+void tpPipelineForward(TPPipeline* pipeline, tp_pipeline_token* token, tp_pipeline_token** ready, int* numOfReady);
+void tpPipelineStartInput(TPPipeline* pipeline, tp_pipeline_token** ready, int* numOfReady);
+void tpPipelineTakeWaiting(TPPipeline* pipeline, tp_pipeline_stage* stage, tp_pipeline_token** ready, int* numOfReady);
+void tpPipelineDispatch(TPPipeline* pipeline, tp_pipeline_token** ready, int numOfReady);
+
+/***
+ * Create a Pipeline:
+ * Items from an input stage flow through a chain of stages, each stage a
+ * task on the pool. A serial stage takes one item at a time, in input
+ * order; a parallel stage takes items as they come. At most maxTokens
+ * items are between the input and the end of the chain at once, so a
+ * slow stage holds back the input instead of growing a queue.
+ * @param threadPool The Thread Pool to run the stages.
+ * @param maxTokens The most items in flight, e.g. a few times the number of threads.
+ * @return A pointer to the new Pipeline, or NULL if failed.
+ */
+TPPipeline* tpPipelineCreate(ThreadPool* threadPool, int maxTokens) {
+
+    if (threadPool == NULL || maxTokens <= 0) {
+        fprintf(stderr, "Bad arguments for PipelineCreate.\n");
+        return NULL;
+    }
+
+    TPPipeline* pipeline = malloc(sizeof(TPPipeline));
+    if (pipeline == NULL) {
+        fprintf(stderr, "Cannot allocate memory for pipeline.\n");
+        return NULL;
+    }
+    if ((pipeline->tokens = malloc(sizeof(tp_pipeline_token) * maxTokens)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for tokens.\n");
+        free(pipeline);
+        return NULL;
+    }
+    pipeline->pool = threadPool;
+    pipeline->stages = NULL;
+    pipeline->numOfStages = 0;
+    pipeline->maxTokens = maxTokens;
+    pipeline->numOfTokensInFlight = 0;
+    pipeline->numOfItems = 0;
+    pipeline->isInputDone = false;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->cv, NULL);
+
+    pipeline->freeTokens = NULL;
+    for (int i = 0; i < maxTokens; ++i) {
+        pipeline->tokens[i].pipeline = pipeline;
+        pipeline->tokens[i].next = pipeline->freeTokens;
+        pipeline->freeTokens = &pipeline->tokens[i];
+    }
+
+    return pipeline;
+}
+
+/***
+ * Add a stage to the end of a Pipeline.
+ * The first stage is the input: it is called with a NULL item and returns
+ * the next item, or NULL when there are no more, and must be serial.
+ * A later stage is called with an item and returns the item for the next
+ * stage, or NULL to drop it.
+ * @param pipeline The Pipeline, not running.
+ * @param mode TP_STAGE_SERIAL or TP_STAGE_PARALLEL.
+ * @param stageFunc The stage.
+ * @param arg The argument to stageFunc.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpPipelineAddStage(TPPipeline* pipeline, int mode, void* (*stageFunc)(void* item, void* arg), void* arg) {
+
+    if (pipeline == NULL || stageFunc == NULL || (mode != TP_STAGE_SERIAL && mode != TP_STAGE_PARALLEL)
+        || (pipeline->numOfStages == 0 && mode != TP_STAGE_SERIAL)) {
+        fprintf(stderr, "Bad arguments for PipelineAddStage.\n");
+        return TP_FAILURE;
+    }
+
+    tp_pipeline_stage* stages = realloc(pipeline->stages, sizeof(tp_pipeline_stage) * (pipeline->numOfStages + 1));
+    if (stages == NULL) {
+        fprintf(stderr, "Cannot allocate memory for stages.\n");
+        return TP_FAILURE;
+    }
+    pipeline->stages = stages;
+
+    tp_pipeline_stage* stage = &stages[pipeline->numOfStages];
+    stage->waiting = NULL;
+    if (mode == TP_STAGE_SERIAL && (stage->waiting = calloc(pipeline->maxTokens, sizeof(tp_pipeline_token*))) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for stage.\n");
+        return TP_FAILURE;
+    }
+    stage->stageFunc = stageFunc;
+    stage->arg = arg;
+    stage->mode = mode;
+    stage->isBusy = false;
+    stage->nextSequence = 0;
+    pipeline->numOfStages++;
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Run a Pipeline until its input runs out and every item went through all the stages.
+ * A task calling this is in a blocking region, see tpBlockingBegin.
+ * @param pipeline The Pipeline.
+ * @return The number of items the input gave, or -1 if failed.
+ */
+long tpPipelineRun(TPPipeline* pipeline) {
+
+    if (pipeline == NULL || pipeline->numOfStages == 0) {
+        fprintf(stderr, "Bad arguments for PipelineRun.\n");
+        return TP_FAILURE;
+    }
+
+    tp_pipeline_token* ready[TP_PIPELINE_MAX_READY];
+    int numOfReady = 0;
+
+    if (pthread_mutex_lock(&pipeline->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    for (int i = 0; i < pipeline->numOfStages; ++i) {
+        pipeline->stages[i].nextSequence = 0;
+    }
+    pipeline->numOfItems = 0;
+    pipeline->isInputDone = false;
+    tpPipelineStartInput(pipeline, ready, &numOfReady);
+    if (pthread_mutex_unlock(&pipeline->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    tpPipelineDispatch(pipeline, ready, numOfReady);
+
+    tpBlockingBegin();
+    if (pthread_mutex_lock(&pipeline->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    while (!pipeline->isInputDone || pipeline->numOfTokensInFlight > 0) {
+        pthread_cond_wait(&pipeline->cv, &pipeline->mutex);
+    }
+    long numOfItems = pipeline->numOfItems;
+    if (pthread_mutex_unlock(&pipeline->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    tpBlockingEnd();
+
+    return numOfItems;
+}
+
+/***
+ * Free a Pipeline that is not running.
+ * @param pipeline The Pipeline.
+ */
+void tpPipelineDestroy(TPPipeline* pipeline) {
+
+    if (pipeline == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < pipeline->numOfStages; ++i) {
+        free(pipeline->stages[i].waiting);
+    }
+    free(pipeline->stages);
+    free(pipeline->tokens);
+    pthread_cond_destroy(&pipeline->cv);
+    pthread_mutex_destroy(&pipeline->mutex);
+    free(pipeline);
+}
+
+/***
+ * Run a stage on the item of a token, and move the token along.
+ * @param token The token.
+ */
+void tpRunPipelineStage(void* token) {
+
+    tp_pipeline_token* self = (tp_pipeline_token*) token;
+    TPPipeline* pipeline = self->pipeline;
+    tp_pipeline_stage* stage = &pipeline->stages[self->stage];
+    tp_pipeline_token* ready[TP_PIPELINE_MAX_READY];
+    int numOfReady = 0;
+
+    /* A dropped item still passes the serial stages, to keep their order. */
+    if (self->stage == 0 || self->item != NULL) {
+        self->item = (*(stage->stageFunc))(self->item, stage->arg);
+    }
+
+    if (pthread_mutex_lock(&pipeline->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (self->stage == 0) {
+        stage->isBusy = false;
+        if (self->item == NULL) {
+            pipeline->isInputDone = true;
+            self->next = pipeline->freeTokens;
+            pipeline->freeTokens = self;
+            pipeline->numOfTokensInFlight--;
+        } else {
+            self->sequence = stage->nextSequence++;
+            pipeline->numOfItems++;
+            tpPipelineForward(pipeline, self, ready, &numOfReady);
+            tpPipelineStartInput(pipeline, ready, &numOfReady);
+        }
+    } else if (stage->mode == TP_STAGE_SERIAL) {
+        stage->isBusy = false;
+        stage->nextSequence++;
+        tpPipelineForward(pipeline, self, ready, &numOfReady);
+        tpPipelineTakeWaiting(pipeline, stage, ready, &numOfReady);
+    } else {
+        tpPipelineForward(pipeline, self, ready, &numOfReady);
+    }
+    if (pipeline->isInputDone && pipeline->numOfTokensInFlight == 0) {
+        pthread_cond_broadcast(&pipeline->cv);
+    }
+    if (pthread_mutex_unlock(&pipeline->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    tpPipelineDispatch(pipeline, ready, numOfReady);
+}
+
+/***
+ * Move a token to its next stage, or free it after the last one.
+ * The Pipeline's mutex must be locked.
+ * @param pipeline The Pipeline.
+ * @param token The token that is done with its stage.
+ * @param ready Where to add the tokens that can run now.
+ * @param numOfReady The size of ready.
+ */
+void tpPipelineForward(TPPipeline* pipeline, tp_pipeline_token* token, tp_pipeline_token** ready, int* numOfReady) {
+
+    token->stage++;
+
+    if (token->stage == pipeline->numOfStages) {
+        token->next = pipeline->freeTokens;
+        pipeline->freeTokens = token;
+        pipeline->numOfTokensInFlight--;
+        tpPipelineStartInput(pipeline, ready, numOfReady);
+        return;
+    }
+
+    tp_pipeline_stage* stage = &pipeline->stages[token->stage];
+    if (stage->mode == TP_STAGE_PARALLEL) {
+        ready[(*numOfReady)++] = token;
+        return;
+    }
+    stage->waiting[token->sequence % pipeline->maxTokens] = token;
+    tpPipelineTakeWaiting(pipeline, stage, ready, numOfReady);
+}
+
+/***
+ * Start the input on a free token, if the input is idle and not done.
+ * The Pipeline's mutex must be locked.
+ * @param pipeline The Pipeline.
+ * @param ready Where to add the token.
+ * @param numOfReady The size of ready.
+ */
+void tpPipelineStartInput(TPPipeline* pipeline, tp_pipeline_token** ready, int* numOfReady) {
+
+    tp_pipeline_stage* input = &pipeline->stages[0];
+    if (pipeline->isInputDone || input->isBusy || pipeline->freeTokens == NULL) {
+        return;
+    }
+
+    tp_pipeline_token* token = pipeline->freeTokens;
+    pipeline->freeTokens = token->next;
+    pipeline->numOfTokensInFlight++;
+    input->isBusy = true;
+    token->stage = 0;
+    token->item = NULL;
+    ready[(*numOfReady)++] = token;
+}
+
+/***
+ * Let an idle serial stage take its next item in order, if it is waiting.
+ * The Pipeline's mutex must be locked.
+ * @param pipeline The Pipeline.
+ * @param stage The serial stage.
+ * @param ready Where to add the token.
+ * @param numOfReady The size of ready.
+ */
+void tpPipelineTakeWaiting(TPPipeline* pipeline, tp_pipeline_stage* stage, tp_pipeline_token** ready, int* numOfReady) {
+
+    int slot = (int) (stage->nextSequence % pipeline->maxTokens);
+    if (stage->isBusy || stage->waiting[slot] == NULL) {
+        return;
+    }
+
+    stage->isBusy = true;
+    ready[(*numOfReady)++] = stage->waiting[slot];
+    stage->waiting[slot] = NULL;
+}
+
+/***
+ * Queue tokens to run their stage on the pool.
+ * @param pipeline The Pipeline.
+ * @param ready The tokens.
+ * @param numOfReady The size of ready.
+ */
+void tpPipelineDispatch(TPPipeline* pipeline, tp_pipeline_token** ready, int numOfReady) {
+
+    for (int i = 0; i < numOfReady; ++i) {
+        if (tpInsertTask(pipeline->pool, tpRunPipelineStage, ready[i]) != TASK_INSERT_SUCCESS) {
+            tpRunPipelineStage(ready[i]);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __PIPELINE__
+#define __PIPELINE__
+
+#include "threadPool.h"
+
+/* Stage modes: a serial stage takes items one at a time in input order, a parallel stage takes any number at once. */
+#define TP_STAGE_SERIAL 0
+#define TP_STAGE_PARALLEL 1
+
+/// Pipeline Token struct.
+
+typedef struct tp_pipeline_token
+{
+    struct tp_pipeline* pipeline; /* The pipeline the token belongs to. */
+    void* item;                  /* The item the token carries, NULL once a stage dropped it. */
+    long sequence;               /* The input order of the item. */
+    int stage;                   /* The stage the token is in. */
+    struct tp_pipeline_token* next; /* The next free token. */
+
+}tp_pipeline_token;
+
+/// Pipeline Stage struct.
+
+typedef struct tp_pipeline_stage
+{
+    void* (*stageFunc)(void* item, void* arg); /* The stage. */
+    void* arg;                   /* The argument to stageFunc. */
+    int mode;                    /* TP_STAGE_SERIAL or TP_STAGE_PARALLEL. */
+    bool isBusy;                 /* Is a serial stage running an item? */
+    long nextSequence;           /* The next item in order a serial stage takes. */
+    tp_pipeline_token** waiting; /* Tokens waiting for a serial stage, indexed by sequence % maxTokens. */
+
+}tp_pipeline_stage;
+
+/// Pipeline struct.
+
+typedef struct tp_pipeline
+{
+    ThreadPool* pool;            /* The Thread Pool running the stages. */
+    tp_pipeline_stage* stages;   /* The stages, the first one is the input. */
+    int numOfStages;             /* The size of stages. */
+    int maxTokens;               /* The most items in flight. */
+    tp_pipeline_token* tokens;   /* All the tokens. */
+    tp_pipeline_token* freeTokens; /* The tokens not in flight. */
+    int numOfTokensInFlight;     /* The number of tokens carrying items through the stages. */
+    long numOfItems;             /* The number of items the input gave in this run. */
+    bool isInputDone;            /* Did the input run out in this run? */
+    pthread_mutex_t mutex;       /* The mutex for the stages and tokens. */
+    pthread_cond_t cv;           /* Broadcast when a run is over. */
+
+}TPPipeline;
+
+TPPipeline* tpPipelineCreate(ThreadPool* threadPool, int maxTokens);
+
+int tpPipelineAddStage(TPPipeline* pipeline, int mode, void* (*stageFunc)(void* item, void* arg), void* arg);
+
+long tpPipelineRun(TPPipeline* pipeline);
+
+void tpPipelineDestroy(TPPipeline* pipeline);
+
+#endif
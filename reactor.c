@@ -0,0 +1,413 @@
+#include "reactor.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+tp_reactor* tpGetReactor(ThreadPool* threadPool);
+tp_reactor* tpCreateReactor(ThreadPool* threadPool);
+void* tpReactorRoutine(void* reactor);
+void tpReactorDispatch(void* registration);
+void tpReactorSweep(tp_reactor* reactor);
+int tpReactorArm(tp_reactor* reactor, tp_registration* registration, int op);
+
+/***
+ * Watch a file descriptor, and run a callback on the pool whenever it is ready:
+ * One poller thread per pool waits in epoll_wait and queues callbacks
+ * straight into the queue of the worker the fd has affinity to, so the
+ * same connection is served by the same worker. An fd is not watched while
+ * its callback is queued or running, so callbacks for one fd never overlap.
+ * @param threadPool The Thread Pool to run the callbacks.
+ * @param fd The file descriptor.
+ * @param events The epoll events to watch for, e.g. EPOLLIN.
+ * @param callback The callback, given the fd, the ready events and arg.
+ * @param arg The argument to the callback.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpReactorAdd(ThreadPool* threadPool, int fd, uint32_t events,
+                 void (*callback)(int fd, uint32_t events, void* arg), void* arg) {
+
+    if (threadPool == NULL || threadPool->isShuttingDown || fd < 0 || callback == NULL) {
+        fprintf(stderr, "Bad arguments for ReactorAdd or ThreadPool is shutting down.\n");
+        return TP_FAILURE;
+    }
+
+    tp_reactor* reactor = tpGetReactor(threadPool);
+    if (reactor == NULL) {
+        return TP_FAILURE;
+    }
+
+    tp_registration* registration = malloc(sizeof(tp_registration));
+    if (registration == NULL) {
+        fprintf(stderr, "Cannot allocate memory for registration.\n");
+        return TP_FAILURE;
+    }
+    registration->reactor = reactor;
+    registration->fd = fd;
+    registration->events = events;
+    registration->readyEvents = 0;
+    registration->callback = callback;
+    registration->arg = arg;
+    registration->isDispatched = false;
+    registration->isRemoved = false;
+    registration->next = NULL;
+
+    if (pthread_mutex_lock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    /* Grow the fd table as needed. */
+    if (fd >= reactor->capacity) {
+        int capacity = reactor->capacity == 0 ? 64 : reactor->capacity;
+        while (capacity <= fd) {
+            capacity *= 2;
+        }
+        tp_registration** registrations = realloc(reactor->registrations, sizeof(tp_registration*) * capacity);
+        if (registrations == NULL) {
+            fprintf(stderr, "Cannot allocate memory for registrations.\n");
+            pthread_mutex_unlock(&reactor->mutex);
+            free(registration);
+            return TP_FAILURE;
+        }
+        for (int i = reactor->capacity; i < capacity; ++i) {
+            registrations[i] = NULL;
+        }
+        reactor->registrations = registrations;
+        reactor->capacity = capacity;
+    }
+
+    if (reactor->registrations[fd] != NULL || tpReactorArm(reactor, registration, EPOLL_CTL_ADD) != 0) {
+        fprintf(stderr, "Cannot watch fd %d, it is watched already or invalid.\n", fd);
+        pthread_mutex_unlock(&reactor->mutex);
+        free(registration);
+        return TP_FAILURE;
+    }
+    reactor->registrations[fd] = registration;
+
+    if (pthread_mutex_unlock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Change the events a watched file descriptor is watched for.
+ * If its callback is dispatched, the change applies once it returns.
+ * @param threadPool The Thread Pool.
+ * @param fd The file descriptor.
+ * @param events The epoll events to watch for.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpReactorModify(ThreadPool* threadPool, int fd, uint32_t events) {
+
+    tp_reactor* reactor = threadPool == NULL ? NULL : threadPool->reactor;
+    if (reactor == NULL || fd < 0) {
+        fprintf(stderr, "Bad arguments for ReactorModify.\n");
+        return TP_FAILURE;
+    }
+
+    int result = TP_FAILURE;
+    if (pthread_mutex_lock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (fd < reactor->capacity && reactor->registrations[fd] != NULL) {
+        tp_registration* registration = reactor->registrations[fd];
+        registration->events = events;
+        result = registration->isDispatched ? 0 : tpReactorArm(reactor, registration, EPOLL_CTL_MOD);
+    }
+    if (pthread_mutex_unlock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return result == 0 ? TP_SUCCESS : TP_FAILURE;
+}
+
+/***
+ * Stop watching a file descriptor.
+ * A callback that is already running finishes, a queued one is skipped.
+ * The fd may be closed once this returns. The poller may still hold events
+ * of the fd that it took from epoll before, so the registration is not freed
+ * here, but by the poller once it is done with that batch and no callback runs.
+ * @param threadPool The Thread Pool.
+ * @param fd The file descriptor.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpReactorRemove(ThreadPool* threadPool, int fd) {
+
+    tp_reactor* reactor = threadPool == NULL ? NULL : threadPool->reactor;
+    if (reactor == NULL || fd < 0) {
+        fprintf(stderr, "Bad arguments for ReactorRemove.\n");
+        return TP_FAILURE;
+    }
+
+    int result = TP_FAILURE;
+    if (pthread_mutex_lock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (fd < reactor->capacity && reactor->registrations[fd] != NULL) {
+        tp_registration* registration = reactor->registrations[fd];
+        reactor->registrations[fd] = NULL;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, fd, NULL);
+
+        registration->isRemoved = true;
+        registration->next = reactor->removed;
+        reactor->removed = registration;
+        result = TP_SUCCESS;
+    }
+    if (pthread_mutex_unlock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return result;
+}
+
+/***
+ * Get the reactor of a Thread Pool, creating it and its poller on first use.
+ * @param threadPool The Thread Pool.
+ * @return The reactor, or NULL if failed.
+ */
+tp_reactor* tpGetReactor(ThreadPool* threadPool) {
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (threadPool->reactor == NULL && !threadPool->isShuttingDown) {
+        threadPool->reactor = tpCreateReactor(threadPool);
+    }
+    tp_reactor* reactor = threadPool->reactor;
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    return reactor;
+}
+
+/***
+ * Create a reactor and start its poller thread.
+ * @param threadPool The Thread Pool to run the callbacks.
+ * @return The reactor, or NULL if failed.
+ */
+tp_reactor* tpCreateReactor(ThreadPool* threadPool) {
+
+    tp_reactor* reactor = malloc(sizeof(tp_reactor));
+    if (reactor == NULL) {
+        fprintf(stderr, "Cannot allocate memory for reactor.\n");
+        return NULL;
+    }
+    reactor->pool = threadPool;
+    reactor->registrations = NULL;
+    reactor->capacity = 0;
+    reactor->removed = NULL;
+    reactor->isStopping = false;
+
+    if ((reactor->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error in system call\n");
+        free(reactor);
+        return NULL;
+    }
+    if ((reactor->wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        fprintf(stderr, "Error in system call\n");
+        close(reactor->epollFd);
+        free(reactor);
+        return NULL;
+    }
+
+    /* The wakeup eventfd is told apart from registrations by its NULL data. */
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    pthread_mutex_init(&reactor->mutex, NULL);
+    if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->wakeupFd, &event) != 0
+        || pthread_create(&reactor->poller, NULL, tpReactorRoutine, reactor) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        pthread_mutex_destroy(&reactor->mutex);
+        close(reactor->wakeupFd);
+        close(reactor->epollFd);
+        free(reactor);
+        return NULL;
+    }
+
+    return reactor;
+}
+
+/***
+ * Wait for ready file descriptors and queue their callbacks, until the reactor stops.
+ * @param reactor The reactor.
+ * @return Nothing.
+ */
+void* tpReactorRoutine(void* reactor) {
+
+    tp_reactor* self = (tp_reactor*) reactor;
+    struct epoll_event events[TP_REACTOR_MAX_EVENTS];
+
+    while (true) {
+
+        int numOfEvents = epoll_wait(self->epollFd, events, TP_REACTOR_MAX_EVENTS, -1);
+        if (numOfEvents < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Error in system call\n");
+            }
+            continue;
+        }
+
+        if (pthread_mutex_lock(&self->mutex) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+        if (self->isStopping) {
+            pthread_mutex_unlock(&self->mutex);
+            break;
+        }
+
+        for (int i = 0; i < numOfEvents; ++i) {
+            tp_registration* registration = events[i].data.ptr;
+            if (registration == NULL || registration->isRemoved) {
+                /* The wakeup eventfd, or an fd removed since epoll_wait returned. */
+                continue;
+            }
+
+            /* The fd is one shot, it is re-armed once its callback returns. */
+            registration->isDispatched = true;
+            registration->readyEvents = events[i].events;
+            if (tpInsertTaskWithAffinity(self->pool, (uint64_t) registration->fd,
+                                         tpReactorDispatch, registration) != TASK_INSERT_SUCCESS) {
+                registration->isDispatched = false;
+            }
+        }
+
+        /* No event of this batch points at a registration any more. */
+        tpReactorSweep(self);
+
+        if (pthread_mutex_unlock(&self->mutex) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+    }
+
+    return NULL;
+}
+
+/***
+ * Run the callback of a ready file descriptor and watch it again.
+ * This is the task queued for every ready fd.
+ * @param registration The registration of the fd.
+ */
+void tpReactorDispatch(void* registration) {
+
+    tp_registration* self = (tp_registration*) registration;
+    tp_reactor* reactor = self->reactor;
+
+    /* The registration only changes while it is not dispatched, or to be removed. */
+    if (pthread_mutex_lock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    bool isRemoved = self->isRemoved;
+    if (pthread_mutex_unlock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    if (!isRemoved) {
+        (*(self->callback))(self->fd, self->readyEvents, self->arg);
+    }
+
+    if (pthread_mutex_lock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    self->isDispatched = false;
+    if (!self->isRemoved && tpReactorArm(reactor, self, EPOLL_CTL_MOD) != 0) {
+        fprintf(stderr, "Cannot watch fd %d again.\n", self->fd);
+    }
+    if (pthread_mutex_unlock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Free the removed registrations whose callback is not queued or running.
+ * Must be called by the poller, between batches, with the reactor mutex locked.
+ * @param reactor The reactor.
+ */
+void tpReactorSweep(tp_reactor* reactor) {
+
+    tp_registration** link = &reactor->removed;
+    while (*link != NULL) {
+        tp_registration* registration = *link;
+        if (registration->isDispatched) {
+            link = &registration->next;
+        } else {
+            *link = registration->next;
+            free(registration);
+        }
+    }
+}
+
+/***
+ * Add or re-arm a registration in epoll, for one shot.
+ * Must be called with the reactor mutex locked.
+ * @param reactor The reactor.
+ * @param registration The registration.
+ * @param op EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+ * @return 0 if worked, -1 if failed.
+ */
+int tpReactorArm(tp_reactor* reactor, tp_registration* registration, int op) {
+
+    struct epoll_event event;
+    event.events = registration->events | EPOLLONESHOT;
+    event.data.ptr = registration;
+
+    return epoll_ctl(reactor->epollFd, op, registration->fd, &event);
+}
+
+/***
+ * Stop the poller of a Thread Pool's reactor, no callbacks are queued after this returns.
+ * Take the reactor under mutexEmptyQ once isShuttingDown is set, so no other is created after it.
+ * @param reactor The reactor, or NULL if the pool has none.
+ */
+void tpReactorStop(tp_reactor* reactor) {
+
+    if (reactor == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    reactor->isStopping = true;
+    if (pthread_mutex_unlock(&reactor->mutex) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    uint64_t one = 1;
+    if (write(reactor->wakeupFd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    if (pthread_join(reactor->poller, NULL) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Free a Thread Pool's reactor and its registrations, removed ones included.
+ * The poller must be stopped and the workers done, queued callbacks are never run.
+ * @param threadPool The Thread Pool.
+ */
+void tpFreeReactor(ThreadPool* threadPool) {
+
+    tp_reactor* reactor = threadPool->reactor;
+    if (reactor == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < reactor->capacity; ++i) {
+        free(reactor->registrations[i]);
+    }
+    while (reactor->removed != NULL) {
+        tp_registration* registration = reactor->removed;
+        reactor->removed = registration->next;
+        free(registration);
+    }
+    free(reactor->registrations);
+    close(reactor->wakeupFd);
+    close(reactor->epollFd);
+    pthread_mutex_destroy(&reactor->mutex);
+    free(reactor);
+    threadPool->reactor = NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef __REACTOR__
+#define __REACTOR__
+
+#include "threadPool.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* The most ready events the poller takes from epoll at once. */
+#define TP_REACTOR_MAX_EVENTS 64
+
+/// Reactor Registration struct.
+
+typedef struct tp_registration
+{
+    struct tp_reactor* reactor;  /* The reactor watching the fd. */
+    int fd;                      /* The watched file descriptor. */
+    uint32_t events;             /* The epoll events to watch for. */
+    uint32_t readyEvents;        /* The events that were ready when the callback was dispatched. */
+    void (*callback)(int fd, uint32_t events, void* arg); /* Run on a worker when the fd is ready. */
+    void* arg;                   /* The argument to the callback. */
+    bool isDispatched;           /* Is the callback queued or running? */
+    bool isRemoved;              /* Was the fd removed? Then the registration waits in removed. */
+    struct tp_registration* next; /* The next registration in the reactor's removed list. */
+
+}tp_registration;
+
+/// Reactor struct.
+
+typedef struct tp_reactor
+{
+    struct thread_pool* pool;    /* The Thread Pool running the callbacks. */
+    int epollFd;                 /* The epoll instance watching the registered fds. */
+    int wakeupFd;                /* An eventfd to stop the poller. */
+    pthread_t poller;            /* The thread waiting in epoll_wait. */
+    pthread_mutex_t mutex;       /* The mutex for registrations and their state. */
+    tp_registration** registrations; /* The registrations, indexed by fd. */
+    tp_registration* removed;    /* Removed registrations, freed by the poller once nothing points at them. */
+    int capacity;                /* The size of registrations. */
+    bool isStopping;             /* Is the poller asked to stop? */
+
+}tp_reactor;
+
+int tpReactorAdd(ThreadPool* threadPool, int fd, uint32_t events,
+                 void (*callback)(int fd, uint32_t events, void* arg), void* arg);
+
+int tpReactorModify(ThreadPool* threadPool, int fd, uint32_t events);
+
+int tpReactorRemove(ThreadPool* threadPool, int fd);
+
+void tpReactorStop(tp_reactor* reactor);
+
+void tpFreeReactor(ThreadPool* threadPool);
+
+#endif
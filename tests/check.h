@@ -0,0 +1,16 @@
+#ifndef __CHECK__
+#define __CHECK__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Fail the test with the condition and where it is, if it does not hold. */
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * Behaviour tests of the Completion Queue: the ring wrapping around many
+ * times, posts spilling to the overflow list when the ring is full, and
+ * a harvester keeping up with workers posting concurrently.
+ */
+#include "completionQueue.h"
+#include "tests/check.h"
+#include <poll.h>
+#include <string.h>
+
+int squareTask(void* param, void** result) {
+
+    long value = (long) param;
+    *result = (void*) (value * value);
+    return (int) (value % 3);
+}
+
+/***
+ * Wait for the queue's eventfd to become readable.
+ * @param queue The Completion Queue.
+ * @param timeoutMs How long to wait.
+ * @return true if readable, false if timed out.
+ */
+bool waitReadable(TPCompletionQueue* queue, int timeoutMs) {
+
+    struct pollfd pollFd = {.fd = tpCompletionQueueFd(queue), .events = POLLIN};
+    return poll(&pollFd, 1, timeoutMs) == 1;
+}
+
+/***
+ * Check the harvested completions against the tasks and mark their ids seen.
+ * @param completions The completions.
+ * @param numOfCompletions The size of completions.
+ * @param isSeen The ids seen so far, indexed by id.
+ * @param numOfIds The size of isSeen.
+ */
+void checkCompletions(const TPCompletion* completions, int numOfCompletions, bool* isSeen, size_t numOfIds) {
+
+    for (int i = 0; i < numOfCompletions; ++i) {
+        long value = (long) completions[i].userData;
+        CHECK(completions[i].taskId > 0 && completions[i].taskId < numOfIds);
+        CHECK(!isSeen[completions[i].taskId]);
+        isSeen[completions[i].taskId] = true;
+        CHECK((long) completions[i].result == value * value);
+        CHECK(completions[i].status == (int) (value % 3));
+    }
+}
+
+/* A small ring reused round after round must hand back every completion once. */
+void testWrapAround(void) {
+
+    enum { ROUNDS = 500, PER_ROUND = 3 };
+    ThreadPool* pool = tpCreate(2);
+    TPCompletionQueue* queue = tpCompletionQueueCreate(4);
+    bool* isSeen = calloc(ROUNDS * PER_ROUND + 1, sizeof(bool));
+    CHECK(pool != NULL && queue != NULL && isSeen != NULL);
+
+    long value = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = 0; i < PER_ROUND; ++i, ++value) {
+            uint64_t taskId;
+            CHECK(tpInsertTaskWithCompletion(pool, queue, squareTask, (void*) value, (void*) value, &taskId)
+                  == TASK_INSERT_SUCCESS);
+            CHECK(taskId == (uint64_t) value + 1);
+        }
+        int numOfHarvested = 0;
+        while (numOfHarvested < PER_ROUND) {
+            TPCompletion completions[PER_ROUND];
+            CHECK(waitReadable(queue, 5000));
+            int numOfCompletions = tpCompletionQueueHarvest(queue, completions, PER_ROUND - numOfHarvested);
+            CHECK(numOfCompletions >= 0);
+            checkCompletions(completions, numOfCompletions, isSeen, ROUNDS * PER_ROUND + 1);
+            numOfHarvested += numOfCompletions;
+        }
+    }
+
+    /* Everything was harvested, so the eventfd is quiet. */
+    TPCompletion completion;
+    CHECK(tpCompletionQueueHarvest(queue, &completion, 1) == 0);
+    CHECK(!waitReadable(queue, 0));
+
+    tpDestroy(pool, 1);
+    tpCompletionQueueDestroy(queue);
+    free(isSeen);
+}
+
+/* Many more completions than the ring holds spill over, and none is lost or doubled. */
+void testOverflow(void) {
+
+    enum { TASKS = 1000, BATCH = 7 };
+    ThreadPool* pool = tpCreate(4);
+    TPCompletionQueue* queue = tpCompletionQueueCreate(1);
+    bool* isSeen = calloc(TASKS + 1, sizeof(bool));
+    CHECK(pool != NULL && queue != NULL && isSeen != NULL);
+    CHECK(queue->mask == 1);
+
+    for (long value = 0; value < TASKS; ++value) {
+        CHECK(tpInsertTaskWithCompletion(pool, queue, squareTask, (void*) value, (void*) value, NULL)
+              == TASK_INSERT_SUCCESS);
+    }
+    tpDestroy(pool, 1);
+    CHECK(atomic_load(&queue->overflowCount) == TASKS - 2);
+    CHECK(waitReadable(queue, 0));
+
+    int numOfHarvested = 0;
+    int numOfCompletions;
+    do {
+        TPCompletion completions[BATCH];
+        numOfCompletions = tpCompletionQueueHarvest(queue, completions, BATCH);
+        CHECK(numOfCompletions >= 0);
+        checkCompletions(completions, numOfCompletions, isSeen, TASKS + 1);
+        numOfHarvested += numOfCompletions;
+        /* The eventfd stays readable while completions are left. */
+        CHECK(numOfCompletions < BATCH || waitReadable(queue, 0));
+    } while (numOfCompletions == BATCH);
+
+    CHECK(numOfHarvested == TASKS);
+    CHECK(atomic_load(&queue->overflowCount) == 0);
+    CHECK(!waitReadable(queue, 0));
+
+    tpCompletionQueueDestroy(queue);
+    free(isSeen);
+}
+
+/* A harvester polling the eventfd sees every completion of workers posting at once. */
+void testConcurrentHarvest(void) {
+
+    enum { TASKS = 20000, BATCH = 16 };
+    ThreadPool* pool = tpCreate(4);
+    TPCompletionQueue* queue = tpCompletionQueueCreate(64);
+    bool* isSeen = calloc(TASKS + 1, sizeof(bool));
+    CHECK(pool != NULL && queue != NULL && isSeen != NULL);
+
+    int numOfHarvested = 0;
+    for (long value = 0; value < TASKS; ++value) {
+        CHECK(tpInsertTaskWithCompletion(pool, queue, squareTask, (void*) value, (void*) value, NULL)
+              == TASK_INSERT_SUCCESS);
+        /* Harvest as we go, so posts race with harvests. */
+        TPCompletion completions[BATCH];
+        int numOfCompletions = tpCompletionQueueHarvest(queue, completions, BATCH);
+        CHECK(numOfCompletions >= 0);
+        checkCompletions(completions, numOfCompletions, isSeen, TASKS + 1);
+        numOfHarvested += numOfCompletions;
+    }
+    while (numOfHarvested < TASKS) {
+        /* A lost wakeup times out here instead of hanging. */
+        CHECK(waitReadable(queue, 5000));
+        int numOfCompletions;
+        do {
+            TPCompletion completions[BATCH];
+            numOfCompletions = tpCompletionQueueHarvest(queue, completions, BATCH);
+            CHECK(numOfCompletions >= 0);
+            checkCompletions(completions, numOfCompletions, isSeen, TASKS + 1);
+            numOfHarvested += numOfCompletions;
+        } while (numOfCompletions == BATCH);
+    }
+    CHECK(numOfHarvested == TASKS);
+
+    tpDestroy(pool, 1);
+    tpCompletionQueueDestroy(queue);
+    free(isSeen);
+}
+
+int main(void) {
+
+    testWrapAround();
+    testOverflow();
+    testConcurrentHarvest();
+
+    printf("completionQueueTest passed\n");
+    return 0;
+}
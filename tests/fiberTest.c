@@ -0,0 +1,178 @@
+/*
+ * Behaviour tests of fiber tasks: resumes racing with suspends from other
+ * threads are never lost, a resume before the suspend makes the suspend
+ * return at once, and a fiber keeps its task tag across yields.
+ * A lost wakeup fails a test after a timeout instead of hanging it.
+ * ThreadSanitizer does not follow swapcontext, so the tests are skipped under it.
+ */
+#include "fiber.h"
+#include "tests/check.h"
+#include <sched.h>
+
+#define SLEEPERS 8
+#define ROUNDS 2000
+#define WAKERS 2
+
+/// Sleeper struct.
+
+typedef struct sleeper
+{
+    TPFiber* _Atomic fiber;      /* The fiber, published once it runs. */
+    atomic_bool isSignalled;     /* Set by the waker before each resume. */
+    atomic_int numOfWakes;       /* Rounds the fiber saw its signal in. */
+    atomic_int numOfResumes;     /* Resumes the waker is done with. */
+
+}Sleeper;
+
+Sleeper sleepers[SLEEPERS];
+atomic_int numOfDone;
+
+/***
+ * Wait until a counter reaches a value, failing the test after 10 seconds.
+ * @param counter The counter.
+ * @param value The value.
+ */
+void waitFor(atomic_int* counter, int value) {
+
+    uint64_t deadline = tpNowNs() + 10000000000ULL;
+    while (atomic_load(counter) < value) {
+        CHECK(tpNowNs() < deadline);
+        sched_yield();
+    }
+}
+
+void sleeperTask(void* param) {
+
+    Sleeper* self = (Sleeper*) param;
+    atomic_store(&self->fiber, tpCurrentFiber());
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        /* Suspend may return early, so re-check like a condition wait. */
+        while (!atomic_exchange(&self->isSignalled, false)) {
+            tpFiberSuspend();
+        }
+        atomic_fetch_add(&self->numOfWakes, 1);
+    }
+
+    /* Stay alive until the waker's last resume is done with the fiber. */
+    while (atomic_load(&self->numOfResumes) < ROUNDS) {
+        tpYield();
+    }
+    atomic_fetch_add(&numOfDone, 1);
+}
+
+void* wakerRoutine(void* param) {
+
+    int first = (int) (long) param;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = first; i < SLEEPERS; i += WAKERS) {
+            Sleeper* sleeper = &sleepers[i];
+            waitFor(&sleeper->numOfWakes, round);
+            while (atomic_load(&sleeper->fiber) == NULL) {
+                sched_yield();
+            }
+            atomic_store(&sleeper->isSignalled, true);
+            tpFiberResume(atomic_load(&sleeper->fiber));
+            atomic_fetch_add(&sleeper->numOfResumes, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/* Threads resuming fibers while they suspend lose no resume. */
+void testSuspendResumeRace(void) {
+
+    ThreadPool* pool = tpCreate(3);
+    CHECK(pool != NULL);
+    atomic_store(&numOfDone, 0);
+    for (int i = 0; i < SLEEPERS; ++i) {
+        atomic_init(&sleepers[i].fiber, NULL);
+        atomic_init(&sleepers[i].isSignalled, false);
+        atomic_init(&sleepers[i].numOfWakes, 0);
+        atomic_init(&sleepers[i].numOfResumes, 0);
+        CHECK(tpInsertFiberTask(pool, sleeperTask, &sleepers[i]) == TASK_INSERT_SUCCESS);
+    }
+
+    pthread_t wakers[WAKERS];
+    for (long i = 0; i < WAKERS; ++i) {
+        CHECK(pthread_create(&wakers[i], NULL, wakerRoutine, (void*) i) == 0);
+    }
+    for (int i = 0; i < WAKERS; ++i) {
+        pthread_join(wakers[i], NULL);
+    }
+    waitFor(&numOfDone, SLEEPERS);
+    for (int i = 0; i < SLEEPERS; ++i) {
+        CHECK(atomic_load(&sleepers[i].numOfWakes) == ROUNDS);
+    }
+
+    tpDestroy(pool, 1);
+}
+
+void selfResumeTask(void* param) {
+
+    (void) param;
+    /* The resume comes first, so the suspend does not give up the worker. */
+    tpFiberResume(tpCurrentFiber());
+    tpFiberSuspend();
+    atomic_fetch_add(&numOfDone, 1);
+}
+
+/* A resume before the suspend is kept for it. */
+void testResumeBeforeSuspend(void) {
+
+    ThreadPool* pool = tpCreate(1);
+    CHECK(pool != NULL);
+    atomic_store(&numOfDone, 0);
+
+    for (int i = 0; i < 100; ++i) {
+        CHECK(tpInsertFiberTask(pool, selfResumeTask, NULL) == TASK_INSERT_SUCCESS);
+    }
+    waitFor(&numOfDone, 100);
+
+    tpDestroy(pool, 1);
+}
+
+void taggedTask(void* param) {
+
+    tpSetTaskTag(param);
+    for (int i = 0; i < 100; ++i) {
+        tpYield();
+        CHECK(tpGetTaskTag() == param);
+    }
+    atomic_fetch_add(&numOfDone, 1);
+}
+
+/* Fibers sharing workers each keep their own tag across yields. */
+void testTagAcrossYields(void) {
+
+    enum { FIBERS = 16 };
+    static int tags[FIBERS];
+    ThreadPool* pool = tpCreate(2);
+    CHECK(pool != NULL);
+    atomic_store(&numOfDone, 0);
+
+    for (int i = 0; i < FIBERS; ++i) {
+        CHECK(tpInsertFiberTask(pool, taggedTask, &tags[i]) == TASK_INSERT_SUCCESS);
+    }
+    waitFor(&numOfDone, FIBERS);
+    CHECK(tpCurrentFiber() == NULL);
+
+    tpDestroy(pool, 1);
+}
+
+int main(void) {
+
+#if defined(__SANITIZE_THREAD__)
+    printf("fiberTest skipped under ThreadSanitizer\n");
+    return 0;
+#endif
+
+    testSuspendResumeRace();
+    testResumeBeforeSuspend();
+    testTagAcrossYields();
+
+    printf("fiberTest passed\n");
+    return 0;
+}
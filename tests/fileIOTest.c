@@ -0,0 +1,346 @@
+/*
+ * Behaviour tests of File I/O: adjacent reads and writes merged into one
+ * preadv / pwritev with the result split among them, and a sync starting
+ * only after the writes to its fd submitted before it are done.
+ *
+ * The test defines pread, pwrite, preadv, pwritev and fsync, which the
+ * library calls instead of the C library's, to count the calls and to
+ * hold an I/O thread in a call while more requests are submitted.
+ */
+#define _GNU_SOURCE
+#include "fileIO.h"
+#include "tests/check.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_SIZE 4096
+
+pthread_mutex_t gateMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gateCv = PTHREAD_COND_INITIALIZER;
+bool isGateClosed = false;
+atomic_int numOfGated;           /* Calls that reached the gate. */
+atomic_int numOfPreadv;
+atomic_int numOfPwritev;
+atomic_int lastNumOfVectors;
+atomic_int writingFd = -1;       /* The fd of the write in flight, the tests hold at most one. */
+atomic_int numOfSyncs;
+atomic_int numOfEarlySyncs;      /* Syncs that started while a write to their fd was in flight. */
+atomic_int numOfCallbacks;
+
+/***
+ * Hold the calling I/O thread while the gate is closed.
+ */
+void passGate(void) {
+
+    pthread_mutex_lock(&gateMutex);
+    atomic_fetch_add(&numOfGated, 1);
+    while (isGateClosed) {
+        pthread_cond_wait(&gateCv, &gateMutex);
+    }
+    pthread_mutex_unlock(&gateMutex);
+}
+
+void setGate(bool isClosed) {
+
+    pthread_mutex_lock(&gateMutex);
+    isGateClosed = isClosed;
+    pthread_cond_broadcast(&gateCv);
+    pthread_mutex_unlock(&gateMutex);
+}
+
+/***
+ * Wait until a counter reaches a value, failing the test after 5 seconds.
+ * @param counter The counter.
+ * @param value The value.
+ */
+void waitFor(atomic_int* counter, int value) {
+
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+    for (int i = 0; i < 5000 && atomic_load(counter) < value; ++i) {
+        nanosleep(&pause, NULL);
+    }
+    CHECK(atomic_load(counter) >= value);
+}
+
+ssize_t pread(int fd, void* buffer, size_t length, off_t offset) {
+
+    static ssize_t (*realPread)(int, void*, size_t, off_t) = NULL;
+    if (realPread == NULL) {
+        realPread = dlsym(RTLD_NEXT, "pread");
+    }
+    passGate();
+    return realPread(fd, buffer, length, offset);
+}
+
+ssize_t pwrite(int fd, const void* buffer, size_t length, off_t offset) {
+
+    static ssize_t (*realPwrite)(int, const void*, size_t, off_t) = NULL;
+    if (realPwrite == NULL) {
+        realPwrite = dlsym(RTLD_NEXT, "pwrite");
+    }
+    atomic_store(&writingFd, fd);
+    passGate();
+    ssize_t result = realPwrite(fd, buffer, length, offset);
+    atomic_store(&writingFd, -1);
+    return result;
+}
+
+ssize_t preadv(int fd, const struct iovec* vectors, int numOfVectors, off_t offset) {
+
+    static ssize_t (*realPreadv)(int, const struct iovec*, int, off_t) = NULL;
+    if (realPreadv == NULL) {
+        realPreadv = dlsym(RTLD_NEXT, "preadv");
+    }
+    atomic_fetch_add(&numOfPreadv, 1);
+    atomic_store(&lastNumOfVectors, numOfVectors);
+    passGate();
+    return realPreadv(fd, vectors, numOfVectors, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec* vectors, int numOfVectors, off_t offset) {
+
+    static ssize_t (*realPwritev)(int, const struct iovec*, int, off_t) = NULL;
+    if (realPwritev == NULL) {
+        realPwritev = dlsym(RTLD_NEXT, "pwritev");
+    }
+    atomic_fetch_add(&numOfPwritev, 1);
+    atomic_store(&lastNumOfVectors, numOfVectors);
+    atomic_store(&writingFd, fd);
+    passGate();
+    ssize_t result = realPwritev(fd, vectors, numOfVectors, offset);
+    atomic_store(&writingFd, -1);
+    return result;
+}
+
+int fsync(int fd) {
+
+    static int (*realFsync)(int) = NULL;
+    if (realFsync == NULL) {
+        realFsync = dlsym(RTLD_NEXT, "fsync");
+    }
+    if (atomic_load(&writingFd) == fd) {
+        atomic_fetch_add(&numOfEarlySyncs, 1);
+    }
+    atomic_fetch_add(&numOfSyncs, 1);
+    return realFsync(fd);
+}
+
+/// Done struct.
+
+typedef struct done
+{
+    ssize_t result;              /* What the callback got. */
+    int error;
+    atomic_bool isDone;
+
+}Done;
+
+void onDone(ssize_t result, int error, void* arg) {
+
+    Done* done = (Done*) arg;
+    done->result = result;
+    done->error = error;
+    atomic_store(&done->isDone, true);
+    atomic_fetch_add(&numOfCallbacks, 1);
+}
+
+/***
+ * Make a temporary file of FILE_SIZE bytes, byte i holding i % 251.
+ * @return The file descriptor.
+ */
+int makeFile(void) {
+
+    char path[] = "/tmp/fileIOTestXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    unlink(path);
+    unsigned char data[FILE_SIZE];
+    for (int i = 0; i < FILE_SIZE; ++i) {
+        data[i] = (unsigned char) (i % 251);
+    }
+    CHECK(write(fd, data, FILE_SIZE) == FILE_SIZE);
+    return fd;
+}
+
+/***
+ * Hold the only I/O thread in a read at the end of the file, so the next requests queue up.
+ * @param io The I/O group.
+ * @param fd The file descriptor.
+ * @param buffer The buffer for the read, 16 bytes.
+ * @param done Where the read reports.
+ */
+void holdIOThread(TPFileIO* io, int fd, unsigned char* buffer, Done* done) {
+
+    atomic_store(&numOfGated, 0);
+    setGate(true);
+    CHECK(tpFileRead(io, fd, buffer, 16, FILE_SIZE - 16, onDone, done) == TP_SUCCESS);
+    waitFor(&numOfGated, 1);
+}
+
+/* Adjacent reads queued behind a busy I/O thread go out as one preadv. */
+void testCoalescedReads(void) {
+
+    ThreadPool* pool = tpCreate(2);
+    TPFileIO* io = tpFileIOCreate(pool, 1);
+    CHECK(pool != NULL && io != NULL);
+    int fd = makeFile();
+
+    unsigned char held[16];
+    Done heldDone = {0};
+    holdIOThread(io, fd, held, &heldDone);
+
+    enum { READS = 5, LENGTH = 100 };
+    unsigned char buffers[READS][LENGTH];
+    Done done[READS] = {0};
+    for (int i = 0; i < READS; ++i) {
+        CHECK(tpFileRead(io, fd, buffers[i], LENGTH, 1000 + i * LENGTH, onDone, &done[i]) == TP_SUCCESS);
+    }
+    atomic_store(&numOfPreadv, 0);
+    atomic_store(&numOfCallbacks, 0);
+    setGate(false);
+    waitFor(&numOfCallbacks, READS + 1);
+
+    CHECK(atomic_load(&numOfPreadv) == 1);
+    CHECK(atomic_load(&lastNumOfVectors) == READS);
+    for (int i = 0; i < READS; ++i) {
+        CHECK(done[i].result == LENGTH && done[i].error == 0);
+        for (int j = 0; j < LENGTH; ++j) {
+            CHECK(buffers[i][j] == (unsigned char) ((1000 + i * LENGTH + j) % 251));
+        }
+    }
+
+    tpFileIODestroy(io);
+    tpDestroy(pool, 1);
+    close(fd);
+}
+
+/* A merged read that runs short at the end of the file is short for the last requests only. */
+void testShortCoalescedRead(void) {
+
+    ThreadPool* pool = tpCreate(2);
+    TPFileIO* io = tpFileIOCreate(pool, 1);
+    CHECK(pool != NULL && io != NULL);
+    int fd = makeFile();
+
+    unsigned char held[16];
+    Done heldDone = {0};
+    holdIOThread(io, fd, held, &heldDone);
+
+    unsigned char buffers[3][10];
+    Done done[3] = {0};
+    for (int i = 0; i < 3; ++i) {
+        CHECK(tpFileRead(io, fd, buffers[i], 10, FILE_SIZE - 14 + i * 10, onDone, &done[i]) == TP_SUCCESS);
+    }
+    atomic_store(&numOfCallbacks, 0);
+    setGate(false);
+    waitFor(&numOfCallbacks, 4);
+
+    CHECK(done[0].result == 10);
+    CHECK(done[1].result == 4);
+    CHECK(done[2].result == 0);
+    CHECK(buffers[1][3] == (unsigned char) ((FILE_SIZE - 1) % 251));
+
+    tpFileIODestroy(io);
+    tpDestroy(pool, 1);
+    close(fd);
+}
+
+/* Adjacent writes go out as one pwritev, and land where each was asked to. */
+void testCoalescedWrites(void) {
+
+    ThreadPool* pool = tpCreate(2);
+    TPFileIO* io = tpFileIOCreate(pool, 1);
+    CHECK(pool != NULL && io != NULL);
+    int fd = makeFile();
+
+    unsigned char held[16];
+    Done heldDone = {0};
+    holdIOThread(io, fd, held, &heldDone);
+
+    enum { WRITES = 4, LENGTH = 64 };
+    unsigned char buffers[WRITES][LENGTH];
+    Done done[WRITES] = {0};
+    for (int i = 0; i < WRITES; ++i) {
+        memset(buffers[i], 'a' + i, LENGTH);
+        CHECK(tpFileWrite(io, fd, buffers[i], LENGTH, 256 + i * LENGTH, onDone, &done[i]) == TP_SUCCESS);
+    }
+    atomic_store(&numOfPwritev, 0);
+    atomic_store(&numOfCallbacks, 0);
+    setGate(false);
+    waitFor(&numOfCallbacks, WRITES + 1);
+
+    CHECK(atomic_load(&numOfPwritev) == 1);
+    CHECK(atomic_load(&lastNumOfVectors) == WRITES);
+    unsigned char data[WRITES * LENGTH + 2];
+    CHECK(pread(fd, data, sizeof(data), 255) == (ssize_t) sizeof(data));
+    CHECK(data[0] == 255 % 251 && data[sizeof(data) - 1] == (256 + WRITES * LENGTH) % 251);
+    for (int i = 0; i < WRITES; ++i) {
+        CHECK(done[i].result == LENGTH && done[i].error == 0);
+        for (int j = 0; j < LENGTH; ++j) {
+            CHECK(data[1 + i * LENGTH + j] == 'a' + i);
+        }
+    }
+
+    tpFileIODestroy(io);
+    tpDestroy(pool, 1);
+    close(fd);
+}
+
+/* A sync waits for the earlier write to its fd, but not for writes to other fds. */
+void testSyncAfterWrites(void) {
+
+    ThreadPool* pool = tpCreate(2);
+    TPFileIO* io = tpFileIOCreate(pool, 2);
+    CHECK(pool != NULL && io != NULL);
+    int fd = makeFile();
+    int otherFd = makeFile();
+
+    unsigned char buffer[32];
+    memset(buffer, 'w', sizeof(buffer));
+    Done writeDone = {0};
+    Done syncDone = {0};
+    Done otherSyncDone = {0};
+
+    atomic_store(&numOfGated, 0);
+    atomic_store(&numOfSyncs, 0);
+    atomic_store(&numOfEarlySyncs, 0);
+    setGate(true);
+    CHECK(tpFileWrite(io, fd, buffer, sizeof(buffer), 0, onDone, &writeDone) == TP_SUCCESS);
+    waitFor(&numOfGated, 1);
+    CHECK(tpFileSync(io, fd, onDone, &syncDone) == TP_SUCCESS);
+    CHECK(tpFileSync(io, otherFd, onDone, &otherSyncDone) == TP_SUCCESS);
+
+    /* The other fd's sync overtakes the sync held back by the write. */
+    waitFor(&numOfSyncs, 1);
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 20000000};
+    nanosleep(&pause, NULL);
+    CHECK(atomic_load(&numOfSyncs) == 1);
+    CHECK(!atomic_load(&syncDone.isDone) && !atomic_load(&writeDone.isDone));
+
+    setGate(false);
+    waitFor(&numOfSyncs, 2);
+    tpFileIODestroy(io);
+    tpDestroy(pool, 1);
+
+    CHECK(atomic_load(&numOfEarlySyncs) == 0);
+    CHECK(writeDone.result == (ssize_t) sizeof(buffer));
+    CHECK(syncDone.result == 0 && syncDone.error == 0);
+    CHECK(otherSyncDone.result == 0 && otherSyncDone.error == 0);
+    close(fd);
+    close(otherFd);
+}
+
+int main(void) {
+
+    testCoalescedReads();
+    testShortCoalescedRead();
+    testCoalescedWrites();
+    testSyncAfterWrites();
+
+    printf("fileIOTest passed\n");
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Behaviour tests of the Pipeline: serial stages take items in input
+ * order while a parallel stage between them finishes items out of order,
+ * dropped items keep the order of the rest, and no more than maxTokens
+ * items are in flight.
+ */
+#include "pipeline.h"
+#include "tests/check.h"
+#include <time.h>
+
+#define ITEMS 2000
+#define MAX_TOKENS 8
+
+/// Order struct.
+
+typedef struct order
+{
+    long nextInput;              /* The next item the input gives. */
+    long lastSeen;               /* The last item a serial stage took. */
+    atomic_int numOfInFlight;    /* Items given by the input and not yet out of the last stage. */
+    atomic_int mostInFlight;
+    atomic_int numOfRunning;     /* Calls of the checked serial stage running now. */
+    long numOfOut;               /* Items out of the last stage. */
+
+}Order;
+
+void* inputStage(void* item, void* arg) {
+
+    Order* order = (Order*) arg;
+    (void) item;
+    if (order->nextInput > ITEMS) {
+        return NULL;
+    }
+    int numOfInFlight = atomic_fetch_add(&order->numOfInFlight, 1) + 1;
+    int most = atomic_load(&order->mostInFlight);
+    while (numOfInFlight > most && !atomic_compare_exchange_weak(&order->mostInFlight, &most, numOfInFlight)) {
+    }
+    return (void*) order->nextInput++;
+}
+
+/* Finishes items out of order, and drops every seventh. */
+void* jitterStage(void* item, void* arg) {
+
+    Order* order = (Order*) arg;
+    long value = (long) item;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = (value * 7919 % 5) * 20000};
+    nanosleep(&pause, NULL);
+    if (value % 7 == 0) {
+        atomic_fetch_sub(&order->numOfInFlight, 1);
+        return NULL;
+    }
+    return item;
+}
+
+/* Checks that items come one at a time and in input order. */
+void* orderedStage(void* item, void* arg) {
+
+    Order* order = (Order*) arg;
+    long value = (long) item;
+    CHECK(atomic_fetch_add(&order->numOfRunning, 1) == 0);
+    CHECK(value > order->lastSeen);
+    /* Only dropped items may be missing. */
+    for (long skipped = order->lastSeen + 1; skipped < value; ++skipped) {
+        CHECK(skipped % 7 == 0);
+    }
+    order->lastSeen = value;
+    atomic_fetch_sub(&order->numOfRunning, 1);
+    return item;
+}
+
+void* outputStage(void* item, void* arg) {
+
+    Order* order = (Order*) arg;
+    order->numOfOut++;
+    atomic_fetch_sub(&order->numOfInFlight, 1);
+    return item;
+}
+
+void initOrder(Order* order) {
+
+    order->nextInput = 1;
+    order->lastSeen = 0;
+    atomic_init(&order->numOfInFlight, 0);
+    atomic_init(&order->mostInFlight, 0);
+    atomic_init(&order->numOfRunning, 0);
+    order->numOfOut = 0;
+}
+
+/* Serial stages around a parallel one see the items in order, run after run. */
+void testSerialOrder(void) {
+
+    ThreadPool* pool = tpCreate(4);
+    TPPipeline* pipeline = tpPipelineCreate(pool, MAX_TOKENS);
+    CHECK(pool != NULL && pipeline != NULL);
+    Order order;
+    Order outputOrder;
+
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_SERIAL, inputStage, &order) == TP_SUCCESS);
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_PARALLEL, jitterStage, &order) == TP_SUCCESS);
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_SERIAL, orderedStage, &order) == TP_SUCCESS);
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_PARALLEL, jitterStage, &outputOrder) == TP_SUCCESS);
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_SERIAL, orderedStage, &outputOrder) == TP_SUCCESS);
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_SERIAL, outputStage, &order) == TP_SUCCESS);
+
+    for (int run = 0; run < 2; ++run) {
+        initOrder(&order);
+        initOrder(&outputOrder);
+        CHECK(tpPipelineRun(pipeline) == ITEMS);
+        CHECK(order.lastSeen == ITEMS - (ITEMS % 7 == 0 ? 1 : 0));
+        CHECK(outputOrder.lastSeen == order.lastSeen);
+        CHECK(order.numOfOut == ITEMS - ITEMS / 7);
+        CHECK(atomic_load(&order.numOfInFlight) == 0);
+        CHECK(atomic_load(&order.mostInFlight) <= MAX_TOKENS);
+    }
+
+    tpPipelineDestroy(pipeline);
+    tpDestroy(pool, 1);
+}
+
+/* The input must be serial. */
+void testParallelInputRejected(void) {
+
+    ThreadPool* pool = tpCreate(1);
+    TPPipeline* pipeline = tpPipelineCreate(pool, MAX_TOKENS);
+    CHECK(pool != NULL && pipeline != NULL);
+    Order order;
+
+    CHECK(tpPipelineAddStage(pipeline, TP_STAGE_PARALLEL, inputStage, &order) == TP_FAILURE);
+
+    tpPipelineDestroy(pipeline);
+    tpDestroy(pool, 1);
+}
+
+int main(void) {
+
+    testSerialOrder();
+    testParallelInputRejected();
+
+    printf("pipelineTest passed\n");
+    return 0;
+}
@@ -1,65 +1,234 @@
 #include "threadPool.h"
+#include "fiber.h"
+#include "histogram.h"
+#include "reactor.h"
+#include "trace.h"
+#include <errno.h>
+#include <stddef.h>
+#include <time.h>
+
+/* All scratch allocations are aligned for any fundamental type. */
+#define TP_SCRATCH_ALIGN (sizeof(max_align_t))
+
+/// Scratch Arena overflow block struct.
+
+typedef struct tp_arena_block
+{
+    struct tp_arena_block* next;
+    max_align_t data[];
+
+}tp_arena_block;
 
 void tpFreeThreadPool(ThreadPool *threadPool);
-void* tpRoutine(void *pool);
+void* tpRoutine(void *worker);
+task_node* tpNextTask(tp_worker* worker);
+task_node* tpStealTask(tp_worker* thief);
+void tpWakeWorker(ThreadPool* threadPool, tp_worker* preferred);
+int tpWorkerForKey(ThreadPool* threadPool, uint64_t affinityKey);
+void tpArenaInit(tp_arena* arena, size_t size);
+void tpArenaReset(tp_arena* arena);
+void tpArenaDestroy(tp_arena* arena);
+task_node* tpNextClassTask(ThreadPool* threadPool);
+void tpStartClassRound(ThreadPool* threadPool, uint64_t nowNs);
+bool tpClassIsReady(tp_class* taskClass, uint64_t nowNs);
+void tpRefillClass(tp_class* taskClass, uint64_t nowNs);
+uint64_t tpNextClassDeadline(ThreadPool* threadPool);
+void tpArmClassTimer(ThreadPool* threadPool, uint64_t deadlineNs);
+void tpActivateSpare(ThreadPool* threadPool);
+bool tpParkSpare(tp_worker* worker);
+void tpTaskDone(ThreadPool* threadPool, task_node* task);
+void tpCountSubmitted(ThreadPool* threadPool, int numOfTasks);
+void tpTraceInsert(ThreadPool* threadPool, task_node* task);
+void tpInitLockCounters(tp_lock_counters* counters);
+void tpGetLockStats(tp_lock_counters* counters, TPLockStats* stats);
+void tpSignalWorker(tp_worker* worker);
+void tpCountWakeup(tp_worker* worker);
+void tpRunInsertHook(const TPTaskHooks* hooks, task_node* task);
+void tpTaskForHooks(const task_node* task, void (**computeFunc)(void *), void** param);
+
+/* The worker the calling thread runs as, NULL outside of any Thread Pool. */
+static __thread tp_worker* tpCurrentWorker = NULL;
+
+/* The tag tasks inserted by the calling thread get, see tpSetTaskTag. */
+static __thread void* tpCurrentTag = NULL;
 
 /***
  * Manage the Thread Pool.
- * @param pool The Thread Pool to manage.
+ * @param worker The worker of the Thread Pool this thread runs as.
  * @return Nothing.
  */
-void* tpRoutine(void *pool) {
+void* tpRoutine(void *worker) {
 
-    // Try to get the ThreadPool.
-    if (pool == NULL) {
+    // Try to get the worker and its ThreadPool.
+    if (worker == NULL) {
         return NULL;
     }
-    struct thread_pool* threadPool = (struct thread_pool*) pool;
+    tp_worker* self = (tp_worker*) worker;
+    struct thread_pool* threadPool = self->pool;
+
+    // Let tasks and hooks know which worker they run on, then set the worker up.
+    // The arena is allocated here so its pages are first touched on this worker's node.
+    tpCurrentWorker = self;
+    tpArenaInit(&self->scratch, threadPool->config.scratchSize);
+    if (threadPool->config.onWorkerStart != NULL) {
+        threadPool->config.onWorkerStart(threadPool, self->index, threadPool->config.hookArg);
+    }
 
+    // The last task run, accounted for once we hold the mutex again.
+    task_node* finished = NULL;
 
     // Loop until we are requested to shutdown the ThreadPool.
     while (true) {
 
         /* Locking the mutex and waiting for tasks to enqueue */
-        if (pthread_mutex_lock(threadPool->mutexEmptyQ) != 0) {
+        if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
             fprintf(stderr, "Error in system call\n");
         }
 
-        /* While queue is empty, wait for wakeup */
-        while (osIsQueueEmpty(threadPool->taskQueue) && !threadPool->isShuttingDown) {
-            if (pthread_cond_wait(threadPool->cv, threadPool->mutexEmptyQ) != 0) {
-                fprintf(stderr, "Error in system call\n");
-            }
+        if (finished != NULL) {
+            tpTaskDone(threadPool, finished);
+            free(finished);
+            finished = NULL;
+            threadPool->numOfBusyThreads--;
+        }
+
+        /* A spare worker retires once the workers it covered for are no longer blocked. */
+        if (!tpParkSpare(self)) {
+            /* ThreadPool is shutting down, parked workers have nothing left to do. */
+            break;
         }
 
         /*
-         * If ThreadPool is shutting down and we need to wait
-         * Check if we have tasks in queue:
-         * if yes, run task
-         * if no, close this thread.
+         * Look for a task: our mailbox and affinity queue first, then the shared queue,
+         * then a peer's affinity queue if it is backed up.
+         * While there is nothing to run, wait for wakeup, or until a rate
+         * limited class gets a token if no other worker waits for that.
+         * If ThreadPool is shutting down and we need to wait, close this thread
+         * only once there is nothing left for it to run, and no running task
+         * can insert more, which may be for this very worker.
          */
-        if (threadPool->isShuttingDown && threadPool->shouldWaitForTasks) {
+        task_node* task = NULL;
+        while (!(threadPool->isShuttingDown && !threadPool->shouldWaitForTasks)
+               && (task = tpNextTask(self)) == NULL) {
+
+            /* An idle spare does not wait for a task it is no longer needed for, see tpBlockingEnd. */
+            if (self->isSpare && threadPool->numOfActiveSpares > threadPool->numOfBlockedThreads
+                && !threadPool->isShuttingDown) {
+                if (!tpParkSpare(self)) {
+                    break;
+                }
+                continue;
+            }
 
-            if (osIsQueueEmpty(threadPool->taskQueue)) {
-                /* Queue is empty, kill thread. */
+            uint64_t deadlineNs = tpNextClassDeadline(threadPool);
+            if (deadlineNs != 0
+                && (threadPool->timerWorker == NULL || deadlineNs < threadPool->timerDeadlineNs)) {
+                threadPool->timerWorker = self;
+                threadPool->timerDeadlineNs = deadlineNs;
+            }
+            if (threadPool->isShuttingDown && threadPool->timerWorker != self
+                && threadPool->numOfBusyThreads == 0) {
+                /* The last task is done, let the workers still waiting for one close too. */
+                for (int i = 0; i < threadPool->numOfThreads + threadPool->numOfSpareThreads; ++i) {
+                    tp_worker* worker = &threadPool->workers[i];
+                    if (worker->isIdle) {
+                        worker->isIdle = false;
+                        threadPool->numOfIdleThreads--;
+                        tpSignalWorker(worker);
+                    }
+                }
                 break;
             }
 
-        } else if (threadPool->isShuttingDown && !threadPool->shouldWaitForTasks) {
-            /* ThreadPool is shutting down and we do not need to wait, kill this thread. */
+            self->isIdle = true;
+            threadPool->numOfIdleThreads++;
+            uint64_t idleStartNs = tpNowNs();
+            int error;
+            bool isTimer = threadPool->timerWorker == self;
+            /* Forget signals sent while running, only those to this wait are timed. */
+            self->signalNs = 0;
+            if (isTimer) {
+                struct timespec deadline;
+                deadline.tv_sec = (time_t) (threadPool->timerDeadlineNs / 1000000000ULL);
+                deadline.tv_nsec = (long) (threadPool->timerDeadlineNs % 1000000000ULL);
+                error = pthread_cond_timedwait(&self->cv, threadPool->mutexEmptyQ, &deadline);
+                threadPool->timerWorker = NULL;
+            } else {
+                error = pthread_cond_wait(&self->cv, threadPool->mutexEmptyQ);
+            }
+            if (error != 0 && error != ETIMEDOUT) {
+                fprintf(stderr, "Error in system call\n");
+            }
+            tpCounterAdd(&self->counters.idleNs, tpNowNs() - idleStartNs);
+            tpCountWakeup(self);
+            /* Whoever woke us normally claimed us already, but wakeups can be spurious. */
+            if (self->isIdle) {
+                self->isIdle = false;
+                threadPool->numOfIdleThreads--;
+                if (!isTimer && !threadPool->isShuttingDown) {
+                    tpCounterAdd(&threadPool->emptyQLockCounters.spuriousWakeups, 1);
+                }
+            }
+        }
+
+        if (task == NULL) {
+            /* ThreadPool is shutting down and there is nothing (more) to run, kill this thread. */
             break;
         }
+        threadPool->numOfBusyThreads++;
 
         /*
          * Thread Pool is not shutting down OR shutting down and waiting,
-         * Get task, un-lock mutex, run the task and free task allocated memory.
+         * Un-lock mutex, run the task and keep it for accounting.
          */
-        task_node* task = osDequeue(threadPool->taskQueue);
         if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
             fprintf(stderr, "Error in system call\n");
         }
+        /* The same hooks see the start and the finish, even if they are replaced meanwhile. */
+        const TPTaskHooks* hooks = atomic_load_explicit(&threadPool->taskHooks, memory_order_acquire);
+        void (*hookFunc)(void *) = NULL;
+        void* hookParam = NULL;
+        if (hooks != NULL) {
+            tpCurrentTag = task->tag;
+            tpTaskForHooks(task, &hookFunc, &hookParam);
+            if (hooks->onStart != NULL) {
+                hooks->onStart(hookFunc, hookParam, task->tag, hooks->hookArg);
+            }
+        }
+
+        /* Time every task, class scheduling charges classes by it and it counts as busy time. */
+        atomic_store_explicit(&self->counters.isRunning, true, memory_order_relaxed);
+        uint64_t startNs = tpNowNs();
+        if (self->trace != NULL) {
+            tpTraceRecord(self->trace, TP_TRACE_BEGIN, startNs, task);
+        }
         (*(task->computeFunc))(task->parameters);
-        free(task);
+        task->runNs = tpNowNs() - startNs;
+        if (self->blockingDepth > 0) {
+            /* The task returned inside a blocking region, the worker is not blocked anymore. */
+            self->blockingDepth = 1;
+            tpBlockingEnd();
+        }
+        if (self->trace != NULL) {
+            tpTraceRecord(self->trace, TP_TRACE_END, startNs + task->runNs, task);
+        }
+        if (hooks != NULL) {
+            if (hooks->onFinish != NULL) {
+                hooks->onFinish(hookFunc, hookParam, task->tag, hooks->hookArg);
+            }
+            tpCurrentTag = NULL;
+        }
+        tpCounterAdd(&self->counters.busyNs, task->runNs);
+        tpCounterAdd(&self->counters.completed, 1);
+        atomic_store_explicit(&self->counters.isRunning, false, memory_order_relaxed);
+        if (self->runLatency != NULL) {
+            if (task->insertNs != 0) {
+                tpHistogramRecord(self->queueWaitLatency, startNs - task->insertNs);
+            }
+            tpHistogramRecord(self->runLatency, task->runNs);
+        }
+        tpArenaReset(&self->scratch);
+        finished = task;
 
     }
 
@@ -67,209 +236,1667 @@ void* tpRoutine(void *pool) {
     if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
         fprintf(stderr, "Error in system call\n");
     }
+    if (threadPool->config.onWorkerStop != NULL) {
+        threadPool->config.onWorkerStop(threadPool, self->index, threadPool->config.hookArg);
+    }
+    tpArenaDestroy(&self->scratch);
+    tpCurrentWorker = NULL;
     pthread_exit(NULL);
 }
 
 /***
- * Create a new Thread Pool.
- * @param numOfThreads The number of threads in the pool.
- * @return A pointer to the new Thread Pool.
+ * Pick the next task for a worker. Must be called with mutexEmptyQ locked.
+ * @param worker The worker looking for a task.
+ * @return The task to run, or NULL if there is nothing for this worker.
  */
-ThreadPool* tpCreate(int numOfThreads) {
+task_node* tpNextTask(tp_worker* worker) {
 
-    ThreadPool* threadPool;
+    ThreadPool* threadPool = worker->pool;
 
-    // Allocate space in heap for struct.
-    if ((threadPool = malloc(sizeof(ThreadPool))) == NULL) {
-        fprintf(stderr, "Cannot allocate memory for ThreadPool.\n");
-        return NULL;
+    /* Tasks addressed to this worker can not run anywhere else, run them first. */
+    if (!osIsQueueEmpty(worker->mailbox)) {
+        return osDequeue(worker->mailbox);
     }
 
-    // Allocate space for thread-threadArray of struct.
-    if ((threadPool->threadArray = malloc(sizeof(pthread_t) * numOfThreads)) == NULL) {
-        fprintf(stderr, "Cannot allocate memory for Thread array.\n");
-        return NULL;
-    } /* Clean array. */
-    for (int i = 0; i < numOfThreads; ++i) {
-        threadPool->threadArray[i] = NULL;
+    /* Tasks with affinity to this worker keep their data in our caches, run them next. */
+    if (worker->localCount > 0) {
+        worker->localCount--;
+        return osDequeue(worker->localQueue);
     }
 
-    if ((threadPool->mutexEmptyQ = malloc(sizeof(pthread_mutex_t))) == NULL) {
-        fprintf(stderr, "Cannot allocate memory for mutex.\n");
-        return NULL;
+    task_node* task = tpNextClassTask(threadPool);
+    if (task != NULL) {
+        return task;
     }
 
-    if ((threadPool->cv = malloc(sizeof(pthread_cond_t))) == NULL) {
-        fprintf(stderr, "Cannot allocate memory for mutex cond.\n");
-        return NULL;
-    }
+    return tpStealTask(worker);
+}
+
+/***
+ * Pick the next task from the class queues by deficit round robin:
+ * Every round each waiting class is given its weight in run time, and is
+ * served until that is used up. Tasks are charged their class's average run
+ * time when dispatched, and corrected to their real run time when done, so
+ * a class flooding the pool gets no more than its share of the workers.
+ * Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool.
+ * @return The task to run, or NULL if no class has waiting tasks.
+ */
+task_node* tpNextClassTask(ThreadPool* threadPool) {
 
-    // The tasks queue for the threadArray.
-    threadPool->taskQueue = osCreateQueue();
-    if ( threadPool->taskQueue == NULL) {
-        fprintf(stderr, "Cannot allocate memory for queue.\n");
+    if (threadPool->numOfQueuedTasks == 0) {
         return NULL;
     }
+    uint64_t nowNs = threadPool->numOfRateLimitedClasses > 0 ? tpNowNs() : 0;
 
-    /* Initialize the mutex. */
-    pthread_mutex_init(threadPool->mutexEmptyQ, NULL);
-    pthread_cond_init(threadPool->cv, NULL);
+    while (true) {
 
-    // Save numOfThreads to struct.
-    threadPool->numOfThreads = numOfThreads;
+        /* Keep serving the current class while it has time left, then move on. */
+        bool isAnyReady = false;
+        for (int n = 0; n < threadPool->numOfClasses; ++n) {
+            int classId = (threadPool->currentClass + n) % threadPool->numOfClasses;
+            tp_class* taskClass = &threadPool->classes[classId];
+            if (!tpClassIsReady(taskClass, nowNs)) {
+                continue;
+            }
+            isAnyReady = true;
+            if (taskClass->deficit <= 0) {
+                continue;
+            }
 
+            threadPool->currentClass = classId;
+            task_node* task = osDequeue(taskClass->queue);
+            taskClass->stats.queued--;
+            taskClass->stats.running++;
+            threadPool->numOfQueuedTasks--;
 
-    threadPool->isShuttingDown = false;
+            task->chargedNs = taskClass->estimatedCostNs;
+            taskClass->deficit -= task->chargedNs;
+            if (taskClass->stats.queued == 0 && taskClass->deficit > 0) {
+                /* A class with nothing waiting does not save up time for later. */
+                taskClass->deficit = 0;
+            }
 
-    /* Create and Start the threadArray. */
-    for (int i = 0; i < numOfThreads; ++i) {
-        if ((threadPool->threadArray[i] = malloc(sizeof(pthread_t))) == NULL) {
-            fprintf(stderr, "Cannot allocate memory for thread number %d in array.\n", i);
+            /* Take a token, and make sure a worker wakes up for the rest once there is a new one. */
+            if (taskClass->ratePerSec > 0) {
+                taskClass->tokens -= 1.0;
+                if (taskClass->stats.queued > 0 && taskClass->tokens < 1.0) {
+                    tpArmClassTimer(threadPool, tpNextClassDeadline(threadPool));
+                }
+            }
+            return task;
+        }
+
+        /*
+         * Waiting tasks are all held back by their class's limits, they are dispatched
+         * when one finishes or, for rate limits, by the timer worker.
+         */
+        if (!isAnyReady) {
             return NULL;
         }
-        pthread_create(threadPool->threadArray[i], NULL, tpRoutine, threadPool);
+
+        /* Every waiting class used up its time, start a new round. */
+        tpStartClassRound(threadPool, nowNs);
     }
+}
 
-    return threadPool;
+/***
+ * Check whether a class has a task that may be dispatched now.
+ * @param taskClass The class.
+ * @param nowNs The current time, only read for rate limited classes.
+ * @return true if the class has waiting tasks, is below its concurrency limit and has a token.
+ */
+bool tpClassIsReady(tp_class* taskClass, uint64_t nowNs) {
+
+    if (taskClass->stats.queued == 0
+        || (taskClass->maxRunning != 0 && taskClass->stats.running >= (unsigned long long) taskClass->maxRunning)) {
+        return false;
+    }
+    if (taskClass->ratePerSec == 0) {
+        return true;
+    }
+
+    tpRefillClass(taskClass, nowNs);
+    return taskClass->tokens >= 1.0;
 }
 
-/**
- * Notify pool manager to close the pool.
- * @param threadPool The Thread Pool to close.
- * @param shouldWaitForTasks The number of tasks to finish before closing.
+/***
+ * Add the tokens a rate limited class earned since its last refill.
+ * @param taskClass The class.
+ * @param nowNs The current time.
  */
-void tpDestroy(ThreadPool* threadPool, int shouldWaitForTasks) {
+void tpRefillClass(tp_class* taskClass, uint64_t nowNs) {
 
-    /* Do not allow two threads to close the same ThreadPool */
-    if (threadPool->isShuttingDown) {
+    if (nowNs <= taskClass->refillNs) {
         return;
     }
-    /* Locking the mutex. */
-    if (pthread_mutex_lock(threadPool->mutexEmptyQ) != 0) {
-        fprintf(stderr, "Error in system call\n");
+    taskClass->tokens += (double) (nowNs - taskClass->refillNs) * taskClass->ratePerSec / 1e9;
+    if (taskClass->tokens > taskClass->burst) {
+        taskClass->tokens = taskClass->burst;
     }
+    taskClass->refillNs = nowNs;
+}
 
-    // Setting isShuttingDown to true, so we wont try to use it.
-    threadPool->shouldWaitForTasks = shouldWaitForTasks == 0 ? false : true ;
-    threadPool->isShuttingDown = true;
+/***
+ * Find when the first rate limited class that has tasks to dispatch gets a token.
+ * Classes held back by their concurrency limit are left out, finishing tasks wake workers for them.
+ * Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool.
+ * @return The time in nanoseconds, or 0 if no class waits for a token.
+ */
+uint64_t tpNextClassDeadline(ThreadPool* threadPool) {
 
-    /* Send broadcast to wake up all threads. */
-    if ((pthread_cond_broadcast(threadPool->cv)) != 0) {
-        fprintf(stderr, "Error in system call\n");
+    if (threadPool->numOfRateLimitedClasses == 0 || threadPool->numOfQueuedTasks == 0) {
+        return 0;
     }
-    /* Un-lock mutex. */
-    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
-        fprintf(stderr, "Error in system call\n");
+
+    uint64_t nowNs = tpNowNs();
+    uint64_t deadlineNs = 0;
+    for (int i = 0; i < threadPool->numOfClasses; ++i) {
+        tp_class* taskClass = &threadPool->classes[i];
+        if (taskClass->ratePerSec == 0 || taskClass->stats.queued == 0
+            || (taskClass->maxRunning != 0 && taskClass->stats.running >= (unsigned long long) taskClass->maxRunning)) {
+            continue;
+        }
+
+        tpRefillClass(taskClass, nowNs);
+        uint64_t tokenNs = nowNs;
+        if (taskClass->tokens < 1.0) {
+            tokenNs += (uint64_t) ((1.0 - taskClass->tokens) * 1e9 / taskClass->ratePerSec) + 1;
+        }
+        if (deadlineNs == 0 || tokenNs < deadlineNs) {
+            deadlineNs = tokenNs;
+        }
     }
 
-    /* Join threads until all are done. */
-    for (int i = 0; i < threadPool->numOfThreads; ++i) {
+    return deadlineNs;
+}
 
-        if ((pthread_join(*threadPool->threadArray[i], NULL)) != 0) {
-            fprintf(stderr, "Error in system call\n");
+/***
+ * Make sure a worker wakes up by the time a rate limited class gets a token.
+ * Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool.
+ * @param deadlineNs When the class gets a token.
+ */
+void tpArmClassTimer(ThreadPool* threadPool, uint64_t deadlineNs) {
+
+    if (threadPool->timerWorker == NULL) {
+        /* An idle worker finds nothing to run and takes the timer. */
+        tpWakeWorker(threadPool, NULL);
+    } else if (deadlineNs < threadPool->timerDeadlineNs) {
+        /* The timer worker sleeps too long, it picks the earlier deadline when it looks again. */
+        tpSignalWorker(threadPool->timerWorker);
+    }
+}
+
+/***
+ * Give every class with tasks ready to dispatch its quantum for a new round.
+ * Rounds in which no class could run anyway are skipped at once, so classes
+ * in debt from long tasks do not make the scheduler spin.
+ * Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool.
+ * @param nowNs The current time, only read for rate limited classes.
+ */
+void tpStartClassRound(ThreadPool* threadPool, uint64_t nowNs) {
+
+    /* Find the least number of rounds after which some class can run. */
+    int64_t rounds = INT64_MAX;
+    for (int i = 0; i < threadPool->numOfClasses; ++i) {
+        tp_class* taskClass = &threadPool->classes[i];
+        if (!tpClassIsReady(taskClass, nowNs)) {
+            continue;
+        }
+        int64_t quantum = (int64_t) taskClass->weight * TP_CLASS_QUANTUM_NS;
+        int64_t needed = (quantum - taskClass->deficit) / quantum;
+        if (needed < rounds) {
+            rounds = needed;
         }
     }
 
-    tpFreeThreadPool(threadPool);
+    for (int i = 0; i < threadPool->numOfClasses; ++i) {
+        tp_class* taskClass = &threadPool->classes[i];
+        if (tpClassIsReady(taskClass, nowNs)) {
+            taskClass->deficit += rounds * taskClass->weight * TP_CLASS_QUANTUM_NS;
+        }
+    }
 }
 
 /***
- * Add a task to the queue:
- * Create Task.
- * Lock Mutex.
- * Add Task to queue.
- * Unlock Mutex.
- * @param threadPool The Thread Pool to do the task.
- * @param computeFunc The task.
- * @param param The parameters to the task.
- * @return -1 if failed, 0 if worked.
+ * Account for a task that finished running. Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool.
+ * @param task The task.
  */
-int tpInsertTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param) {
+void tpTaskDone(ThreadPool* threadPool, task_node* task) {
 
-    /* If Thread Pool is closing down or NULL is passed, FAIL. */
-    if (threadPool->isShuttingDown || threadPool == NULL || computeFunc == NULL) {
-        fprintf(stderr, "Bad arguments for InsertTask or ThreadPool is shutting down.\n");
-        return TASK_INSERT_FAILURE;
+    if (task->classId == TP_NO_CLASS) {
+        return;
     }
+    tp_class* taskClass = &threadPool->classes[task->classId];
 
-    /* Create task_node struct. */
-    task_node *taskNode = NULL;
-    if ((taskNode = tnCreate(computeFunc, param)) == NULL) {
-        fprintf(stderr, "Cannot create task to insert.\n");
-        return TASK_INSERT_FAILURE;
+    /* Replace the estimate charged at dispatch with the real run time. */
+    taskClass->deficit += task->chargedNs - (int64_t) task->runNs;
+    if (taskClass->stats.queued == 0 && taskClass->deficit > 0) {
+        taskClass->deficit = 0;
+    }
+    taskClass->estimatedCostNs += ((int64_t) task->runNs - taskClass->estimatedCostNs) / 8;
+    if (taskClass->estimatedCostNs < 1) {
+        taskClass->estimatedCostNs = 1;
     }
 
-    /* Locking the mutex. */
-    if (pthread_mutex_lock(threadPool->mutexEmptyQ) != 0) {
-        fprintf(stderr, "Error in system call\n");
-        return TASK_INSERT_FAILURE;
+    taskClass->stats.completed++;
+    taskClass->stats.runNs += task->runNs;
+
+    /* If the class was held at its limit, one of its waiting tasks may run now. */
+    bool wasAtLimit = taskClass->maxRunning != 0
+                      && taskClass->stats.running == (unsigned long long) taskClass->maxRunning;
+    taskClass->stats.running--;
+    if (wasAtLimit && taskClass->stats.queued > 0) {
+        tpWakeWorker(threadPool, NULL);
     }
+}
 
-    /* Adding to queue. */
-    osEnqueue(threadPool->taskQueue, taskNode);
+/***
+ * Count tasks inserted into a Thread Pool. Must be called with mutexEmptyQ locked.
+ * A worker counts the tasks it inserts itself, so workers never share a counter.
+ * @param threadPool The Thread Pool.
+ * @param numOfTasks The number of tasks inserted.
+ */
+void tpCountSubmitted(ThreadPool* threadPool, int numOfTasks) {
 
-    /* Notifying Threads that new task is available. */
-    if (pthread_cond_signal(threadPool->cv) != 0) {
-        fprintf(stderr, "Error in system call\n");
-        return TASK_INSERT_FAILURE;
+    if (tpCurrentWorker != NULL && tpCurrentWorker->pool == threadPool) {
+        tpCounterAdd(&tpCurrentWorker->counters.submitted, (unsigned long long) numOfTasks);
+    } else {
+        tpCounterAdd(&threadPool->numOfSubmitted, (unsigned long long) numOfTasks);
     }
+}
 
-    /* Un-locking the mutex. */
-    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
-        fprintf(stderr, "Error in system call\n");
-        return TASK_INSERT_FAILURE;
+/***
+ * Record the insert of a task into the trace. Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool, traced.
+ * @param task The task.
+ */
+void tpTraceInsert(ThreadPool* threadPool, task_node* task) {
+
+    task->traceId = threadPool->trace->nextTaskId++;
+    if (tpCurrentWorker != NULL && tpCurrentWorker->pool == threadPool) {
+        tpTraceRecord(tpCurrentWorker->trace, TP_TRACE_INSERT, tpNowNs(), task);
+    } else {
+        tpTraceRecord(&threadPool->trace->buffers[threadPool->numOfWorkers], TP_TRACE_INSERT, tpNowNs(), task);
     }
+}
 
-    return TASK_INSERT_SUCCESS;
+/***
+ * Add to a counter that only one thread at a time writes:
+ * A plain load and store, never a locked read-modify-write, readers see either value.
+ * @param counter The counter.
+ * @param value The value to add.
+ */
+void tpCounterAdd(atomic_ullong* counter, unsigned long long value) {
+
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
 }
 
 /***
- * Create a new TaskNode.
- * @param computeFunc The task.
- * @param param The parameters.
- * @return A pointer to the new TaskNode.
+ * Lock one of the Thread Pool's mutexes and count how contended it is:
+ * Only a lock found held is timed, so uncontended locking costs a trylock.
+ * The counters are updated once the mutex is held, which serializes them.
+ * @param mutex The mutex.
+ * @param counters The counters of the mutex.
+ * @return 0 if locked, else the error of pthread_mutex_lock.
  */
-task_node* tnCreate(void (*computeFunc) (void *), void* param) {
+int tpLockMutex(pthread_mutex_t* mutex, tp_lock_counters* counters) {
 
-    /* Allocate space. */
-    task_node* taskNode = (task_node*) malloc(sizeof(task_node));
-    if (taskNode == NULL) {
-        return NULL;
+    int error = pthread_mutex_trylock(mutex);
+    if (error == EBUSY) {
+        uint64_t startNs = tpNowNs();
+        if ((error = pthread_mutex_lock(mutex)) == 0) {
+            tpCounterAdd(&counters->contended, 1);
+            tpCounterAdd(&counters->waitNs, tpNowNs() - startNs);
+        }
+    }
+    if (error == 0) {
+        tpCounterAdd(&counters->acquisitions, 1);
     }
 
-    /* Initiate struct. */
-    taskNode->computeFunc = computeFunc;
-    taskNode->parameters  = param;
+    return error;
+}
 
-    return taskNode;
+/***
+ * Tell if a Thread Pool refuses tasks from the calling thread: once it is
+ * shutting down, it only takes them from its own workers while it waits for
+ * its tasks, since the running tasks may still add more, e.g. yielding fibers.
+ * @param threadPool The Thread Pool.
+ * @return true if inserts fail.
+ */
+bool tpRejectsInserts(ThreadPool* threadPool) {
+
+    return threadPool->isShuttingDown
+           && !(threadPool->shouldWaitForTasks && tpCurrentWorker != NULL && tpCurrentWorker->pool == threadPool);
 }
 
 /***
- * Free all allocated space for Thread Pool.
- * @param threadPool The Thread Pool to de-allocate space for.
+ * Zero the counters of a mutex.
+ * @param counters The counters.
  */
-void tpFreeThreadPool(ThreadPool *threadPool) {
+void tpInitLockCounters(tp_lock_counters* counters) {
 
-    if (threadPool == NULL) {
+    atomic_init(&counters->acquisitions, 0);
+    atomic_init(&counters->contended, 0);
+    atomic_init(&counters->waitNs, 0);
+    atomic_init(&counters->condWaits, 0);
+    atomic_init(&counters->wakeupNs, 0);
+    atomic_init(&counters->spuriousWakeups, 0);
+}
+
+/***
+ * Get the statistics of one of the Thread Pool's mutexes, without locking it.
+ * @param counters The counters of the mutex.
+ * @param stats Where to write the statistics.
+ */
+void tpGetLockStats(tp_lock_counters* counters, TPLockStats* stats) {
+
+    stats->acquisitions = atomic_load_explicit(&counters->acquisitions, memory_order_relaxed);
+    stats->contended = atomic_load_explicit(&counters->contended, memory_order_relaxed);
+    stats->waitNs = atomic_load_explicit(&counters->waitNs, memory_order_relaxed);
+    stats->condWaits = atomic_load_explicit(&counters->condWaits, memory_order_relaxed);
+    stats->wakeupNs = atomic_load_explicit(&counters->wakeupNs, memory_order_relaxed);
+    stats->spuriousWakeups = atomic_load_explicit(&counters->spuriousWakeups, memory_order_relaxed);
+}
+
+/***
+ * Read the monotonic clock.
+ * @return The time in nanoseconds.
+ */
+uint64_t tpNowNs(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/***
+ * Take a task from the most backed up affinity queue of another worker.
+ * Only queues holding at least TP_AFFINITY_STEAL_THRESHOLD tasks are stolen from,
+ * so affinity is only broken when the pool is imbalanced.
+ * Must be called with mutexEmptyQ locked.
+ * @param thief The idle worker looking for a task.
+ * @return The stolen task, or NULL if no worker is backed up.
+ */
+task_node* tpStealTask(tp_worker* thief) {
+
+    ThreadPool* threadPool = thief->pool;
+    tp_worker* victim = NULL;
+
+    for (int i = 0; i < threadPool->numOfThreads; ++i) {
+        tp_worker* worker = &threadPool->workers[i];
+        if (worker != thief && worker->localCount >= TP_AFFINITY_STEAL_THRESHOLD
+            && (victim == NULL || worker->localCount > victim->localCount)) {
+            victim = worker;
+        }
+    }
+
+    if (victim == NULL) {
+        return NULL;
+    }
+    victim->localCount--;
+    return osDequeue(victim->localQueue);
+}
+
+/***
+ * Wake up an idle worker. Must be called with mutexEmptyQ locked.
+ * The woken worker is claimed here, so back to back calls wake different workers.
+ * @param threadPool The Thread Pool to wake a worker in.
+ * @param preferred The worker to wake if it is idle, or NULL for any worker.
+ */
+void tpWakeWorker(ThreadPool* threadPool, tp_worker* preferred) {
+
+    if (threadPool->numOfIdleThreads == 0) {
+        /* Every worker is busy, but some may be blocked and not using their core. */
+        if (threadPool->numOfBlockedThreads > threadPool->numOfActiveSpares) {
+            tpActivateSpare(threadPool);
+        }
         return;
     }
 
-    // Free all tasks and than the queue.
-    while (!osIsQueueEmpty(threadPool->taskQueue)) {
-        free(osDequeue(threadPool->taskQueue));
+    /* Rather not take the worker waiting for rate limited classes off its timer. */
+    tp_worker* worker = preferred;
+    if (worker == NULL || !worker->isIdle) {
+        worker = threadPool->timerWorker;
+        for (int i = 0; i < threadPool->numOfThreads + threadPool->numOfSpareThreads; ++i) {
+            if (threadPool->workers[i].isIdle && &threadPool->workers[i] != threadPool->timerWorker) {
+                worker = &threadPool->workers[i];
+                break;
+            }
+        }
+    }
+
+    worker->isIdle = false;
+    threadPool->numOfIdleThreads--;
+    tpSignalWorker(worker);
+}
+
+/***
+ * Signal a worker waiting on its condition variable, and note when,
+ * so the time until it wakes up is accounted for, see tpCountWakeup.
+ * Must be called with mutexEmptyQ locked.
+ * @param worker The worker.
+ */
+void tpSignalWorker(tp_worker* worker) {
+
+    if (worker->signalNs == 0) {
+        worker->signalNs = tpNowNs();
+    }
+    if (pthread_cond_signal(&worker->cv) != 0) {
+        fprintf(stderr, "Error in system call\n");
     }
-    osDestroyQueue(threadPool->taskQueue);
+}
 
-    // Destroy and free pthread_cond_t
-    pthread_cond_destroy(threadPool->cv);
-    free(threadPool->cv);
+/***
+ * Count a wakeup from a condition variable wait, which reacquired mutexEmptyQ
+ * inside pthread_cond_wait, out of sight of tpLockMutex:
+ * The wakeup is an acquisition, and if signalled, the time from the signal on
+ * is counted as wakeup time, kept apart from waitNs: it is mostly the
+ * scheduling of the woken thread, not waiting for the mutex.
+ * Timeouts and spurious wakeups have no signal to time from.
+ * Must be called with mutexEmptyQ locked.
+ * @param worker The worker that woke up.
+ */
+void tpCountWakeup(tp_worker* worker) {
 
-    // Destroy and free mutex.
-    pthread_mutex_destroy(threadPool->mutexEmptyQ);
-    free(threadPool->mutexEmptyQ);
+    tp_lock_counters* counters = &worker->pool->emptyQLockCounters;
 
-    // Free Thread in array and than free the Array.
-    for (int i = 0; i < threadPool->numOfThreads; ++i) {
+    tpCounterAdd(&counters->acquisitions, 1);
+    tpCounterAdd(&counters->condWaits, 1);
+    if (worker->signalNs != 0) {
+        tpCounterAdd(&counters->wakeupNs, tpNowNs() - worker->signalNs);
+        worker->signalNs = 0;
+    }
+}
+
+/***
+ * Park a spare worker if it is not needed: while more spares are in service
+ * than workers are blocked, it waits until tpActivateSpare brings it back.
+ * Must be called with mutexEmptyQ locked.
+ * @param worker The worker, does nothing unless it is a spare.
+ * @return false if the pool shut down meanwhile and the worker should exit, else true.
+ */
+bool tpParkSpare(tp_worker* worker) {
+
+    ThreadPool* threadPool = worker->pool;
+    if (!worker->isSpare || threadPool->numOfActiveSpares <= threadPool->numOfBlockedThreads
+        || threadPool->isShuttingDown) {
+        return true;
+    }
+
+    worker->isParked = true;
+    threadPool->numOfActiveSpares--;
+    while (worker->isParked && !threadPool->isShuttingDown) {
+        worker->signalNs = 0;
+        if (pthread_cond_wait(&worker->cv, threadPool->mutexEmptyQ) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+        tpCountWakeup(worker);
+        if (worker->isParked && !threadPool->isShuttingDown) {
+            tpCounterAdd(&threadPool->emptyQLockCounters.spuriousWakeups, 1);
+        }
+    }
+
+    return !worker->isParked;
+}
+
+/***
+ * Bring a spare worker into service, waking a parked one or starting a new thread.
+ * Does nothing once all maxSpareThreads are in service.
+ * Must be called with mutexEmptyQ locked.
+ * @param threadPool The Thread Pool.
+ */
+void tpActivateSpare(ThreadPool* threadPool) {
+
+    if (threadPool->isShuttingDown) {
+        return;
+    }
+
+    for (int i = threadPool->numOfThreads; i < threadPool->numOfThreads + threadPool->numOfSpareThreads; ++i) {
+        tp_worker* worker = &threadPool->workers[i];
+        if (worker->isParked) {
+            worker->isParked = false;
+            threadPool->numOfActiveSpares++;
+            tpSignalWorker(worker);
+            return;
+        }
+    }
+
+    if (threadPool->numOfThreads + threadPool->numOfSpareThreads == threadPool->numOfWorkers) {
+        return;
+    }
+    int index = threadPool->numOfThreads + threadPool->numOfSpareThreads;
+    if ((threadPool->threadArray[index] = malloc(sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for thread number %d in array.\n", index);
+        return;
+    }
+    if (pthread_create(threadPool->threadArray[index], NULL, tpRoutine, &threadPool->workers[index]) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        free(threadPool->threadArray[index]);
+        threadPool->threadArray[index] = NULL;
+        return;
+    }
+    threadPool->numOfSpareThreads++;
+    threadPool->numOfActiveSpares++;
+}
+
+/***
+ * Map an affinity key to the index of its preferred worker.
+ * The key is mixed first, so sequential keys spread over all workers.
+ * @param threadPool The Thread Pool.
+ * @param affinityKey The key.
+ * @return The index of the preferred worker.
+ */
+int tpWorkerForKey(ThreadPool* threadPool, uint64_t affinityKey) {
+
+    affinityKey ^= affinityKey >> 33;
+    affinityKey *= 0xff51afd7ed558ccdULL;
+    affinityKey ^= affinityKey >> 33;
+    affinityKey *= 0xc4ceb9fe1a85ec53ULL;
+    affinityKey ^= affinityKey >> 33;
+
+    return (int) (affinityKey % (uint64_t) threadPool->numOfThreads);
+}
+
+/***
+ * Fill a Thread Pool configuration with the defaults.
+ * @param config The configuration to fill.
+ * @param numOfThreads The number of threads in the pool.
+ */
+void tpConfigInit(ThreadPoolConfig* config, int numOfThreads) {
+
+    config->numOfThreads = numOfThreads;
+    config->onWorkerStart = NULL;
+    config->onWorkerStop = NULL;
+    config->hookArg = NULL;
+    config->scratchSize = TP_DEFAULT_SCRATCH_SIZE;
+    config->numOfClasses = TP_DEFAULT_NUM_OF_CLASSES;
+    config->maxSpareThreads = numOfThreads;
+    config->fiberStackSize = TP_DEFAULT_FIBER_STACK_SIZE;
+    config->trackLatency = false;
+    config->traceEvents = 0;
+}
+
+/***
+ * Create a new Thread Pool.
+ * @param numOfThreads The number of threads in the pool.
+ * @return A pointer to the new Thread Pool.
+ */
+ThreadPool* tpCreate(int numOfThreads) {
+
+    ThreadPoolConfig config;
+    tpConfigInit(&config, numOfThreads);
+
+    return tpCreateWithConfig(&config);
+}
+
+/***
+ * Create a new Thread Pool.
+ * @param config The configuration of the pool, see tpConfigInit.
+ * @return A pointer to the new Thread Pool.
+ */
+ThreadPool* tpCreateWithConfig(const ThreadPoolConfig* config) {
+
+    ThreadPool* threadPool;
+    int numOfThreads = config->numOfThreads;
+    int numOfWorkers = numOfThreads + (config->maxSpareThreads > 0 ? config->maxSpareThreads : 0);
+
+    // Allocate space in heap for struct.
+    if ((threadPool = malloc(sizeof(ThreadPool))) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for ThreadPool.\n");
+        return NULL;
+    }
+
+    // Allocate space for thread-threadArray of struct.
+    if ((threadPool->threadArray = malloc(sizeof(pthread_t) * numOfWorkers)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for Thread array.\n");
+        return NULL;
+    } /* Clean array. */
+    for (int i = 0; i < numOfWorkers; ++i) {
+        threadPool->threadArray[i] = NULL;
+    }
+
+    // Allocate space for the per-thread workers, spare ones included.
+    // Each worker's counters sit on their own cache line, so the array is cache line aligned.
+    if ((threadPool->workers = aligned_alloc(64, sizeof(tp_worker) * numOfWorkers)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for Worker array.\n");
+        return NULL;
+    }
+
+    if ((threadPool->mutexEmptyQ = malloc(sizeof(pthread_mutex_t))) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for mutex.\n");
+        return NULL;
+    }
+
+    if ((threadPool->mutexFiberCache = malloc(sizeof(pthread_mutex_t))) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for mutex.\n");
+        return NULL;
+    }
+
+    // The tasks queues for the threadArray, one per class.
+    if (config->numOfClasses < 1
+        || (threadPool->classes = malloc(sizeof(tp_class) * config->numOfClasses)) == NULL) {
+        fprintf(stderr, "Cannot allocate memory for class array.\n");
+        return NULL;
+    }
+    for (int i = 0; i < config->numOfClasses; ++i) {
+        tp_class* taskClass = &threadPool->classes[i];
+        if ((taskClass->queue = osCreateQueue()) == NULL) {
+            fprintf(stderr, "Cannot allocate memory for queue.\n");
+            return NULL;
+        }
+        taskClass->weight = 1;
+        taskClass->maxRunning = 0;
+        taskClass->ratePerSec = 0;
+        taskClass->burst = 0;
+        taskClass->tokens = 0;
+        taskClass->refillNs = 0;
+        taskClass->deficit = 0;
+        taskClass->estimatedCostNs = TP_CLASS_QUANTUM_NS / 100;
+        taskClass->stats.submitted = 0;
+        taskClass->stats.completed = 0;
+        taskClass->stats.queued = 0;
+        taskClass->stats.running = 0;
+        taskClass->stats.runNs = 0;
+    }
+    threadPool->numOfClasses = config->numOfClasses;
+    threadPool->currentClass = 0;
+    threadPool->numOfQueuedTasks = 0;
+    threadPool->numOfRateLimitedClasses = 0;
+    threadPool->timerWorker = NULL;
+    threadPool->timerDeadlineNs = 0;
+
+    /* Initialize the mutex. */
+    pthread_mutex_init(threadPool->mutexEmptyQ, NULL);
+    pthread_mutex_init(threadPool->mutexFiberCache, NULL);
+    threadPool->fiberCache = NULL;
+    threadPool->numOfCachedFibers = 0;
+    threadPool->fibers = NULL;
+    threadPool->reactor = NULL;
+
+    // Save numOfThreads and the configuration to struct.
+    threadPool->numOfThreads = numOfThreads;
+    threadPool->config = *config;
+    threadPool->numOfIdleThreads = 0;
+    threadPool->numOfBusyThreads = 0;
+    threadPool->numOfWorkers = numOfWorkers;
+    threadPool->numOfSpareThreads = 0;
+    threadPool->numOfActiveSpares = 0;
+    threadPool->numOfBlockedThreads = 0;
+    atomic_init(&threadPool->numOfSubmitted, 0);
+    atomic_init(&threadPool->taskHooks, NULL);
+    threadPool->trace = NULL;
+    tpInitLockCounters(&threadPool->emptyQLockCounters);
+    tpInitLockCounters(&threadPool->fiberCacheLockCounters);
+
+    threadPool->isShuttingDown = false;
+    threadPool->shouldWaitForTasks = false;
+
+    /* Initialize the workers before any thread can look at its peers. */
+    for (int i = 0; i < numOfWorkers; ++i) {
+        tp_worker* worker = &threadPool->workers[i];
+        worker->pool = threadPool;
+        worker->index = i;
+        worker->localCount = 0;
+        worker->isIdle = false;
+        worker->context = NULL;
+        worker->blockingDepth = 0;
+        worker->isSpare = i >= numOfThreads;
+        worker->isParked = false;
+        worker->signalNs = 0;
+        atomic_init(&worker->counters.submitted, 0);
+        atomic_init(&worker->counters.completed, 0);
+        atomic_init(&worker->counters.busyNs, 0);
+        atomic_init(&worker->counters.idleNs, 0);
+        atomic_init(&worker->counters.isRunning, false);
+        worker->queueWaitLatency = NULL;
+        worker->runLatency = NULL;
+        worker->trace = NULL;
+        if (config->trackLatency
+            && ((worker->queueWaitLatency = tpHistogramCreate()) == NULL
+                || (worker->runLatency = tpHistogramCreate()) == NULL)) {
+            return NULL;
+        }
+        tpArenaInit(&worker->scratch, 0);
+        if ((worker->mailbox = osCreateQueue()) == NULL) {
+            fprintf(stderr, "Cannot allocate memory for mailbox of worker number %d.\n", i);
+            return NULL;
+        }
+        if ((worker->localQueue = osCreateQueue()) == NULL) {
+            fprintf(stderr, "Cannot allocate memory for queue of worker number %d.\n", i);
+            return NULL;
+        }
+        pthread_condattr_t cvAttr;
+        pthread_condattr_init(&cvAttr);
+        pthread_condattr_setclock(&cvAttr, CLOCK_MONOTONIC);
+        pthread_cond_init(&worker->cv, &cvAttr);
+        pthread_condattr_destroy(&cvAttr);
+    }
+
+    /* The trace buffers must be in place before the first task runs. */
+    if (config->traceEvents > 0 && tpCreateTrace(threadPool) != TP_SUCCESS) {
+        return NULL;
+    }
+
+    /* Create and Start the threadArray, spare threads are started when needed. */
+    for (int i = 0; i < numOfThreads; ++i) {
+        if ((threadPool->threadArray[i] = malloc(sizeof(pthread_t))) == NULL) {
+            fprintf(stderr, "Cannot allocate memory for thread number %d in array.\n", i);
+            return NULL;
+        }
+        pthread_create(threadPool->threadArray[i], NULL, tpRoutine, &threadPool->workers[i]);
+    }
+
+    return threadPool;
+}
+
+/**
+ * Notify pool manager to close the pool.
+ * @param threadPool The Thread Pool to close.
+ * @param shouldWaitForTasks The number of tasks to finish before closing.
+ */
+void tpDestroy(ThreadPool* threadPool, int shouldWaitForTasks) {
+
+    /* Locking the mutex. */
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    /* Do not allow two threads to close the same ThreadPool */
+    if (threadPool->isShuttingDown) {
+        if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+        return;
+    }
+
+    // Setting isShuttingDown to true, so we wont try to use it.
+    threadPool->shouldWaitForTasks = shouldWaitForTasks == 0 ? false : true ;
+    threadPool->isShuttingDown = true;
+    /* No reactor is created from now on, the one there is gets stopped below. */
+    tp_reactor* reactor = threadPool->reactor;
+
+    /* Wake up all threads. */
+    int numOfStartedThreads = threadPool->numOfThreads + threadPool->numOfSpareThreads;
+    for (int i = 0; i < numOfStartedThreads; ++i) {
+        tpSignalWorker(&threadPool->workers[i]);
+    }
+    /* Un-lock mutex. */
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+
+    /* Stop queueing callbacks of ready fds, its inserts fail by now anyway. */
+    tpReactorStop(reactor);
+
+    /* Join threads until all are done, no spare thread is started after shutdown. */
+    for (int i = 0; i < numOfStartedThreads; ++i) {
+
+        if ((pthread_join(*threadPool->threadArray[i], NULL)) != 0) {
+            fprintf(stderr, "Error in system call\n");
+        }
+    }
+
+    tpFreeThreadPool(threadPool);
+}
+
+/***
+ * Add a task to the queue:
+ * Create Task.
+ * Lock Mutex.
+ * Add Task to queue.
+ * Unlock Mutex.
+ * @param threadPool The Thread Pool to do the task.
+ * @param computeFunc The task.
+ * @param param The parameters to the task.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param) {
+
+    return tpInsertTaskForClass(threadPool, 0, computeFunc, param);
+}
+
+/***
+ * Add a task to the queue of a class:
+ * Classes (e.g. tenants) share the workers by weight, see tpSetClassWeight,
+ * so a class flooding the pool does not starve the others.
+ * @param threadPool The Thread Pool to do the task.
+ * @param classId The class of the task, 0 to numOfClasses - 1.
+ * @param computeFunc The task.
+ * @param param The parameters to the task.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertTaskForClass(ThreadPool* threadPool, int classId, void (*computeFunc) (void *), void* param) {
+
+    /*
+     * If Thread Pool is closing down or bad arguments are passed, FAIL.
+     * While the pool is waiting for its tasks, the tasks may still add more, e.g. yielding fibers.
+     */
+    if (threadPool == NULL || computeFunc == NULL || classId < 0 || classId >= threadPool->numOfClasses
+        || tpRejectsInserts(threadPool)) {
+        fprintf(stderr, "Bad arguments for InsertTask or ThreadPool is shutting down.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Create task_node struct. */
+    task_node *taskNode = NULL;
+    if ((taskNode = tnCreate(computeFunc, param)) == NULL) {
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    taskNode->classId = classId;
+    const TPTaskHooks* hooks = atomic_load_explicit(&threadPool->taskHooks, memory_order_acquire);
+    if (hooks != NULL) {
+        tpRunInsertHook(hooks, taskNode);
+    }
+    if (threadPool->config.trackLatency) {
+        taskNode->insertNs = tpNowNs();
+    }
+
+    /* Locking the mutex. */
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Adding to queue. */
+    tp_class* taskClass = &threadPool->classes[classId];
+    if (taskClass->stats.queued == 0 && taskClass->deficit > 0) {
+        taskClass->deficit = 0;
+    }
+    osEnqueue(taskClass->queue, taskNode);
+    taskClass->stats.queued++;
+    taskClass->stats.submitted++;
+    threadPool->numOfQueuedTasks++;
+    tpCountSubmitted(threadPool, 1);
+    if (threadPool->trace != NULL) {
+        tpTraceInsert(threadPool, taskNode);
+    }
+
+    /* Notifying Threads that new task is available. */
+    tpWakeWorker(threadPool, NULL);
+
+    /* Un-locking the mutex. */
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Set the weight of a class:
+ * When the pool is busy, each class with waiting tasks gets run time in
+ * proportion to its weight. All classes start with weight 1.
+ * @param threadPool The Thread Pool.
+ * @param classId The class, 0 to numOfClasses - 1.
+ * @param weight The weight, at least 1.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpSetClassWeight(ThreadPool* threadPool, int classId, int weight) {
+
+    if (threadPool == NULL || classId < 0 || classId >= threadPool->numOfClasses || weight < 1) {
+        fprintf(stderr, "Bad arguments for SetClassWeight.\n");
+        return TP_FAILURE;
+    }
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+    threadPool->classes[classId].weight = weight;
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Limit the number of tasks of a class that run at once:
+ * Tasks over the limit wait in the class queue instead of occupying a worker,
+ * e.g. for a class using a resource that only takes so many users.
+ * @param threadPool The Thread Pool.
+ * @param classId The class, 0 to numOfClasses - 1.
+ * @param maxRunning The most tasks of the class that may run at once, 0 for no limit.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpSetClassConcurrency(ThreadPool* threadPool, int classId, int maxRunning) {
+
+    if (threadPool == NULL || classId < 0 || classId >= threadPool->numOfClasses || maxRunning < 0) {
+        fprintf(stderr, "Bad arguments for SetClassConcurrency.\n");
+        return TP_FAILURE;
+    }
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+    tp_class* taskClass = &threadPool->classes[classId];
+    taskClass->maxRunning = maxRunning;
+
+    /* Raising the limit may let waiting tasks run. */
+    unsigned long long runnable = taskClass->stats.queued;
+    if (maxRunning != 0 && taskClass->stats.running < (unsigned long long) maxRunning
+        && (unsigned long long) maxRunning - taskClass->stats.running < runnable) {
+        runnable = (unsigned long long) maxRunning - taskClass->stats.running;
+    }
+    for (unsigned long long i = 0; i < runnable && threadPool->numOfIdleThreads > 0; ++i) {
+        tpWakeWorker(threadPool, NULL);
+    }
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Limit the rate at which tasks of a class are dispatched, by a token bucket:
+ * The bucket fills with tasksPerSecond tokens per second up to burst, and each
+ * dispatch takes one. Tasks without a token wait in the class queue, and a
+ * single idle worker sleeps until the next token instead of polling.
+ * @param threadPool The Thread Pool.
+ * @param classId The class, 0 to numOfClasses - 1.
+ * @param tasksPerSecond The most tasks dispatched per second, 0 for no limit.
+ * @param burst The most tasks dispatched at once after a quiet period, at least 1.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpSetClassRate(ThreadPool* threadPool, int classId, double tasksPerSecond, int burst) {
+
+    if (threadPool == NULL || classId < 0 || classId >= threadPool->numOfClasses
+        || !(tasksPerSecond >= 0) || burst < 1) {
+        fprintf(stderr, "Bad arguments for SetClassRate.\n");
+        return TP_FAILURE;
+    }
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+    tp_class* taskClass = &threadPool->classes[classId];
+    if (taskClass->ratePerSec == 0 && tasksPerSecond > 0) {
+        threadPool->numOfRateLimitedClasses++;
+    } else if (taskClass->ratePerSec > 0 && tasksPerSecond == 0) {
+        threadPool->numOfRateLimitedClasses--;
+    }
+    taskClass->ratePerSec = tasksPerSecond;
+    taskClass->burst = burst;
+    taskClass->tokens = burst;
+    taskClass->refillNs = tpNowNs();
+
+    /* The class may have tasks that were waiting for tokens. */
+    if (taskClass->stats.queued > 0) {
+        tpWakeWorker(threadPool, NULL);
+    }
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Get a snapshot of the statistics of a class.
+ * @param threadPool The Thread Pool.
+ * @param classId The class, 0 to numOfClasses - 1.
+ * @param stats Where to write the statistics.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpGetClassStats(ThreadPool* threadPool, int classId, TPClassStats* stats) {
+
+    if (threadPool == NULL || classId < 0 || classId >= threadPool->numOfClasses || stats == NULL) {
+        fprintf(stderr, "Bad arguments for GetClassStats.\n");
+        return TP_FAILURE;
+    }
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+    *stats = threadPool->classes[classId].stats;
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TP_FAILURE;
+    }
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Get the statistics of the whole Thread Pool:
+ * Every worker keeps its own counters, they are only summed up here, without
+ * locking, so this is cheap but may be a moment off while tasks run.
+ * The contention on the pool's own mutexes comes with them, see tpLockMutex.
+ * @param threadPool The Thread Pool.
+ * @param stats Where to write the statistics.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpGetStats(ThreadPool* threadPool, TPStats* stats) {
+
+    if (threadPool == NULL || stats == NULL) {
+        fprintf(stderr, "Bad arguments for GetStats.\n");
+        return TP_FAILURE;
+    }
+
+    /* Read what finished before what was inserted, so a task is rarely counted done but not inserted. */
+    stats->completed = 0;
+    stats->running = 0;
+    stats->busyNs = 0;
+    stats->idleNs = 0;
+    stats->submitted = 0;
+    for (int i = 0; i < threadPool->numOfWorkers; ++i) {
+        tp_worker_counters* counters = &threadPool->workers[i].counters;
+        stats->completed += atomic_load_explicit(&counters->completed, memory_order_relaxed);
+        stats->running += atomic_load_explicit(&counters->isRunning, memory_order_relaxed) ? 1 : 0;
+        stats->busyNs += atomic_load_explicit(&counters->busyNs, memory_order_relaxed);
+        stats->idleNs += atomic_load_explicit(&counters->idleNs, memory_order_relaxed);
+    }
+    for (int i = 0; i < threadPool->numOfWorkers; ++i) {
+        stats->submitted += atomic_load_explicit(&threadPool->workers[i].counters.submitted, memory_order_relaxed);
+    }
+    stats->submitted += atomic_load_explicit(&threadPool->numOfSubmitted, memory_order_relaxed);
+
+    unsigned long long started = stats->completed + stats->running;
+    stats->queued = stats->submitted > started ? stats->submitted - started : 0;
+    stats->numOfWorkers = threadPool->numOfWorkers;
+    tpGetLockStats(&threadPool->emptyQLockCounters, &stats->emptyQLock);
+    tpGetLockStats(&threadPool->fiberCacheLockCounters, &stats->fiberCacheLock);
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Get the statistics of one worker, without locking.
+ * @param threadPool The Thread Pool.
+ * @param workerIndex The index of the worker, spare workers included, see tpCurrentWorkerIndex.
+ * @param stats Where to write the statistics.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpGetWorkerStats(ThreadPool* threadPool, int workerIndex, TPWorkerStats* stats) {
+
+    if (threadPool == NULL || workerIndex < 0 || workerIndex >= threadPool->numOfWorkers || stats == NULL) {
+        fprintf(stderr, "Bad arguments for GetWorkerStats.\n");
+        return TP_FAILURE;
+    }
+
+    tp_worker_counters* counters = &threadPool->workers[workerIndex].counters;
+    stats->submitted = atomic_load_explicit(&counters->submitted, memory_order_relaxed);
+    stats->completed = atomic_load_explicit(&counters->completed, memory_order_relaxed);
+    stats->busyNs = atomic_load_explicit(&counters->busyNs, memory_order_relaxed);
+    stats->idleNs = atomic_load_explicit(&counters->idleNs, memory_order_relaxed);
+    stats->isRunning = atomic_load_explicit(&counters->isRunning, memory_order_relaxed);
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Add a task to the queue of the worker its affinity key hashes to:
+ * Tasks submitted with the same key run on the same worker, so the data they
+ * touch stays in that core's caches. Other workers only steal them when the
+ * preferred worker falls behind by TP_AFFINITY_STEAL_THRESHOLD tasks.
+ * @param threadPool The Thread Pool to do the task.
+ * @param affinityKey The key identifying the data the task works on.
+ * @param computeFunc The task.
+ * @param param The parameters to the task.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertTaskWithAffinity(ThreadPool* threadPool, uint64_t affinityKey,
+                             void (*computeFunc) (void *), void* param) {
+
+    /* If Thread Pool is closing down or NULL is passed, FAIL. */
+    if (threadPool == NULL || computeFunc == NULL || tpRejectsInserts(threadPool)) {
+        fprintf(stderr, "Bad arguments for InsertTaskWithAffinity or ThreadPool is shutting down.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Create task_node struct. */
+    task_node *taskNode = NULL;
+    if ((taskNode = tnCreate(computeFunc, param)) == NULL) {
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    const TPTaskHooks* hooks = atomic_load_explicit(&threadPool->taskHooks, memory_order_acquire);
+    if (hooks != NULL) {
+        tpRunInsertHook(hooks, taskNode);
+    }
+    if (threadPool->config.trackLatency) {
+        taskNode->insertNs = tpNowNs();
+    }
+
+    tp_worker* worker = &threadPool->workers[tpWorkerForKey(threadPool, affinityKey)];
+
+    /* Locking the mutex. */
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Adding to the preferred worker's queue. */
+    osEnqueue(worker->localQueue, taskNode);
+    worker->localCount++;
+    tpCountSubmitted(threadPool, 1);
+    if (threadPool->trace != NULL) {
+        tpTraceInsert(threadPool, taskNode);
+    }
+
+    /*
+     * Wake the preferred worker if it sleeps.
+     * If it is busy and backed up, let an idle worker steal instead.
+     */
+    if (worker->isIdle) {
+        tpWakeWorker(threadPool, worker);
+    } else if (worker->localCount >= TP_AFFINITY_STEAL_THRESHOLD) {
+        tpWakeWorker(threadPool, NULL);
+    }
+
+    /* Un-locking the mutex. */
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Add a task to the mailbox of a specific worker:
+ * The task runs on that worker's thread and is never stolen, e.g. to flush
+ * per-worker buffers. Mailbox tasks run before any other task of the worker.
+ * @param threadPool The Thread Pool to do the task.
+ * @param workerIndex The index of the worker to run the task, 0 to numOfThreads - 1.
+ * @param computeFunc The task.
+ * @param param The parameters to the task.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpInsertTaskOn(ThreadPool* threadPool, int workerIndex, void (*computeFunc) (void *), void* param) {
+
+    /* If Thread Pool is closing down or bad arguments are passed, FAIL. */
+    if (threadPool == NULL || computeFunc == NULL || tpRejectsInserts(threadPool)
+        || workerIndex < 0 || workerIndex >= threadPool->numOfThreads) {
+        fprintf(stderr, "Bad arguments for InsertTaskOn or ThreadPool is shutting down.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Create task_node struct. */
+    task_node *taskNode = NULL;
+    if ((taskNode = tnCreate(computeFunc, param)) == NULL) {
+        fprintf(stderr, "Cannot create task to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    const TPTaskHooks* hooks = atomic_load_explicit(&threadPool->taskHooks, memory_order_acquire);
+    if (hooks != NULL) {
+        tpRunInsertHook(hooks, taskNode);
+    }
+    if (threadPool->config.trackLatency) {
+        taskNode->insertNs = tpNowNs();
+    }
+
+    tp_worker* worker = &threadPool->workers[workerIndex];
+
+    /* Locking the mutex. */
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Adding to the worker's mailbox, only this worker can take it. */
+    osEnqueue(worker->mailbox, taskNode);
+    tpCountSubmitted(threadPool, 1);
+    if (threadPool->trace != NULL) {
+        tpTraceInsert(threadPool, taskNode);
+    }
+    if (worker->isIdle) {
+        tpWakeWorker(threadPool, worker);
+    }
+
+    /* Un-locking the mutex. */
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Add the same task to the mailbox of every worker:
+ * Either every worker gets the task or none does.
+ * @param threadPool The Thread Pool to do the task.
+ * @param computeFunc The task, run once on each worker.
+ * @param param The parameters to the task, shared by all workers.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpBroadcastTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param) {
+
+    /* If Thread Pool is closing down or NULL is passed, FAIL. */
+    if (threadPool == NULL || computeFunc == NULL || tpRejectsInserts(threadPool)) {
+        fprintf(stderr, "Bad arguments for BroadcastTask or ThreadPool is shutting down.\n");
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Create all task_node structs up front, so a failure leaves no worker with the task. */
+    task_node** taskNodes = malloc(sizeof(task_node*) * threadPool->numOfThreads);
+    if (taskNodes == NULL) {
+        fprintf(stderr, "Cannot create tasks to insert.\n");
+        return TASK_INSERT_FAILURE;
+    }
+    for (int i = 0; i < threadPool->numOfThreads; ++i) {
+        if ((taskNodes[i] = tnCreate(computeFunc, param)) == NULL) {
+            fprintf(stderr, "Cannot create tasks to insert.\n");
+            while (i-- > 0) {
+                free(taskNodes[i]);
+            }
+            free(taskNodes);
+            return TASK_INSERT_FAILURE;
+        }
+        if (threadPool->config.trackLatency) {
+            taskNodes[i]->insertNs = tpNowNs();
+        }
+    }
+    const TPTaskHooks* hooks = atomic_load_explicit(&threadPool->taskHooks, memory_order_acquire);
+    if (hooks != NULL) {
+        for (int i = 0; i < threadPool->numOfThreads; ++i) {
+            tpRunInsertHook(hooks, taskNodes[i]);
+        }
+    }
+
+    /* Locking the mutex. */
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        for (int i = 0; i < threadPool->numOfThreads; ++i) {
+            free(taskNodes[i]);
+        }
+        free(taskNodes);
+        return TASK_INSERT_FAILURE;
+    }
+
+    /* Adding to every mailbox and waking the sleeping workers. */
+    for (int i = 0; i < threadPool->numOfThreads; ++i) {
+        tp_worker* worker = &threadPool->workers[i];
+        osEnqueue(worker->mailbox, taskNodes[i]);
+        if (threadPool->trace != NULL) {
+            tpTraceInsert(threadPool, taskNodes[i]);
+        }
+        if (worker->isIdle) {
+            tpWakeWorker(threadPool, worker);
+        }
+    }
+    tpCountSubmitted(threadPool, threadPool->numOfThreads);
+
+    /* Un-locking the mutex. */
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+        free(taskNodes);
+        return TASK_INSERT_FAILURE;
+    }
+
+    free(taskNodes);
+    return TASK_INSERT_SUCCESS;
+}
+
+/***
+ * Set the hooks called for every task, e.g. to feed spans to a profiler:
+ * onInsert runs on the inserting thread, onStart and onFinish on the worker,
+ * right around the task, so they may run on many threads at once.
+ * While hooks are set, tasks carry the tag of the thread that inserted them,
+ * see tpSetTaskTag. Without hooks, a task pays for one branch at each point.
+ * A fiber task, see tpInsertFiberTask, is seen once per slice it runs between
+ * yields and suspends, always with its own function and the tag it started with.
+ * @param threadPool The Thread Pool.
+ * @param hooks The hooks, kept until the pool is destroyed, or NULL to remove them.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpSetTaskHooks(ThreadPool* threadPool, const TPTaskHooks* hooks) {
+
+    if (threadPool == NULL) {
+        fprintf(stderr, "Bad arguments for SetTaskHooks.\n");
+        return TP_FAILURE;
+    }
+
+    atomic_store_explicit(&threadPool->taskHooks, hooks, memory_order_release);
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Set the tag of the calling thread, e.g. the id of the request it serves:
+ * Tasks it inserts into a pool with hooks get the tag, and pass it to the hooks.
+ * While such a task runs, the worker has its tag, so the tasks it inserts
+ * inherit it, and the tag follows the request across the pool.
+ * @param tag The tag, NULL for none.
+ */
+void tpSetTaskTag(void* tag) {
+
+    tpCurrentTag = tag;
+}
+
+/***
+ * Get the tag of the calling thread, or of the task it runs, see tpSetTaskTag.
+ * @return The tag, or NULL if none.
+ */
+void* tpGetTaskTag(void) {
+
+    return tpCurrentTag;
+}
+
+/***
+ * Tag a task being inserted and run the insert hook. Called only while hooks are set.
+ * @param hooks The hooks.
+ * @param task The task.
+ */
+void tpRunInsertHook(const TPTaskHooks* hooks, task_node* task) {
+
+    task->tag = tpCurrentTag;
+    if (hooks->onInsert != NULL) {
+        void (*computeFunc)(void *);
+        void* param;
+        tpTaskForHooks(task, &computeFunc, &param);
+        hooks->onInsert(computeFunc, param, task->tag, hooks->hookArg);
+    }
+}
+
+/***
+ * Get the task the hooks are told about: a fiber task runs in slices,
+ * each queued as tpRunFiber, and the hooks see the fiber's own task.
+ * @param task The task.
+ * @param computeFunc Where to write the task's function.
+ * @param param Where to write the task's parameters.
+ */
+void tpTaskForHooks(const task_node* task, void (**computeFunc)(void *), void** param) {
+
+    if (task->computeFunc == tpRunFiber) {
+        TPFiber* fiber = (TPFiber*) task->parameters;
+        *computeFunc = fiber->computeFunc;
+        *param = fiber->parameters;
+    } else {
+        *computeFunc = task->computeFunc;
+        *param = task->parameters;
+    }
+}
+
+/***
+ * Get the index of the worker the calling thread runs as.
+ * Spare workers, see tpBlockingBegin, come after the numOfThreads regular ones.
+ * @return The worker index, 0 to numOfThreads + maxSpareThreads - 1, or -1 if not called from a worker.
+ */
+int tpCurrentWorkerIndex(void) {
+
+    return tpCurrentWorker == NULL ? -1 : tpCurrentWorker->index;
+}
+
+/***
+ * Get the Thread Pool the calling thread is a worker of, e.g. to tell
+ * whether tpCurrentWorkerIndex refers to a worker of a given pool.
+ * @return The Thread Pool, or NULL if not called from a worker.
+ */
+ThreadPool* tpCurrentPool(void) {
+
+    return tpCurrentWorker == NULL ? NULL : tpCurrentWorker->pool;
+}
+
+/***
+ * Get the user context of the worker the calling thread runs as.
+ * Only that worker touches its context, so no locking is needed.
+ * @return The context, or NULL if none was set or not called from a worker.
+ */
+void* tpGetWorkerContext(void) {
+
+    return tpCurrentWorker == NULL ? NULL : tpCurrentWorker->context;
+}
+
+/***
+ * Set the user context of the worker the calling thread runs as.
+ * Usually done once per thread in onWorkerStart, and released in onWorkerStop.
+ * Does nothing if not called from a worker.
+ * @param context The context.
+ */
+void tpSetWorkerContext(void* context) {
+
+    if (tpCurrentWorker != NULL) {
+        tpCurrentWorker->context = context;
+    }
+}
+
+/***
+ * Allocate task scoped scratch memory from the arena of the calling worker.
+ * The memory is released all at once when the running task returns, so it
+ * must not be freed and must not be used after the task is done.
+ * Allocations that do not fit in the arena fall back to malloc, and are
+ * freed at the same time.
+ * @param size The number of bytes to allocate.
+ * @return A pointer to the memory, or NULL if failed or not called from a task.
+ */
+void* tpScratchAlloc(size_t size) {
+
+    if (tpCurrentWorker == NULL) {
+        return NULL;
+    }
+    tp_arena* arena = &tpCurrentWorker->scratch;
+
+    /* Bump the pointer, keeping every allocation aligned. */
+    size_t aligned = (size + TP_SCRATCH_ALIGN - 1) & ~(TP_SCRATCH_ALIGN - 1);
+    if (aligned >= size && aligned <= arena->size - arena->used) {
+        void* memory = arena->base + arena->used;
+        arena->used += aligned;
+        return memory;
+    }
+
+    /* Arena is full, chain a block from the heap. */
+    if (size > SIZE_MAX - sizeof(tp_arena_block)) {
+        return NULL;
+    }
+    tp_arena_block* block = malloc(sizeof(tp_arena_block) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = arena->overflow;
+    arena->overflow = block;
+
+    return block->data;
+}
+
+/***
+ * Create the memory of a Scratch Arena.
+ * If the memory can not be allocated every allocation goes to the heap.
+ * @param arena The arena.
+ * @param size The size of the arena memory.
+ */
+void tpArenaInit(tp_arena* arena, size_t size) {
+
+    arena->base = size == 0 ? NULL : malloc(size);
+    arena->size = arena->base == NULL ? 0 : size;
+    arena->used = 0;
+    arena->overflow = NULL;
+}
+
+/***
+ * Release everything allocated from a Scratch Arena.
+ * @param arena The arena.
+ */
+void tpArenaReset(tp_arena* arena) {
+
+    arena->used = 0;
+
+    /* Only tasks that outgrew the arena leave blocks to free. */
+    while (arena->overflow != NULL) {
+        tp_arena_block* block = arena->overflow;
+        arena->overflow = block->next;
+        free(block);
+    }
+}
+
+/***
+ * Free the memory of a Scratch Arena.
+ * @param arena The arena.
+ */
+void tpArenaDestroy(tp_arena* arena) {
+
+    tpArenaReset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+/***
+ * Mark the start of a blocking call in the running task, e.g. blocking I/O:
+ * While the worker is blocked its core would idle, so the pool brings a
+ * spare worker into service, if one is left, to run tasks in its place. Once the
+ * blocking call is over, see tpBlockingEnd, the spare worker retires right
+ * away if idle, else after its current task, keeping the number of running
+ * workers near numOfThreads. Regions may nest, and are closed when the task
+ * returns. Does nothing if not called from a task.
+ */
+void tpBlockingBegin(void) {
+
+    tp_worker* self = tpCurrentWorker;
+    if (self == NULL || self->blockingDepth++ > 0) {
+        return;
+    }
+    ThreadPool* threadPool = self->pool;
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    threadPool->numOfBlockedThreads++;
+
+    /*
+     * Get a spare in service now: waiting work may be in queues the shared
+     * count misses, e.g. affinity queues, and a spare with nothing to run
+     * waits as an idle worker, first in line for the next insert.
+     */
+    if (threadPool->numOfBlockedThreads > threadPool->numOfActiveSpares) {
+        tpActivateSpare(threadPool);
+    }
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Mark the end of a blocking call started by tpBlockingBegin.
+ * Does nothing if not called from a task.
+ */
+void tpBlockingEnd(void) {
+
+    tp_worker* self = tpCurrentWorker;
+    if (self == NULL || self->blockingDepth == 0 || --self->blockingDepth > 0) {
+        return;
+    }
+    ThreadPool* threadPool = self->pool;
+
+    if (tpLockMutex(threadPool->mutexEmptyQ, &threadPool->emptyQLockCounters) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+    threadPool->numOfBlockedThreads--;
+
+    /* A spare waiting for a task retires now, a busy one after its task. */
+    if (threadPool->numOfActiveSpares > threadPool->numOfBlockedThreads) {
+        for (int i = threadPool->numOfThreads; i < threadPool->numOfThreads + threadPool->numOfSpareThreads; ++i) {
+            tp_worker* worker = &threadPool->workers[i];
+            if (worker->isIdle) {
+                worker->isIdle = false;
+                threadPool->numOfIdleThreads--;
+                tpSignalWorker(worker);
+                break;
+            }
+        }
+    }
+    if (pthread_mutex_unlock(threadPool->mutexEmptyQ) != 0) {
+        fprintf(stderr, "Error in system call\n");
+    }
+}
+
+/***
+ * Create a new TaskNode.
+ * @param computeFunc The task.
+ * @param param The parameters.
+ * @return A pointer to the new TaskNode.
+ */
+task_node* tnCreate(void (*computeFunc) (void *), void* param) {
+
+    /* Allocate space. */
+    task_node* taskNode = (task_node*) malloc(sizeof(task_node));
+    if (taskNode == NULL) {
+        return NULL;
+    }
+
+    /* Initiate struct. */
+    taskNode->computeFunc = computeFunc;
+    taskNode->parameters  = param;
+    taskNode->classId     = TP_NO_CLASS;
+    taskNode->chargedNs   = 0;
+    taskNode->runNs       = 0;
+    taskNode->insertNs    = 0;
+    taskNode->traceId     = 0;
+    taskNode->tag         = NULL;
+
+    return taskNode;
+}
+
+/***
+ * Free all allocated space for Thread Pool.
+ * @param threadPool The Thread Pool to de-allocate space for.
+ */
+void tpFreeThreadPool(ThreadPool *threadPool) {
+
+    if (threadPool == NULL) {
+        return;
+    }
+
+    // Free all tasks and than the queues.
+    for (int i = 0; i < threadPool->numOfClasses; ++i) {
+        while (!osIsQueueEmpty(threadPool->classes[i].queue)) {
+            free(osDequeue(threadPool->classes[i].queue));
+        }
+        osDestroyQueue(threadPool->classes[i].queue);
+    }
+    free(threadPool->classes);
+
+    // Free the workers with their tasks.
+    for (int i = 0; i < threadPool->numOfWorkers; ++i) {
+        tp_worker* worker = &threadPool->workers[i];
+        while (!osIsQueueEmpty(worker->mailbox)) {
+            free(osDequeue(worker->mailbox));
+        }
+        osDestroyQueue(worker->mailbox);
+        while (!osIsQueueEmpty(worker->localQueue)) {
+            free(osDequeue(worker->localQueue));
+        }
+        osDestroyQueue(worker->localQueue);
+        pthread_cond_destroy(&worker->cv);
+        tpHistogramDestroy(worker->queueWaitLatency);
+        tpHistogramDestroy(worker->runLatency);
+    }
+    free(threadPool->workers);
+
+    // Destroy and free mutex.
+    pthread_mutex_destroy(threadPool->mutexEmptyQ);
+    free(threadPool->mutexEmptyQ);
+
+    // Free the reactor.
+    tpFreeReactor(threadPool);
+
+    // Free the trace buffers.
+    tpFreeTrace(threadPool);
+
+    // Free the fibers, cached or never resumed, and their mutex.
+    tpFreeFiberCache(threadPool);
+    pthread_mutex_destroy(threadPool->mutexFiberCache);
+    free(threadPool->mutexFiberCache);
+
+    // Free Thread in array and than free the Array.
+    for (int i = 0; i < threadPool->numOfWorkers; ++i) {
         if (threadPool->threadArray[i] != NULL) {
             free(threadPool->threadArray[i]);
         }
@@ -3,39 +3,306 @@
 
 #include "osqueue.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #define TASK_INSERT_FAILURE -1
 #define TASK_INSERT_SUCCESS 0
 
+#define TP_FAILURE -1
+#define TP_SUCCESS 0
+
+/* Tasks that bypass the class scheduler: mailbox and affinity tasks. */
+#define TP_NO_CLASS -1
+
+/* The default number of task classes, class 0 gets the tasks of tpInsertTask. */
+#define TP_DEFAULT_NUM_OF_CLASSES 1
+
+/* The run time a class of weight 1 is given per scheduling round, in nanoseconds. */
+#define TP_CLASS_QUANTUM_NS 100000
+
+/* An idle worker only steals from another worker's affinity queue once it holds this many tasks. */
+#define TP_AFFINITY_STEAL_THRESHOLD 2
+
+/* The default size of each worker's scratch arena, see tpScratchAlloc. */
+#define TP_DEFAULT_SCRATCH_SIZE (64 * 1024)
+
+/// Scratch Arena struct.
+
+typedef struct tp_arena
+{
+    char* base;                  /* The arena memory, allocated by the worker thread itself. */
+    size_t size;                 /* The size of the arena memory. */
+    size_t used;                 /* The bump pointer, as an offset into base. */
+    struct tp_arena_block* overflow; /* Allocations that did not fit, freed on reset. */
+
+}tp_arena;
+
+/// Task Class Statistics struct.
+
+typedef struct tp_class_stats
+{
+    unsigned long long submitted; /* The number of tasks inserted for the class. */
+    unsigned long long completed; /* The number of tasks of the class that finished running. */
+    unsigned long long queued;    /* The number of tasks of the class waiting to run. */
+    unsigned long long running;   /* The number of tasks of the class running now. */
+    unsigned long long runNs;     /* The total run time of the class's tasks, in nanoseconds. */
+
+}TPClassStats;
+
+/// Worker Statistics struct.
+
+typedef struct tp_worker_stats
+{
+    unsigned long long submitted; /* The number of tasks inserted from the worker's thread. */
+    unsigned long long completed; /* The number of tasks the worker finished running. */
+    unsigned long long busyNs;    /* The time the worker spent running tasks, in nanoseconds. */
+    unsigned long long idleNs;    /* The time the worker spent waiting for tasks, in nanoseconds. */
+    bool isRunning;              /* Is the worker running a task now? */
+
+}TPWorkerStats;
+
+/// Lock Statistics struct.
+
+typedef struct tp_lock_stats
+{
+    unsigned long long acquisitions; /* The number of times the lock was taken, condition variable wakeups included. */
+    unsigned long long contended; /* How many of them found it held and had to wait, wakeups not included. */
+    unsigned long long waitNs;    /* The time contended acquisitions spent waiting for it, in nanoseconds. */
+    unsigned long long condWaits; /* The number of condition variable waits with the lock. */
+    unsigned long long wakeupNs;  /* The time from signal to wakeup of signalled waits, mostly scheduling, in nanoseconds. */
+    unsigned long long spuriousWakeups; /* How many of them woke up with nothing to do. */
+
+}TPLockStats;
+
+/// Lock Counters struct.
+
+typedef struct tp_lock_counters
+{
+    /* Only written with the lock held, so they are updated with plain loads and stores. */
+    atomic_ullong acquisitions;  /* See TPLockStats. */
+    atomic_ullong contended;
+    atomic_ullong waitNs;
+    atomic_ullong condWaits;
+    atomic_ullong wakeupNs;
+    atomic_ullong spuriousWakeups;
+
+}tp_lock_counters;
+
+/// Pool Statistics struct.
+
+typedef struct tp_stats
+{
+    unsigned long long submitted; /* The number of tasks inserted into the pool. */
+    unsigned long long completed; /* The number of tasks that finished running. */
+    unsigned long long queued;    /* The number of tasks waiting to run. */
+    unsigned long long running;   /* The number of tasks running now. */
+    unsigned long long busyNs;    /* The time all workers spent running tasks, in nanoseconds. */
+    unsigned long long idleNs;    /* The time all workers spent waiting for tasks, in nanoseconds. */
+    int numOfWorkers;            /* The number of workers summed up, spare workers included. */
+    TPLockStats emptyQLock;      /* The contention on the lock of the task queues. */
+    TPLockStats fiberCacheLock;  /* The contention on the lock of the fiber cache. */
+
+}TPStats;
+
+/// Worker Counters struct.
+
+typedef struct tp_worker_counters
+{
+    /* Only the owning worker writes these, so they are updated with plain loads and stores. */
+    atomic_ullong submitted;     /* See TPWorkerStats. */
+    atomic_ullong completed;
+    atomic_ullong busyNs;
+    atomic_ullong idleNs;
+    atomic_bool isRunning;
+
+}tp_worker_counters;
+
+/// Task Class struct.
+
+typedef struct tp_class
+{
+    struct os_queue* queue;      /* The tasks of this class waiting to run. */
+    int weight;                  /* The share of the pool this class gets, relative to the others. */
+    int maxRunning;              /* The most tasks of this class that may run at once, 0 for no limit. */
+    double ratePerSec;           /* The most tasks of this class dispatched per second, 0 for no limit. */
+    double burst;                /* The most tokens the class's bucket holds. */
+    double tokens;               /* The tokens in the class's bucket, one is taken per dispatch. */
+    uint64_t refillNs;           /* When the bucket was last refilled. */
+    int64_t deficit;             /* The run time left to the class in this round, in nanoseconds. */
+    int64_t estimatedCostNs;     /* Moving average of the run time of the class's tasks. */
+    TPClassStats stats;          /* The statistics of this class, see tpGetClassStats. */
+
+}tp_class;
+
+/// Worker struct.
+
+typedef struct tp_worker
+{
+    struct thread_pool* pool;    /* The Thread Pool this worker belongs to. */
+    pthread_cond_t cv;           /* Signalled when this worker has something to do. */
+    struct os_queue* mailbox;    /* Tasks that must run on this worker, never stolen. */
+    struct os_queue* localQueue; /* Tasks routed to this worker by affinity key. */
+    int localCount;              /* The number of tasks in localQueue. */
+    int index;                   /* The index of this worker in the threadArray. */
+    bool isIdle;                 /* Is this worker waiting for a wakeup? */
+    void* context;               /* User context of this worker, see tpSetWorkerContext. */
+    tp_arena scratch;            /* Task scoped memory, reset after every task. */
+    int blockingDepth;           /* How deep the running task is in tpBlockingBegin regions. */
+    bool isSpare;                /* Does this worker only run while others are blocked? */
+    bool isParked;               /* Is this spare worker retired until it is needed again? */
+    uint64_t signalNs;           /* When the worker was signalled, 0 once it woke up, under mutexEmptyQ. */
+    struct tp_histogram* queueWaitLatency; /* The time tasks waited to run, NULL if not tracked. */
+    struct tp_histogram* runLatency; /* The time tasks took to run, NULL if not tracked. */
+    struct tp_trace_buffer* trace; /* The trace events of this worker, NULL if not traced. */
+    /* On a cache line of its own, so updating it never invalidates a peer's. */
+    _Alignas(64) tp_worker_counters counters;
+
+}tp_worker;
+
+/// Task Hooks struct.
+
+typedef struct tp_task_hooks
+{
+    /* Each is given the task, its parameters, its tag (see tpSetTaskTag) and hookArg; any may be NULL. */
+    void (*onInsert)(void (*computeFunc)(void *), void* param, void* tag, void* hookArg); /* Before the task is queued. */
+    void (*onStart)(void (*computeFunc)(void *), void* param, void* tag, void* hookArg);  /* On the worker, before the task. */
+    void (*onFinish)(void (*computeFunc)(void *), void* param, void* tag, void* hookArg); /* On the worker, after the task. */
+    void* hookArg;               /* Passed to the hooks. */
+
+}TPTaskHooks;
+
+/// Thread Pool configuration struct.
+
+typedef struct thread_pool_config
+{
+    int numOfThreads;            /* The number of threads in the pool. */
+    /* Run on every worker thread before its first task, e.g. to tpSetWorkerContext. */
+    void (*onWorkerStart)(struct thread_pool* threadPool, int workerIndex, void* hookArg);
+    /* Run on every worker thread after its last task, e.g. to free its context. */
+    void (*onWorkerStop)(struct thread_pool* threadPool, int workerIndex, void* hookArg);
+    void* hookArg;               /* Passed to onWorkerStart and onWorkerStop. */
+    size_t scratchSize;          /* The size of each worker's scratch arena, 0 for none. */
+    int numOfClasses;            /* The number of task classes (tenants) sharing the pool. */
+    int maxSpareThreads;         /* The most extra threads started to cover for blocked workers. */
+    size_t fiberStackSize;       /* The stack size of fiber tasks, see tpInsertFiberTask. */
+    bool trackLatency;           /* Should tasks be timestamped for latency histograms, see tpGetLatency? */
+    size_t traceEvents;          /* The events each thread keeps for tpTraceDump, 0 for no tracing. */
+
+}ThreadPoolConfig;
+
 /// Thread Pool struct.
 
 typedef struct thread_pool
 {
     pthread_t** threadArray;     /* An array of thread pointers. */
+    tp_worker* workers;          /* Per-thread state, parallel to threadArray, spare workers last. */
     pthread_mutex_t* mutexEmptyQ;/* The mutex to check for empty queue. */
-    pthread_cond_t* cv;          /* The cond for the mutex. */
-    struct os_queue* taskQueue;  /* The tasks queue. */
-    bool isShuttingDown;         /* Is the thread threadArray being shutdown? */
-    bool shouldWaitForTasks;      /* Should we wait for tasks in queue when shutting down? */
+    tp_class* classes;           /* The tasks queues, one per class. */
+    int numOfClasses;            /* The number of classes. */
+    int currentClass;            /* The class the round robin scheduler serves now. */
+    int numOfQueuedTasks;        /* The number of tasks waiting in all class queues. */
+    int numOfRateLimitedClasses; /* The number of classes with a token bucket. */
+    tp_worker* timerWorker;      /* The idle worker that wakes up when a rate limited class gets a token. */
+    uint64_t timerDeadlineNs;    /* When timerWorker wakes up. */
+    /* Written under mutexEmptyQ, atomic since inserts check them before locking. */
+    atomic_bool isShuttingDown;  /* Is the thread threadArray being shutdown? */
+    atomic_bool shouldWaitForTasks; /* Should we wait for tasks in queue when shutting down? */
     int numOfThreads;            /* The number of threads in the threadArray. */
+    int numOfIdleThreads;        /* The number of workers waiting for a wakeup. */
+    int numOfBusyThreads;        /* The number of workers between taking a task and accounting for it. */
+    int numOfWorkers;            /* The size of threadArray and workers, numOfThreads + maxSpareThreads. */
+    int numOfSpareThreads;       /* The number of spare threads started so far. */
+    int numOfActiveSpares;       /* The number of spare workers that are not parked. */
+    int numOfBlockedThreads;     /* The number of workers in a blocking region. */
+    pthread_mutex_t* mutexFiberCache; /* The mutex for fiberCache and fibers. */
+    struct tp_fiber* fiberCache; /* Finished fibers, kept to reuse their stacks. */
+    int numOfCachedFibers;       /* The number of fibers in fiberCache. */
+    struct tp_fiber* fibers;     /* Every fiber with a stack, cached, running or suspended. */
+    struct tp_reactor* reactor;  /* The epoll reactor, created by the first tpReactorAdd. */
+    ThreadPoolConfig config;     /* The configuration the pool was created with. */
+    atomic_ullong numOfSubmitted;/* The tasks inserted from outside the workers, updated under mutexEmptyQ. */
+    struct tp_trace* trace;      /* The trace buffers, NULL if not traced. */
+    tp_lock_counters emptyQLockCounters; /* The contention on mutexEmptyQ, see tpLockMutex. */
+    tp_lock_counters fiberCacheLockCounters; /* The contention on mutexFiberCache. */
+    _Atomic(const TPTaskHooks*) taskHooks; /* The task hooks, NULL for none, see tpSetTaskHooks. */
 
 }ThreadPool;
 
+void tpConfigInit(ThreadPoolConfig* config, int numOfThreads);
+
 ThreadPool* tpCreate(int numOfThreads);
 
+ThreadPool* tpCreateWithConfig(const ThreadPoolConfig* config);
+
 void tpDestroy(ThreadPool* threadPool, int shouldWaitForTasks);
 
 int tpInsertTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param);
 
+int tpInsertTaskForClass(ThreadPool* threadPool, int classId, void (*computeFunc) (void *), void* param);
+
+int tpSetClassWeight(ThreadPool* threadPool, int classId, int weight);
+
+int tpSetClassConcurrency(ThreadPool* threadPool, int classId, int maxRunning);
+
+int tpSetClassRate(ThreadPool* threadPool, int classId, double tasksPerSecond, int burst);
+
+int tpGetClassStats(ThreadPool* threadPool, int classId, TPClassStats* stats);
+
+int tpGetStats(ThreadPool* threadPool, TPStats* stats);
+
+int tpGetWorkerStats(ThreadPool* threadPool, int workerIndex, TPWorkerStats* stats);
+
+int tpInsertTaskWithAffinity(ThreadPool* threadPool, uint64_t affinityKey,
+                             void (*computeFunc) (void *), void* param);
+
+int tpInsertTaskOn(ThreadPool* threadPool, int workerIndex, void (*computeFunc) (void *), void* param);
+
+int tpBroadcastTask(ThreadPool* threadPool, void (*computeFunc) (void *), void* param);
+
+int tpSetTaskHooks(ThreadPool* threadPool, const TPTaskHooks* hooks);
+
+void tpSetTaskTag(void* tag);
+
+void* tpGetTaskTag(void);
+
+int tpCurrentWorkerIndex(void);
+
+ThreadPool* tpCurrentPool(void);
+
+void* tpGetWorkerContext(void);
+
+void tpSetWorkerContext(void* context);
+
+void* tpScratchAlloc(size_t size);
+
+void tpBlockingBegin(void);
+
+void tpBlockingEnd(void);
+
+uint64_t tpNowNs(void);
+
+void tpCounterAdd(atomic_ullong* counter, unsigned long long value);
+
+int tpLockMutex(pthread_mutex_t* mutex, tp_lock_counters* counters);
+
+bool tpRejectsInserts(ThreadPool* threadPool);
+
 /// Task Node struct.
 
 typedef struct task_node {
 
     void (*computeFunc)(void *);
     void* parameters;
+    int classId;                 /* The class the task was inserted for, or TP_NO_CLASS. */
+    int64_t chargedNs;           /* The run time charged to the class when dispatched. */
+    uint64_t runNs;              /* The time it took to run the task. */
+    uint64_t insertNs;           /* When the task was inserted, 0 if latency is not tracked. */
+    uint64_t traceId;            /* Ties the task's trace events together, 0 if not traced. */
+    void* tag;                   /* The tag of the thread that inserted the task, if hooks are set. */
 
 }task_node;
 
@@ -0,0 +1,215 @@
+#include "trace.h"
+#include <unistd.h>
+
+void tpTraceWriteEvent(FILE* out, const tp_trace_event* event, uint64_t startNs, int pid, int tid);
+
+/***
+ * Create the trace buffers of a Thread Pool created with config.traceEvents set:
+ * Every worker writes the inserts, begins and ends of tasks to a ring buffer
+ * of its own, without locking; inserts from outside the workers go to one more
+ * buffer, under mutexEmptyQ. When full, a buffer overwrites its oldest events,
+ * so a dump shows the last traceEvents events of each thread.
+ * @param threadPool The Thread Pool.
+ * @return -1 if failed, 0 if worked.
+ */
+int tpCreateTrace(ThreadPool* threadPool) {
+
+    size_t size = 2;
+    while (size < threadPool->config.traceEvents) {
+        size *= 2;
+    }
+
+    tp_trace* trace = malloc(sizeof(tp_trace));
+    if (trace == NULL) {
+        fprintf(stderr, "Cannot allocate memory for trace.\n");
+        return TP_FAILURE;
+    }
+    trace->numOfBuffers = threadPool->numOfWorkers + 1;
+    trace->buffers = aligned_alloc(64, sizeof(tp_trace_buffer) * trace->numOfBuffers);
+    if (trace->buffers == NULL) {
+        fprintf(stderr, "Cannot allocate memory for trace buffers.\n");
+        free(trace);
+        return TP_FAILURE;
+    }
+    for (int i = 0; i < trace->numOfBuffers; ++i) {
+        tp_trace_buffer* buffer = &trace->buffers[i];
+        buffer->trace = trace;
+        buffer->mask = size - 1;
+        atomic_init(&buffer->numOfEvents, 0);
+        if ((buffer->events = malloc(sizeof(tp_trace_event) * size)) == NULL) {
+            fprintf(stderr, "Cannot allocate memory for trace events.\n");
+            while (i-- > 0) {
+                free(trace->buffers[i].events);
+            }
+            free(trace->buffers);
+            free(trace);
+            return TP_FAILURE;
+        }
+    }
+    atomic_init(&trace->isEnabled, true);
+    trace->startNs = tpNowNs();
+    trace->nextTaskId = 1;
+
+    for (int i = 0; i < threadPool->numOfWorkers; ++i) {
+        threadPool->workers[i].trace = &trace->buffers[i];
+    }
+    threadPool->trace = trace;
+
+    return TP_SUCCESS;
+}
+
+/***
+ * Free the trace buffers of a Thread Pool, if it has any.
+ * @param threadPool The Thread Pool.
+ */
+void tpFreeTrace(ThreadPool* threadPool) {
+
+    tp_trace* trace = threadPool->trace;
+    if (trace == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < trace->numOfBuffers; ++i) {
+        free(trace->buffers[i].events);
+    }
+    free(trace->buffers);
+    free(trace);
+    threadPool->trace = NULL;
+}
+
+/***
+ * Write an event to a trace buffer, unless tracing is disabled.
+ * Only one thread at a time may write to a buffer.
+ * @param buffer The trace buffer.
+ * @param type TP_TRACE_INSERT, TP_TRACE_BEGIN or TP_TRACE_END.
+ * @param timeNs When the event happened.
+ * @param task The task.
+ */
+void tpTraceRecord(tp_trace_buffer* buffer, int type, uint64_t timeNs, task_node* task) {
+
+    if (!atomic_load_explicit(&buffer->trace->isEnabled, memory_order_relaxed)) {
+        return;
+    }
+
+    unsigned long long position = atomic_load_explicit(&buffer->numOfEvents, memory_order_relaxed);
+    tp_trace_event* event = &buffer->events[position & buffer->mask];
+    event->timeNs = timeNs;
+    event->computeFunc = task->computeFunc;
+    event->taskId = task->traceId;
+    event->type = type;
+    atomic_store_explicit(&buffer->numOfEvents, position + 1, memory_order_release);
+}
+
+/***
+ * Start or stop recording trace events, e.g. to trace only one batch of tasks.
+ * Tracing is enabled when the Thread Pool is created.
+ * @param threadPool The Thread Pool, created with config.traceEvents set.
+ * @param isEnabled Should events be recorded?
+ */
+void tpTraceEnable(ThreadPool* threadPool, bool isEnabled) {
+
+    if (threadPool == NULL || threadPool->trace == NULL) {
+        fprintf(stderr, "Bad arguments for TraceEnable or the ThreadPool is not traced.\n");
+        return;
+    }
+
+    atomic_store(&threadPool->trace->isEnabled, isEnabled);
+}
+
+/***
+ * Write the trace of a Thread Pool as Chrome trace-event JSON:
+ * Open the file in a trace viewer (e.g. ui.perfetto.dev or chrome://tracing)
+ * to see the tasks each worker ran on a timeline, with an arrow from where
+ * every task was inserted to where it started.
+ * Dump once the traced tasks are done, or with tracing disabled; events
+ * written meanwhile may overwrite the oldest ones as they are read.
+ * @param threadPool The Thread Pool, created with config.traceEvents set.
+ * @param out Where to write the JSON.
+ * @return The number of events written, or -1 if failed.
+ */
+long tpTraceDump(ThreadPool* threadPool, FILE* out) {
+
+    if (threadPool == NULL || threadPool->trace == NULL || out == NULL) {
+        fprintf(stderr, "Bad arguments for TraceDump or the ThreadPool is not traced.\n");
+        return TP_FAILURE;
+    }
+
+    tp_trace* trace = threadPool->trace;
+    int pid = (int) getpid();
+    long numOfEvents = 0;
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    for (int i = 0; i < trace->numOfBuffers; ++i) {
+        tp_trace_buffer* buffer = &trace->buffers[i];
+
+        /* Name the thread's track. */
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                i == 0 ? "" : ",\n", pid, i);
+        if (i == threadPool->numOfWorkers) {
+            fprintf(out, "outside the pool\"}}");
+        } else {
+            fprintf(out, "%s %d\"}}", threadPool->workers[i].isSpare ? "spare worker" : "worker", i);
+        }
+
+        /* The ring holds the last mask + 1 events, the task running when it wrapped lost its begin. */
+        unsigned long long end = atomic_load_explicit(&buffer->numOfEvents, memory_order_acquire);
+        unsigned long long position = end > buffer->mask + 1 ? end - (buffer->mask + 1) : 0;
+        bool isRunning = false;
+        for (; position < end; ++position) {
+            tp_trace_event event = buffer->events[position & buffer->mask];
+            if (event.type == TP_TRACE_END && !isRunning) {
+                continue;
+            }
+            if (event.type != TP_TRACE_INSERT) {
+                isRunning = event.type == TP_TRACE_BEGIN;
+            }
+            tpTraceWriteEvent(out, &event, trace->startNs, pid, i);
+            numOfEvents++;
+        }
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (ferror(out)) {
+        fprintf(stderr, "Cannot write the trace.\n");
+        return TP_FAILURE;
+    }
+
+    return numOfEvents;
+}
+
+/***
+ * Write one event as Chrome trace-event JSON, after the events written before it:
+ * Inserts are instant events starting a flow, begins and ends are a slice
+ * on the worker's track, and the begin ends the flow of its insert.
+ * @param out Where to write the JSON.
+ * @param event The event.
+ * @param startNs When the trace started.
+ * @param pid The process id.
+ * @param tid The index of the thread's track.
+ */
+void tpTraceWriteEvent(FILE* out, const tp_trace_event* event, uint64_t startNs, int pid, int tid) {
+
+    double timeUs = (double) (event->timeNs - startNs) / 1000.0;
+
+    switch (event->type) {
+        case TP_TRACE_INSERT:
+            fprintf(out, ",\n{\"name\":\"insert\",\"cat\":\"task\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"func\":\"%p\",\"task\":%llu}}",
+                    timeUs, pid, tid, (void*) event->computeFunc, (unsigned long long) event->taskId);
+            fprintf(out, ",\n{\"name\":\"task\",\"cat\":\"flow\",\"ph\":\"s\",\"id\":%llu,\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d}",
+                    (unsigned long long) event->taskId, timeUs, pid, tid);
+            break;
+        case TP_TRACE_BEGIN:
+            fprintf(out, ",\n{\"name\":\"%p\",\"cat\":\"task\",\"ph\":\"B\",\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"task\":%llu}}",
+                    (void*) event->computeFunc, timeUs, pid, tid, (unsigned long long) event->taskId);
+            fprintf(out, ",\n{\"name\":\"task\",\"cat\":\"flow\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%llu,"
+                    "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    (unsigned long long) event->taskId, timeUs, pid, tid);
+            break;
+        default:
+            fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", timeUs, pid, tid);
+            break;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __TRACE__
+#define __TRACE__
+
+#include "threadPool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* The trace events. */
+#define TP_TRACE_INSERT 0
+#define TP_TRACE_BEGIN 1
+#define TP_TRACE_END 2
+
+/// Trace Event struct.
+
+typedef struct tp_trace_event
+{
+    uint64_t timeNs;             /* When the event happened, on the monotonic clock. */
+    void (*computeFunc)(void *); /* The task. */
+    uint64_t taskId;             /* Ties the insert of a task to its run. */
+    int type;                    /* TP_TRACE_INSERT, TP_TRACE_BEGIN or TP_TRACE_END. */
+
+}tp_trace_event;
+
+/// Trace Buffer struct.
+
+typedef struct tp_trace_buffer
+{
+    /* On cache lines of their own, each buffer is written by one thread at a time. */
+    _Alignas(64) struct tp_trace* trace; /* The trace the buffer belongs to. */
+    tp_trace_event* events;      /* The ring of events, the oldest are overwritten. */
+    size_t mask;                 /* The size of events, a power of two, minus one. */
+    atomic_ullong numOfEvents;   /* The number of events ever written. */
+
+}tp_trace_buffer;
+
+/// Trace struct.
+
+typedef struct tp_trace
+{
+    atomic_bool isEnabled;       /* Are events recorded? See tpTraceEnable. */
+    uint64_t startNs;            /* When the trace started, the timeline starts there. */
+    uint64_t nextTaskId;         /* The id of the next task inserted, under mutexEmptyQ. */
+    tp_trace_buffer* buffers;    /* One per worker, then one for inserts from outside the workers. */
+    int numOfBuffers;            /* The size of buffers. */
+
+}tp_trace;
+
+int tpCreateTrace(ThreadPool* threadPool);
+
+void tpFreeTrace(ThreadPool* threadPool);
+
+void tpTraceRecord(tp_trace_buffer* buffer, int type, uint64_t timeNs, task_node* task);
+
+void tpTraceEnable(ThreadPool* threadPool, bool isEnabled);
+
+long tpTraceDump(ThreadPool* threadPool, FILE* out);
+
+#endif